@@ -0,0 +1,930 @@
+/*
+ * @ttts-bench.c
+ * Load generator for the TicTacToe server
+ * Plays thousands of concurrent protocol 0x06 games against a ttts server, over TCP or its --udp-port,
+ * and reports games/s, moves/s and reply latency percentiles.
+ * With --upgrade it hot upgrades the server halfway through and exits with a failure if any game stalled or dropped.
+ * With --pipeline it sends every frame several times over in one write, and fails the same way if a reply goes missing.
+ * With --failover it replays a discovery storm instead, and reports how long every orphaned client waits for an offer.
+ */
+
+const unsigned char VERSION = 0x06;
+
+const unsigned char NEWGAME = 0x00;
+const unsigned char MOVE = 0x01;
+const unsigned char GAMEOVER = 0x02;
+const unsigned char RESUME = 0x03;
+const unsigned char SERVER_FULL = 0xFF; //position of the GAMEOVER a server with no free game sends before closing
+
+const int DEFAULT_THREADS = 4;
+const int DEFAULT_CONNECTIONS = 1000;
+const int DEFAULT_DURATION = 10;
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <signal.h>
+
+#define MC_PORT 1818
+#define MC_GROUP "239.0.0.1"
+#define ROWS  3
+#define COLUMNS  3
+#define FULL_BOARD ((1 << (ROWS * COLUMNS)) - 1)
+#define MESSAGE_SIZE 5
+#define MAX_EVENTS 256
+#define MAX_THREADS 64
+#define RETRY_DELAY_NS 10000000 //wait before reconnecting after the server turned a connection away
+#define UDP_RESEND_NS 200000000 //with --udp, a frame without a reply after this long is sent again
+#define LOOP_TIMEOUT_MS 10
+#define STORM_INTERVAL_NS 10000000 //storm bursts are spread over 100 intervals per second
+#define STALL_NS 1000000000ull //with --upgrade, a reply this late was lost in the hand over and only came with a resend
+#define MAX_PIPELINE 51 //frames the server buffers per game, its GAME_BUFFER_SIZE of 256 over MESSAGE_SIZE
+#define FAILOVER_RESEND_NS 100000000 //with --failover, a client without an offer after this long multicasts again
+#define FAILOVER_TIMEOUT_NS 10000000000ull //with --failover, clients still without an offer after this are given up on
+#define METRICS_SIZE 65536 //room for the server's whole stats response
+#define LATENCY_SUB_BUCKET_BITS 3 //same buckets as the server's stats, 12.5% precision
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS)
+
+/**
+ * One simulated client. The client is always O, the server X.
+ */
+struct connection{
+    int socket; //-1 while waiting to reconnect
+    uint16_t x;
+    uint16_t o;
+    unsigned char id; //game id the server gave us
+    unsigned char seqNum; //last sequence number received
+    int isInProgress; //a NEWGAME or RESUME has been answered on this game
+    unsigned char buffer[MESSAGE_SIZE];
+    int buffered;
+    uint64_t sentAt; //when the frame being answered went out
+    unsigned char lastFrame[MESSAGE_SIZE + ROWS*COLUMNS]; //what went out then, for --udp resends
+    int lastLength;
+    int repeatsDue; //--pipeline copies of our last frame the server has yet to answer
+    unsigned char heldMove[MESSAGE_SIZE]; //our next MOVE, held back until every copy of the last frame is answered
+    int isMoveHeld;
+    uint64_t retryAt; //when to reconnect, 0 if connected
+};
+
+/**
+ * Counters and latency histogram of one worker thread, only that thread writes them.
+ */
+struct results{
+    uint64_t games;
+    uint64_t moves;
+    uint64_t resumes;
+    uint64_t rejected;
+    uint64_t disconnects;
+    uint64_t resends; //--udp only
+    uint64_t repeats; //--pipeline only, replies to the copies of a frame
+    uint64_t stalls; //replies, and frames still unanswered at the end, that waited longer than STALL_NS
+    uint64_t latencyBuckets[LATENCY_BUCKETS];
+    uint64_t maxLatency;
+};
+
+/**
+ * The server counters --stats-port reads, before and after the run.
+ */
+struct serverMetrics{
+    uint64_t syscalls;
+    uint64_t moves;
+};
+
+/**
+ * A worker thread and the connections it drives from its own epoll instance.
+ */
+struct worker{
+    int index;
+    int epollSD;
+    struct connection *connections;
+    int numConnections;
+    unsigned int seed;
+    struct results results;
+};
+
+static struct sockaddr_in serverAddress;
+//probability that a client drops its connection instead of sending a move, and resumes the game on a new one
+static double dropRate = 0;
+//discovery multicasts sent per second by the storm thread, 0 for none
+static int stormRate = 0;
+//the server's --stats-port, 0 to leave the server's counters alone
+static int statsPort = 0;
+//server to send SIGUSR2 halfway through the run, 0 for none
+static pid_t upgradePid = 0;
+//orphaned clients that multicast a discovery request at the same moment, 0 to play games instead
+static int failoverClients = 0;
+//--failover sockets, and how many of them have sent their first request
+static int *failoverSockets;
+static atomic_int failoverSent;
+//play over datagrams to the server's --udp-port, one socket per game, instead of a TCP connection per game
+static int useUdp = 0;
+//copies of every NEWGAME and MOVE sent in one write, the server answers each copy
+static int pipelineDepth = 1;
+static atomic_uint_fast64_t stormSent;
+static atomic_uint_fast64_t stormOffers;
+static atomic_int isRunning = 1;
+
+//winningMasks[mask] is 1 when the squares in mask contain a full row, column or diagonal
+static unsigned char winningMasks[FULL_BOARD + 1];
+
+/**
+ * Fills winningMasks[], must be called once before any game is played.
+ */
+void initializeWinTable(void);
+/**
+ * @return CLOCK_MONOTONIC time in nanoseconds
+ */
+uint64_t getMonotonicNanos(void);
+/**
+ * @param nanos latency
+ * @return index into results.latencyBuckets, values below 8 get their own bucket, above that every power of two
+ * is split into 8 equal sub-buckets
+ */
+int getLatencyBucket(uint64_t nanos);
+/**
+ * @param bucket index into results.latencyBuckets
+ * @return largest latency in nanoseconds that falls into the bucket
+ */
+uint64_t getLatencyBucketLimit(int bucket);
+/**
+ * Opens a new connection (with --udp a connected datagram socket) for a client and registers it with the worker's epoll instance.
+ * @param worker
+ * @param connection
+ * @return 1 on success, 0 on failure
+ */
+int connectClient(struct worker *worker, struct connection *connection);
+/**
+ * Closes a client's connection, the client reconnects after RETRY_DELAY_NS if delay is set and immediately otherwise.
+ * @param connection
+ * @param delay
+ */
+void disconnectClient(struct connection *connection, int delay);
+/**
+ * Connects a client and sends NEWGAME.
+ * @param worker
+ * @param connection
+ */
+void startGame(struct worker *worker, struct connection *connection);
+/**
+ * Sends a frame and notes when it went out for the latency of its reply, and with --udp for its resend.
+ * @param connection
+ * @param frame
+ * @param length
+ * @return 1 on success, 0 on failure
+ */
+int sendFrame(struct connection *connection, const unsigned char *frame, int length);
+/**
+ * Sends pipelineDepth copies of a NEWGAME or MOVE in one write, like sendFrame() does one frame.
+ * The client then waits for the server's reply to every copy before it sends its next MOVE.
+ * @param connection
+ * @param frame MESSAGE_SIZE bytes
+ * @return 1 on success, 0 on failure
+ */
+int sendPipelinedFrame(struct connection *connection, const unsigned char *frame);
+/**
+ * Acts on a complete message from the server: plays a random move, or acknowledges a finished game and starts the next.
+ * With probability dropRate the move is carried in a RESUME on a fresh connection instead.
+ * @param worker
+ * @param connection
+ */
+void handleServerMessage(struct worker *worker, struct connection *connection);
+/**
+ * Reads whatever the server sent on a client's connection.
+ * @param worker
+ * @param connection
+ */
+void handleClientData(struct worker *worker, struct connection *connection);
+/**
+ * Worker thread, plays its connections' games until isRunning is cleared.
+ * @param arg the struct worker to run
+ * @return NULL
+ */
+void *runWorker(void *arg);
+/**
+ * Storm thread, multicasts stormRate discovery requests per second and counts the offers that come back.
+ * @param arg unused
+ * @return never returns
+ */
+void *runStorm(void *arg);
+/**
+ * Reads ttts_syscalls_total and the MOVE count off the server's stats endpoint, on the --host address.
+ * @param metrics
+ * @return 1 on success, 0 if the endpoint can't be read
+ */
+int readServerMetrics(struct serverMetrics *metrics);
+/**
+ * Replays a failover storm: failoverClients orphaned clients, each on a socket of its own, multicast a discovery
+ * request at the same moment, and multicast it again every FAILOVER_RESEND_NS until an offer comes back.
+ * Prints how long it took from the first request until every client had an offer.
+ */
+void runFailover(void);
+/**
+ * Sends the first request of every --failover client, on a thread of its own so offers are read as they arrive.
+ * @param arg unused
+ * @return NULL
+ */
+void *sendFailoverRequests(void *arg);
+/**
+ * qsort() comparator for uint64_t
+ */
+int compareNanos(const void *a, const void *b);
+/**
+ * Merges every worker's results and prints the totals.
+ * @param workers
+ * @param numWorkers
+ * @param seconds length of the run
+ * @param server what the server counted over the run, NULL without --stats-port
+ */
+void printResults(struct worker *workers, int numWorkers, double seconds, const struct serverMetrics *server);
+int main(int argc, char *argv[]){
+    int numThreads = DEFAULT_THREADS;
+    int numConnections = DEFAULT_CONNECTIONS;
+    int duration = DEFAULT_DURATION;
+    const char *host = "127.0.0.1";
+
+    const struct option longOptions[] = {
+            {"threads", required_argument, NULL, 't'},
+            {"connections", required_argument, NULL, 'c'},
+            {"duration", required_argument, NULL, 'd'},
+            {"drop-rate", required_argument, NULL, 'r'},
+            {"storm", required_argument, NULL, 's'},
+            {"host", required_argument, NULL, 'h'},
+            {"udp", no_argument, NULL, 'u'},
+            {"failover", required_argument, NULL, 'f'},
+            {"stats-port", required_argument, NULL, 'p'},
+            {"upgrade", required_argument, NULL, 'U'},
+            {"pipeline", required_argument, NULL, 'P'},
+            {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "t:c:d:r:s:h:uf:p:U:P:", longOptions, NULL)) != -1){
+        if(opt == 't'){
+            numThreads = strtol(optarg, NULL, 10);
+        }
+        else if(opt == 'c'){
+            numConnections = strtol(optarg, NULL, 10);
+        }
+        else if(opt == 'd'){
+            duration = strtol(optarg, NULL, 10);
+        }
+        else if(opt == 'r'){
+            dropRate = strtod(optarg, NULL);
+            if(dropRate < 0 || dropRate > 1){
+                printf("drop-rate must be the probability of dropping a connection (0-1)\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(opt == 's'){
+            stormRate = strtol(optarg, NULL, 10);
+        }
+        else if(opt == 'h'){
+            host = optarg;
+        }
+        else if(opt == 'u'){
+            useUdp = 1;
+        }
+        else if(opt == 'p'){
+            statsPort = strtol(optarg, NULL, 10);
+            if(statsPort < 1 || statsPort > 65535){
+                printf("stats-port must be between 1 and 65535\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(opt == 'U'){
+            upgradePid = strtol(optarg, NULL, 10);
+            if(upgradePid < 1){
+                printf("upgrade must be the pid of a server started with --upgrade-socket\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(opt == 'P'){
+            pipelineDepth = strtol(optarg, NULL, 10);
+            if(pipelineDepth < 1 || pipelineDepth > MAX_PIPELINE){
+                printf("pipeline must be between 1 and %i frames\n", MAX_PIPELINE);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(opt == 'f'){
+            failoverClients = strtol(optarg, NULL, 10);
+            if(failoverClients < 1){
+                printf("failover must be at least 1 client\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else{
+            optind = argc + 1; //force the usage message
+            break;
+        }
+    }
+    //a failover storm goes to the multicast group, not to a port
+    if(argc - optind != (failoverClients > 0 ? 0 : 1)){
+        printf("usage is: ttts-bench [--threads <n>] [--connections <n>] [--duration <seconds>] [--drop-rate <0-1>]\n"
+               "                      [--storm <multicasts per second>] [--host <address>] [--udp] [--stats-port <port>]\n"
+               "                      [--upgrade <server pid>] [--pipeline <frames>] <port-number>\n"
+               "   or: ttts-bench --failover <clients>\n");
+        exit(EXIT_FAILURE);
+    }
+    if(failoverClients > 0){
+        runFailover();
+        return 0;
+    }
+    if(numThreads < 1 || numThreads > MAX_THREADS){
+        printf("threads must be between 1 and %i\n", MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+    if(numConnections < numThreads || duration < 1){
+        printf("connections must be at least threads and duration at least 1\n");
+        exit(EXIT_FAILURE);
+    }
+    //a datagram holds one frame
+    if(useUdp && pipelineDepth > 1){
+        printf("pipeline only works over TCP\n");
+        exit(EXIT_FAILURE);
+    }
+
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(strtol(argv[optind], NULL, 10));
+    if(inet_pton(AF_INET, host, &serverAddress.sin_addr) != 1){
+        printf("host must be an IPv4 address\n");
+        exit(EXIT_FAILURE);
+    }
+    initializeWinTable();
+
+    struct worker *workers = calloc(numThreads, sizeof(struct worker));
+    pthread_t *threads = calloc(numThreads, sizeof(pthread_t));
+    if(workers == NULL || threads == NULL){
+        perror("main:\tcalloc():");
+        exit(EXIT_FAILURE);
+    }
+    if(stormRate > 0){
+        pthread_t storm;
+        int rc = pthread_create(&storm, NULL, runStorm, NULL);
+        if(rc != 0){
+            printf("main:\tpthread_create(): %s\n", strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(storm);
+    }
+
+    struct serverMetrics before, after;
+    if(statsPort > 0 && !readServerMetrics(&before)){
+        printf("main:\tcan't read the server's stats on port %i\n", statsPort);
+        exit(EXIT_FAILURE);
+    }
+    printf("Playing %i concurrent games over %s on %i thread(s) for %i seconds...\n", numConnections, useUdp ? "UDP" : "TCP",
+           numThreads, duration);
+    uint64_t startedAt = getMonotonicNanos();
+    for(int n = 0; n < numThreads; n++){
+        workers[n].index = n;
+        //spread the remainder over the first workers
+        workers[n].numConnections = numConnections / numThreads + (n < numConnections % numThreads ? 1 : 0);
+        workers[n].seed = time(NULL) ^ (n * 2654435761u);
+        int rc = pthread_create(&threads[n], NULL, runWorker, &workers[n]);
+        if(rc != 0){
+            printf("main:\tpthread_create(): %s\n", strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(upgradePid > 0){
+        //halfway through, with every game well under way
+        usleep(duration * 500000);
+        if(kill(upgradePid, SIGUSR2) != 0){
+            perror("main:\tkill():");
+            exit(EXIT_FAILURE);
+        }
+        usleep(duration * 500000);
+    }
+    else{
+        sleep(duration);
+    }
+    atomic_store(&isRunning, 0);
+    for(int n = 0; n < numThreads; n++)
+        pthread_join(threads[n], NULL);
+    double seconds = (getMonotonicNanos() - startedAt) / 1e9;
+    struct serverMetrics server = {0};
+    if(statsPort > 0 && readServerMetrics(&after)){
+        server.syscalls = after.syscalls - before.syscalls;
+        server.moves = after.moves - before.moves;
+    }
+    printResults(workers, numThreads, seconds, statsPort > 0 ? &server : NULL);
+    if(upgradePid > 0 || pipelineDepth > 1){
+        uint64_t lost = 0;
+        for(int n = 0; n < numThreads; n++)
+            lost += workers[n].results.stalls + workers[n].results.disconnects;
+        return lost == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    return 0;
+}
+
+void *runWorker(void *arg){
+    struct worker *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    worker->epollSD = epoll_create1(0);
+    worker->connections = calloc(worker->numConnections, sizeof(struct connection));
+    if(worker->epollSD == -1 || worker->connections == NULL){
+        perror("runWorker:\tepoll_create1():");
+        exit(EXIT_FAILURE);
+    }
+    for(int n = 0; n < worker->numConnections; n++){
+        worker->connections[n].socket = -1;
+        startGame(worker, &worker->connections[n]);
+    }
+
+    while(atomic_load_explicit(&isRunning, memory_order_relaxed)){
+        int numEvents = epoll_wait(worker->epollSD, events, MAX_EVENTS, LOOP_TIMEOUT_MS);
+        for(int n = 0; n < numEvents; n++)
+            handleClientData(worker, events[n].data.ptr);
+
+        //reconnect clients the server turned away once they have waited long enough
+        uint64_t now = getMonotonicNanos();
+        for(int n = 0; n < worker->numConnections; n++){
+            struct connection *connection = &worker->connections[n];
+            if(connection->retryAt != 0 && connection->retryAt <= now)
+                startGame(worker, connection);
+            //a lost datagram either way is made up for by sending our frame again, the server answers a repeat
+            //with its last reply
+            else if(useUdp && connection->socket != -1 && now - connection->sentAt > UDP_RESEND_NS){
+                worker->results.resends++;
+                sendFrame(connection, connection->lastFrame, connection->lastLength);
+            }
+        }
+    }
+    uint64_t now = getMonotonicNanos();
+    for(int n = 0; n < worker->numConnections; n++){
+        struct connection *connection = &worker->connections[n];
+        if(connection->socket != -1 && now - connection->sentAt > STALL_NS)
+            worker->results.stalls++;
+        disconnectClient(connection, 0);
+    }
+    close(worker->epollSD);
+    return NULL;
+}
+
+int connectClient(struct worker *worker, struct connection *connection){
+    struct epoll_event event;
+    connection->socket = socket(AF_INET, useUdp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if(connection->socket == -1){
+        perror("connectClient:\tsocket():");
+        return 0;
+    }
+    //every frame is a complete message, don't let Nagle hold one back waiting for the reply to the last
+    int noDelay = 1;
+    if(!useUdp)
+        setsockopt(connection->socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    if(connect(connection->socket, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) != 0){
+        perror("connectClient:\tconnect():");
+        close(connection->socket);
+        connection->socket = -1;
+        return 0;
+    }
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if(epoll_ctl(worker->epollSD, EPOLL_CTL_ADD, connection->socket, &event) != 0){
+        perror("connectClient:\tepoll_ctl():");
+        close(connection->socket);
+        connection->socket = -1;
+        return 0;
+    }
+    connection->buffered = 0;
+    connection->retryAt = 0;
+    connection->repeatsDue = 0;
+    connection->isMoveHeld = 0;
+    return 1;
+}
+
+void disconnectClient(struct connection *connection, const int delay){
+    if(connection->socket != -1)
+        close(connection->socket); //also removes it from the epoll set
+    connection->socket = -1;
+    connection->retryAt = delay ? getMonotonicNanos() + RETRY_DELAY_NS : 0;
+}
+
+void startGame(struct worker *worker, struct connection *connection){
+    connection->x = 0;
+    connection->o = 0;
+    connection->isInProgress = 0;
+    if(!connectClient(worker, connection)){
+        disconnectClient(connection, 1);
+        return;
+    }
+    const unsigned char newGame[MESSAGE_SIZE] = {VERSION, NEWGAME, 0, 0, 0};
+    if(!sendPipelinedFrame(connection, newGame))
+        disconnectClient(connection, 1);
+}
+
+int sendFrame(struct connection *connection, const unsigned char *frame, const int length){
+    connection->sentAt = getMonotonicNanos();
+    if(frame != connection->lastFrame)
+        memcpy(connection->lastFrame, frame, length);
+    connection->lastLength = length;
+    return send(connection->socket, frame, length, MSG_NOSIGNAL) == length;
+}
+
+int sendPipelinedFrame(struct connection *connection, const unsigned char *frame){
+    unsigned char frames[MAX_PIPELINE * MESSAGE_SIZE];
+    for(int n = 0; n < pipelineDepth; n++)
+        memcpy(frames + n * MESSAGE_SIZE, frame, MESSAGE_SIZE);
+    connection->sentAt = getMonotonicNanos();
+    memcpy(connection->lastFrame, frame, MESSAGE_SIZE);
+    connection->lastLength = MESSAGE_SIZE;
+    connection->repeatsDue = pipelineDepth - 1;
+    int length = pipelineDepth * MESSAGE_SIZE;
+    return send(connection->socket, frames, length, MSG_NOSIGNAL) == length;
+}
+
+void handleClientData(struct worker *worker, struct connection *connection){
+    int rc = recv(connection->socket, connection->buffer + connection->buffered, MESSAGE_SIZE - connection->buffered, MSG_DONTWAIT);
+    if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if(rc <= 0){
+        //turned away before the game started means the server had no free game, otherwise it dropped us mid game
+        if(connection->isInProgress)
+            worker->results.disconnects++;
+        else
+            worker->results.rejected++;
+        disconnectClient(connection, 1);
+        return;
+    }
+    connection->buffered += rc;
+    if(connection->buffered == MESSAGE_SIZE){
+        connection->buffered = 0;
+        handleServerMessage(worker, connection);
+    }
+}
+
+void handleServerMessage(struct worker *worker, struct connection *connection){
+    struct results *results = &worker->results;
+    const unsigned char *message = connection->buffer;
+    if(message[1] == GAMEOVER && message[2] == SERVER_FULL){
+        results->rejected++;
+        disconnectClient(connection, 1);
+        return;
+    }
+    //every reply is numbered one past our frame, anything else answers a frame we have already had a reply to
+    if(useUdp && connection->isInProgress && message[4] != (unsigned char)(connection->seqNum + 2))
+        return;
+    //with --pipeline, every copy of our frame after the first gets the server's last reply again
+    if(connection->repeatsDue > 0 && connection->isInProgress && message[4] == connection->seqNum){
+        results->repeats++;
+        if(--connection->repeatsDue == 0 && connection->isMoveHeld){
+            connection->isMoveHeld = 0;
+            if(!sendPipelinedFrame(connection, connection->heldMove)){
+                results->disconnects++;
+                disconnectClient(connection, 1);
+            }
+        }
+        return;
+    }
+    uint64_t latency = getMonotonicNanos() - connection->sentAt;
+    results->latencyBuckets[getLatencyBucket(latency)]++;
+    if(latency > results->maxLatency)
+        results->maxLatency = latency;
+    if(latency > STALL_NS)
+        results->stalls++;
+    connection->isInProgress = 1;
+    connection->id = message[3];
+    connection->seqNum = message[4];
+
+    unsigned char frame[MESSAGE_SIZE + ROWS*COLUMNS];
+    if(message[1] == MOVE && message[2] >= 1 && message[2] <= ROWS*COLUMNS)
+        connection->x |= 1 << (message[2] - 1);
+    //the server ends the game with GAMEOVER after our final move, or expects one from us after its own
+    if(message[1] == GAMEOVER || winningMasks[connection->x] || (connection->x | connection->o) == FULL_BOARD){
+        frame[0] = VERSION;
+        frame[1] = GAMEOVER;
+        frame[2] = 0;
+        frame[3] = connection->id;
+        frame[4] = connection->seqNum + 1;
+        send(connection->socket, frame, MESSAGE_SIZE, MSG_NOSIGNAL);
+        results->games++;
+        disconnectClient(connection, 0);
+        if(atomic_load_explicit(&isRunning, memory_order_relaxed))
+            startGame(worker, connection);
+        return;
+    }
+
+    //play a random open square
+    unsigned short open = ~(connection->x | connection->o) & FULL_BOARD;
+    int skip = rand_r(&worker->seed) % __builtin_popcount(open);
+    while(skip-- > 0)
+        open &= open - 1;
+    int square = __builtin_ctz(open);
+    connection->o |= 1 << square;
+    results->moves++;
+
+    if(dropRate > 0 && rand_r(&worker->seed) < dropRate * RAND_MAX){
+        //pretend the connection broke and hand our move and the board to the server on a new one
+        disconnectClient(connection, 0);
+        if(!connectClient(worker, connection)){
+            disconnectClient(connection, 1);
+            return;
+        }
+        frame[0] = VERSION;
+        frame[1] = RESUME;
+        frame[2] = 0;
+        frame[3] = connection->id;
+        frame[4] = connection->seqNum + 1;
+        for(int n = 0; n < ROWS*COLUMNS; n++)
+            frame[MESSAGE_SIZE + n] = (connection->x >> n) & 1 ? 'X' : (connection->o >> n) & 1 ? 'O' : '1' + n;
+        results->resumes++;
+        if(!sendFrame(connection, frame, MESSAGE_SIZE + ROWS*COLUMNS))
+            disconnectClient(connection, 1);
+        return;
+    }
+    frame[0] = VERSION;
+    frame[1] = MOVE;
+    frame[2] = square + 1;
+    frame[3] = connection->id;
+    frame[4] = connection->seqNum + 1;
+    if(connection->repeatsDue > 0){
+        memcpy(connection->heldMove, frame, MESSAGE_SIZE);
+        connection->isMoveHeld = 1;
+        return;
+    }
+    if(!sendPipelinedFrame(connection, frame)){
+        results->disconnects++;
+        disconnectClient(connection, 1);
+    }
+}
+
+void *runStorm(void *arg){
+    struct sockaddr_in group;
+    const unsigned char request[2] = {VERSION, 0};
+    unsigned char offer[16];
+    int sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sd == -1){
+        perror("runStorm:\tsocket():");
+        return NULL;
+    }
+    group.sin_family = AF_INET;
+    group.sin_port = htons(MC_PORT);
+    group.sin_addr.s_addr = inet_addr(MC_GROUP);
+    //offers arrive in bursts as large as ours
+    int receiveBuffer = 1 << 22;
+    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+
+    int perInterval = stormRate / 100 > 0 ? stormRate / 100 : 1;
+    uint64_t next = getMonotonicNanos();
+    while(1){
+        for(int n = 0; n < perInterval; n++){
+            if(sendto(sd, request, sizeof(request), 0, (struct sockaddr *)&group, sizeof(group)) == sizeof(request))
+                atomic_fetch_add_explicit(&stormSent, 1, memory_order_relaxed);
+        }
+        while(recv(sd, offer, sizeof(offer), MSG_DONTWAIT) > 0)
+            atomic_fetch_add_explicit(&stormOffers, 1, memory_order_relaxed);
+        next += perInterval * 1000000000ull / stormRate;
+        uint64_t now = getMonotonicNanos();
+        if(next > now){
+            struct timespec wait = {.tv_sec = (next - now) / 1000000000, .tv_nsec = (next - now) % 1000000000};
+            nanosleep(&wait, NULL);
+        }
+    }
+    return NULL;
+}
+
+void runFailover(void){
+    struct sockaddr_in group;
+    const unsigned char request[2] = {VERSION, 0};
+    unsigned char offer[16];
+    struct epoll_event events[MAX_EVENTS];
+    int *sockets = failoverSockets = malloc(failoverClients * sizeof(int));
+    uint64_t *answeredAt = calloc(failoverClients, sizeof(uint64_t)); //since the first request, 0 while unanswered
+    int epollSD = epoll_create1(0);
+    if(sockets == NULL || answeredAt == NULL || epollSD == -1){
+        perror("runFailover:\tepoll_create1():");
+        exit(EXIT_FAILURE);
+    }
+    group.sin_family = AF_INET;
+    group.sin_port = htons(MC_PORT);
+    group.sin_addr.s_addr = inet_addr(MC_GROUP);
+    //every socket first, so the requests go out as one burst
+    for(int n = 0; n < failoverClients; n++){
+        sockets[n] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        struct epoll_event event = {.events = EPOLLIN, .data.u32 = n};
+        if(sockets[n] == -1 || epoll_ctl(epollSD, EPOLL_CTL_ADD, sockets[n], &event) != 0){
+            perror("runFailover:\tsocket():");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Multicasting discovery requests from %i orphaned clients at once...\n", failoverClients);
+    uint64_t startedAt = getMonotonicNanos();
+    pthread_t sender;
+    int rc = pthread_create(&sender, NULL, sendFailoverRequests, NULL);
+    if(rc != 0){
+        printf("runFailover:\tpthread_create(): %s\n", strerror(rc));
+        exit(EXIT_FAILURE);
+    }
+    int answered = 0;
+    uint64_t offers = 0;
+    uint64_t resent = 0;
+    uint64_t resentAt = startedAt;
+    while(answered < failoverClients){
+        uint64_t now = getMonotonicNanos();
+        if(now - startedAt >= FAILOVER_TIMEOUT_NS)
+            break;
+        if(now - resentAt >= FAILOVER_RESEND_NS){
+            int sent = atomic_load(&failoverSent);
+            for(int n = 0; n < sent; n++){
+                if(answeredAt[n] == 0 && sendto(sockets[n], request, sizeof(request), 0, (struct sockaddr *)&group,
+                                                sizeof(group)) == sizeof(request))
+                    resent++;
+            }
+            resentAt = now;
+        }
+        int ready = epoll_wait(epollSD, events, MAX_EVENTS, LOOP_TIMEOUT_MS);
+        for(int e = 0; e < ready; e++){
+            int n = events[e].data.u32;
+            //every server, and every thread of one, with a free game offers it
+            while(recv(sockets[n], offer, sizeof(offer), 0) > 0){
+                offers++;
+                if(answeredAt[n] == 0){
+                    answeredAt[n] = getMonotonicNanos() - startedAt;
+                    answered++;
+                }
+            }
+        }
+    }
+
+    pthread_join(sender, NULL);
+    printf("answered:\t%i of %i clients, %lu offers, %lu requests sent again\n", answered, failoverClients, offers, resent);
+    if(answered > 0){
+        uint64_t *times = malloc(answered * sizeof(uint64_t));
+        int numTimes = 0;
+        for(int n = 0; n < failoverClients; n++){
+            if(answeredAt[n] != 0)
+                times[numTimes++] = answeredAt[n];
+        }
+        qsort(times, numTimes, sizeof(uint64_t), compareNanos);
+        printf("answer (ms):\tfirst %.2f  p50 %.2f  p99 %.2f  %s %.2f\n", times[0] / 1e6, times[numTimes / 2] / 1e6,
+               times[(int)(numTimes * 0.99)] / 1e6, answered == failoverClients ? "all" : "last", times[numTimes - 1] / 1e6);
+        free(times);
+    }
+    for(int n = 0; n < failoverClients; n++)
+        close(sockets[n]);
+    close(epollSD);
+    free(sockets);
+    free(answeredAt);
+}
+
+void *sendFailoverRequests(void *arg){
+    struct sockaddr_in group;
+    const unsigned char request[2] = {VERSION, 0};
+    group.sin_family = AF_INET;
+    group.sin_port = htons(MC_PORT);
+    group.sin_addr.s_addr = inet_addr(MC_GROUP);
+    for(int n = 0; n < failoverClients; n++){
+        sendto(failoverSockets[n], request, sizeof(request), 0, (struct sockaddr *)&group, sizeof(group));
+        atomic_store_explicit(&failoverSent, n + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+int compareNanos(const void *a, const void *b){
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+    return (left > right) - (left < right);
+}
+
+int readServerMetrics(struct serverMetrics *metrics){
+    struct sockaddr_in address = serverAddress;
+    address.sin_port = htons(statsPort);
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sd == -1 || connect(sd, (struct sockaddr *)&address, sizeof(address)) != 0){
+        perror("readServerMetrics:\tconnect():");
+        if(sd != -1)
+            close(sd);
+        return 0;
+    }
+    const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    send(sd, request, sizeof(request) - 1, MSG_NOSIGNAL);
+    char *response = malloc(METRICS_SIZE);
+    if(response == NULL){
+        close(sd);
+        return 0;
+    }
+    int length = 0;
+    int rc;
+    while(length < METRICS_SIZE - 1 && (rc = recv(sd, response + length, METRICS_SIZE - 1 - length, 0)) > 0)
+        length += rc;
+    response[length] = 0;
+    close(sd);
+    const char *syscalls = strstr(response, "\nttts_syscalls_total ");
+    const char *moves = strstr(response, "\nttts_commands_total{command=\"move\"} ");
+    int isFound = syscalls != NULL && moves != NULL;
+    if(isFound){
+        metrics->syscalls = strtoull(strchr(syscalls + 1, ' ') + 1, NULL, 10);
+        metrics->moves = strtoull(strchr(moves + 1, ' ') + 1, NULL, 10);
+    }
+    free(response);
+    return isFound;
+}
+
+void printResults(struct worker *workers, const int numWorkers, const double seconds, const struct serverMetrics *server){
+    struct results total;
+    memset(&total, 0, sizeof(total));
+    for(int n = 0; n < numWorkers; n++){
+        struct results *results = &workers[n].results;
+        total.games += results->games;
+        total.moves += results->moves;
+        total.resumes += results->resumes;
+        total.rejected += results->rejected;
+        total.disconnects += results->disconnects;
+        total.resends += results->resends;
+        total.repeats += results->repeats;
+        total.stalls += results->stalls;
+        for(int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+            total.latencyBuckets[bucket] += results->latencyBuckets[bucket];
+        if(results->maxLatency > total.maxLatency)
+            total.maxLatency = results->maxLatency;
+    }
+    uint64_t count = 0;
+    for(int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+        count += total.latencyBuckets[bucket];
+
+    printf("games:\t\t%lu (%.0f/s)\n", total.games, total.games / seconds);
+    printf("moves:\t\t%lu (%.0f/s)\n", total.moves, total.moves / seconds);
+    printf("resumes:\t%lu\n", total.resumes);
+    printf("rejected:\t%lu\n", total.rejected);
+    printf("disconnects:\t%lu\n", total.disconnects);
+    if(useUdp)
+        printf("resends:\t%lu\n", total.resends);
+    //quantiles are the upper bound of the bucket holding them
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    printf("latency (us):\t");
+    for(int n = 0; n < sizeof(quantiles) / sizeof(quantiles[0]); n++){
+        uint64_t rank = (uint64_t)(quantiles[n] * count);
+        uint64_t cumulative = 0;
+        int bucket;
+        for(bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++){
+            cumulative += total.latencyBuckets[bucket];
+            if(count > 0 && cumulative > rank)
+                break;
+        }
+        printf("p%g %.1f  ", quantiles[n] * 100, count > 0 ? getLatencyBucketLimit(bucket) / 1e3 : 0);
+    }
+    printf("max %.1f\n", total.maxLatency / 1e3);
+    if(pipelineDepth > 1)
+        printf("pipeline:\t%lu repeated replies, %lu stalled past %llu ms, %lu disconnects\n", total.repeats, total.stalls,
+               STALL_NS / 1000000, total.disconnects);
+    if(upgradePid > 0)
+        printf("upgrade:\t%lu replies stalled past %llu ms, %lu disconnects\n", total.stalls, STALL_NS / 1000000,
+               total.disconnects);
+    if(server != NULL)
+        printf("server:\t\t%lu syscalls for %lu moves, %.2f per move\n", server->syscalls, server->moves,
+               server->moves > 0 ? (double)server->syscalls / server->moves : 0);
+    if(stormRate > 0)
+        printf("discovery:\t%lu sent, %lu offers\n", (uint64_t)atomic_load(&stormSent), (uint64_t)atomic_load(&stormOffers));
+}
+
+void initializeWinTable(void){
+    const unsigned short lines[] = {
+            0007, 0070, 0700, // rows
+            0111, 0222, 0444, // columns
+            0421, 0124        // diagonals
+    };
+    for(int mask = 0; mask <= FULL_BOARD; mask++){
+        winningMasks[mask] = 0;
+        for(int n = 0; n < sizeof(lines) / sizeof(lines[0]); n++){
+            if((mask & lines[n]) == lines[n])
+                winningMasks[mask] = 1;
+        }
+    }
+}
+
+uint64_t getMonotonicNanos(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+int getLatencyBucket(const uint64_t nanos){
+    const int subBuckets = 1 << LATENCY_SUB_BUCKET_BITS;
+    if(nanos < subBuckets)
+        return (int)nanos;
+    int highestBit = 63 - __builtin_clzll(nanos);
+    int subBucket = (int)(nanos >> (highestBit - LATENCY_SUB_BUCKET_BITS)) & (subBuckets - 1);
+    return ((highestBit - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS) + subBucket;
+}
+
+uint64_t getLatencyBucketLimit(const int bucket){
+    const int subBuckets = 1 << LATENCY_SUB_BUCKET_BITS;
+    if(bucket < subBuckets)
+        return bucket;
+    int shift = (bucket >> LATENCY_SUB_BUCKET_BITS) - 1;
+    uint64_t lowest = (uint64_t)(subBuckets + (bucket & (subBuckets - 1))) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
@@ -0,0 +1,136 @@
+/*
+ * @ttts-micro-game.c
+ * The server's game logic for ttts-micro
+ * Compiles ttts.c into the micro benchmarks as is, so they time exactly the code the server runs (same source, same
+ * CFLAGS), and exposes its per-move functions with plain integer arguments the C++ benchmarks can call.
+ */
+
+//the server's main() never returns, which only main itself may leave out
+#pragma GCC diagnostic ignored "-Wreturn-type"
+#define main tttsMain
+#include "ttts.c"
+#undef main
+#pragma GCC diagnostic warning "-Wreturn-type"
+
+#include "ttts-micro-game.h"
+
+static struct game replyGame;
+static struct shard scanShard;
+
+void microInitialize(const double epsilon){
+    logLevel = LOG_ERROR; //getServerReply() logs every move at the default level
+    aiEpsilon = epsilon;
+    aiSeed = 1;
+    initializeWinTable();
+    initializeAITable();
+}
+
+void microSetDifficulty(const double epsilon){
+    aiEpsilon = epsilon;
+}
+
+int microCheckwin(const uint16_t x, const uint16_t o){
+    struct board board = {.x = x, .o = o};
+    return checkwin(board);
+}
+
+int microValidateMove(const unsigned char move, const uint16_t x, const uint16_t o){
+    struct board board = {.x = x, .o = o};
+    return validateMove(move, board);
+}
+
+unsigned char microGetAIMove(const uint16_t x, const uint16_t o){
+    struct board board = {.x = x, .o = o};
+    return getAIMove(board, aiEpsilon);
+}
+
+int microIsWinningMove(const int variant, const uint64_t *stones, const int square){
+    return variants[variant].isWinningMove(stones, square);
+}
+
+int microGetSquares(const int variant){
+    return variants[variant].rows * variants[variant].columns;
+}
+
+unsigned char microGetServerReply(const uint16_t x, const uint16_t o){
+    replyGame.board.x = x;
+    replyGame.board.o = o;
+    replyGame.isInProgress = 1;
+    replyGame.version = VERSION;
+    struct message reply = getServerReply(&replyGame);
+    return reply.position;
+}
+
+const char *microGetClassifierName(const int classifier){
+    if(classifier < 0 || classifier > getBestBoardClassifier())
+        return NULL;
+    return boardClassifiers[classifier].name;
+}
+
+void microClassifyBoards(const int classifier, const uint16_t *boards, signed char *states, const size_t count){
+    boardClassifiers[classifier].classify((const struct board *)boards, states, count);
+}
+
+void microCreateShard(const int numGames, const int numClients){
+    free(scanShard.games);
+    free(scanShard.timers.entries);
+    free(scanShard.freeSlots);
+    free(scanShard.occupiedSlots);
+    memset(&scanShard, 0, sizeof(scanShard));
+    scanShard.numGames = numGames;
+    scanShard.games = aligned_alloc(CACHE_LINE_SIZE, numGames * sizeof(struct game));
+    scanShard.timers.entries = calloc(numGames, sizeof(struct gameTimer));
+    scanShard.freeSlots = malloc(numGames * sizeof(int));
+    scanShard.occupiedSlots = calloc((numGames + 63) / 64, sizeof(uint64_t));
+    memset(scanShard.games, 0, numGames * sizeof(struct game));
+    memset(scanShard.timers.slots, 0xFF, sizeof(scanShard.timers.slots));
+    scanShard.now = 1000000;
+    scanShard.timers.currentTick = scanShard.now / TIMER_TICK_MS;
+    for(int n = numGames - 1; n >= 0; n--){
+        scanShard.games[n].id = n;
+        scanShard.games[n].shard = &scanShard;
+        scanShard.freeSlots[scanShard.numFreeSlots++] = n;
+    }
+    //a random pick of the free slots, as clients coming and going leave them
+    srand(1);
+    for(int n = numGames - 1; n > 0; n--){
+        int other = rand() % (n + 1);
+        int swap = scanShard.freeSlots[n];
+        scanShard.freeSlots[n] = scanShard.freeSlots[other];
+        scanShard.freeSlots[other] = swap;
+    }
+    for(int n = 0; n < numClients; n++){
+        struct game *game = &scanShard.games[allocateGameSlot(&scanShard)];
+        game->isInProgress = 1;
+        game->socket = game->id + 3;
+        scheduleGameTimeout(&scanShard.timers, game, scanShard.now + rand() % (GAME_TIMEOUT * 1000));
+    }
+}
+
+void microPackResumeToken(const uint16_t x, const uint16_t o, const unsigned char seqNum, unsigned char *token){
+    replyGame.board.x = x;
+    replyGame.board.o = o;
+    replyGame.version = VERSION;
+    replyGame.currentSeqNum = seqNum;
+    packResumeToken(&replyGame, MICRO_TOKEN_ISSUED_AT, token);
+}
+
+int microUnpackResumeToken(const unsigned char *token){
+    struct resumeToken unpacked;
+    return unpackResumeToken(token, MICRO_TOKEN_ISSUED_AT, &unpacked);
+}
+
+int microGetNextTimeout(void){
+    return getNextTimeout(&scanShard.timers, scanShard.now);
+}
+
+void microRefreshTimeout(const int id, const int delay){
+    scheduleGameTimeout(&scanShard.timers, &scanShard.games[id], scanShard.now + delay);
+}
+
+int microCountClients(void){
+    int numClients = 0;
+    for(int id = getNextOccupiedSlot(&scanShard, 0); id != -1; id = getNextOccupiedSlot(&scanShard, id + 1))
+        numClients += scanShard.games[id].socket > 0;
+    return numClients;
+}
@@ -0,0 +1,110 @@
+/*
+ * @ttts-micro-game.h
+ * The server's per-move functions as ttts-micro calls them, see ttts-micro-game.c
+ * Boards are passed as the X and O bitmasks of struct board.
+ */
+
+#ifndef TTTS_MICRO_GAME_H
+#define TTTS_MICRO_GAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MICRO_TOKEN_SIZE 24 //the server's TOKEN_SIZE
+#define MICRO_TOKEN_ISSUED_AT 1800000000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Builds the win and AI tables and silences the log, call once before anything else.
+ * @param epsilon see microSetDifficulty()
+ */
+void microInitialize(double epsilon);
+/**
+ * @param epsilon probability of a random AI move, as --difficulty
+ */
+void microSetDifficulty(double epsilon);
+/**
+ * @return checkwin()
+ */
+int microCheckwin(uint16_t x, uint16_t o);
+/**
+ * @return validateMove()
+ */
+int microValidateMove(unsigned char move, uint16_t x, uint16_t o);
+/**
+ * @return getAIMove()
+ */
+unsigned char microGetAIMove(uint16_t x, uint16_t o);
+/**
+ * @param variant index into the server's variants[], anything but 0 (3x3)
+ * @param stones the mover's bitmask, see struct wideBoard
+ * @param square 0 based square the mover just placed a stone on
+ * @return the variant's isWinningMove()
+ */
+int microIsWinningMove(int variant, const uint64_t *stones, int square);
+/**
+ * @param variant
+ * @return number of squares on the variant's board
+ */
+int microGetSquares(int variant);
+/**
+ * Runs getServerReply() on a game holding the board, as after the client's MOVE.
+ * @return the reply's position, 0 for GAMEOVER
+ */
+unsigned char microGetServerReply(uint16_t x, uint16_t o);
+/**
+ * @param classifier index into the server's boardClassifiers[]
+ * @return the classifier's name, NULL if there is no such classifier or this CPU can't run it
+ */
+const char *microGetClassifierName(int classifier);
+/**
+ * Runs one of the server's classifyBoards() kernels.
+ * @param classifier see microGetClassifierName()
+ * @param boards count X and O bitmask pairs, laid out as struct board
+ * @param states checkwin() of each board
+ * @param count
+ */
+void microClassifyBoards(int classifier, const uint16_t *boards, signed char *states, size_t count);
+/**
+ * Runs packResumeToken() on a game holding the board, as when an idle game is evicted.
+ * @param seqNum
+ * @param token MICRO_TOKEN_SIZE bytes
+ */
+void microPackResumeToken(uint16_t x, uint16_t o, unsigned char seqNum, unsigned char *token);
+/**
+ * Runs unpackResumeToken() the moment the token was packed, as when a client comes back with it.
+ * @param token
+ * @return 1 if the MAC matches
+ */
+int microUnpackResumeToken(const unsigned char *token);
+/**
+ * Sets up a shard of numGames games, numClients of them in random slots holding a client and a timeout somewhere in
+ * the next GAME_TIMEOUT seconds, scheduled in random order as a busy server would have them. Replaces the previous shard.
+ * @param numGames
+ * @param numClients
+ */
+void microCreateShard(int numGames, int numClients);
+/**
+ * @return getNextTimeout() of the shard, the lookup every loop pass does before it waits
+ */
+int microGetNextTimeout(void);
+/**
+ * Pushes a game's timeout back, as every frame from its client does.
+ * @param id
+ * @param delay milliseconds from now, at most GAME_TIMEOUT seconds
+ */
+void microRefreshTimeout(int id, int delay);
+/**
+ * Walks every occupied game of the shard, as arming io_uring and handing games over to an upgrade do.
+ * @return games holding a client
+ */
+int microCountClients(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //TTTS_MICRO_GAME_H
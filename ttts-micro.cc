@@ -0,0 +1,362 @@
+/*
+ * @ttts-micro.cc
+ * Micro benchmarks for the server's per-move functions: checkwin(), validateMove(), getAIMove() and getServerReply(),
+ * and the win check of every variant other than 3x3
+ * Built on Google Benchmark, run with make bench-micro. Every function is timed over two board distributions:
+ *  exhaustive  every board encoding (3^9) in order, or every one still in progress for the functions that move
+ *  random      positions reached by random playouts, shuffled so the branch predictor can't learn the order
+ * Alongside ns/op each benchmark reports branch-misses, the hardware branch misses per call counted with
+ * perf_event_open() (left out if the kernel doesn't allow it, see /proc/sys/kernel/perf_event_paranoid).
+ * Times include looking up the next board and a call into ttts-micro-game.c, about the same for every benchmark.
+ * classifyBoards runs every kernel of the server's batch checkwin() over the random boards and reports boards/s, once
+ * its states matched checkwin() on every board encoding.
+ * packResumeToken and unpackResumeToken time signing and checking the token an evicted game's client resumes it with.
+ * The scan benchmarks time what every loop pass and every frame do to a shard's game table, at 10k, 100k and 1M games.
+ */
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "ttts-micro-game.h"
+
+#define FULL_BOARD ((1 << 9) - 1)
+#define RANDOM_POSITIONS (1 << 16)
+#define WIDE_POSITIONS (1 << 12) //per variant
+#define WIDE_BOARD_WORDS 4
+#define NUM_VARIANTS 5
+#define PERFECT 0.0 //--difficulty perfect
+#define RANDOM 1.0 //--difficulty random, the server's default
+
+/**
+ * A board plus the square the client plays on it, only validateMove() looks at move.
+ */
+struct position{
+    uint16_t x;
+    uint16_t o;
+    unsigned char move;
+};
+
+static std::vector<position> exhaustiveBoards; //every encoding, in order
+static std::vector<position> exhaustiveInProgress; //the encodings checkwin() says are still in progress
+static std::vector<position> exhaustiveMoves; //every encoding with every move byte from 0 to 10, out of range included
+static std::vector<position> randomBoards; //every position of random playouts, finished ones included
+static std::vector<position> randomInProgress;
+static std::vector<position> randomMoves; //random playout positions with a random square, open or not
+static std::vector<uint16_t> exhaustivePacked; //exhaustiveBoards as struct board, X and O masks in turn
+static std::vector<uint16_t> randomPacked; //randomBoards as struct board
+
+/**
+ * One player's stones on a variant's board, plus the square the player just took.
+ */
+struct widePosition{
+    uint64_t stones[WIDE_BOARD_WORDS];
+    int square;
+};
+
+static std::vector<widePosition> widePositions[NUM_VARIANTS]; //random stones on a third of the squares
+
+/**
+ * Counts the calling thread's branch misses in user space between its construction and report().
+ */
+class branchMisses{
+public:
+    branchMisses(){
+        struct perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.size = sizeof(attributes);
+        attributes.config = PERF_COUNT_HW_BRANCH_MISSES;
+        attributes.disabled = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+        if(fd != -1){
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    ~branchMisses(){
+        if(fd != -1)
+            close(fd);
+    }
+    /**
+     * Adds the branch-misses counter, averaged over the benchmark's iterations.
+     * @param state
+     */
+    void report(benchmark::State &state){
+        uint64_t count;
+        if(fd == -1)
+            return;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(fd, &count, sizeof(count)) == sizeof(count))
+            state.counters["branch-misses"] = benchmark::Counter(count, benchmark::Counter::kAvgIterations);
+    }
+private:
+    int fd;
+};
+
+/**
+ * Fills the board distributions, needs the tables from microInitialize().
+ */
+static void generatePositions(){
+    //every square is open, X or O
+    for(int x = 0; x <= FULL_BOARD; x++){
+        for(int o = x ^ FULL_BOARD; ; o = (o - 1) & (x ^ FULL_BOARD)){
+            position board = {(uint16_t)x, (uint16_t)o, 0};
+            exhaustiveBoards.push_back(board);
+            if(microCheckwin(board.x, board.o) == -1)
+                exhaustiveInProgress.push_back(board);
+            for(board.move = 0; board.move <= 10; board.move++)
+                exhaustiveMoves.push_back(board);
+            if(o == 0)
+                break;
+        }
+    }
+
+    //the server is X and moves first, the positions are the ones it sees on its turn and the ones it leaves behind
+    std::mt19937 generator(3800);
+    while(randomBoards.size() < RANDOM_POSITIONS){
+        position board = {0, 0, 0};
+        for(int turn = 0; microCheckwin(board.x, board.o) == -1; turn++){
+            int open[9];
+            int numOpen = 0;
+            for(int square = 0; square < 9; square++){
+                if(!((board.x | board.o) & (1 << square)))
+                    open[numOpen++] = square;
+            }
+            int square = open[generator() % numOpen];
+            if(turn % 2 == 0)
+                board.x |= 1 << square;
+            else
+                board.o |= 1 << square;
+            randomBoards.push_back(board);
+        }
+    }
+    std::shuffle(randomBoards.begin(), randomBoards.end(), generator);
+    for(position board : randomBoards){
+        if(microCheckwin(board.x, board.o) == -1)
+            randomInProgress.push_back(board);
+        board.move = 1 + generator() % 9;
+        randomMoves.push_back(board);
+    }
+
+    for(const position &board : exhaustiveBoards){
+        exhaustivePacked.push_back(board.x);
+        exhaustivePacked.push_back(board.o);
+    }
+    for(const position &board : randomBoards){
+        randomPacked.push_back(board.x);
+        randomPacked.push_back(board.o);
+    }
+
+    for(int variant = 1; variant < NUM_VARIANTS; variant++){
+        int squares = microGetSquares(variant);
+        for(int n = 0; n < WIDE_POSITIONS; n++){
+            widePosition board = {{0}, (int)(generator() % squares)};
+            for(int square = 0; square < squares; square++){
+                if(square == board.square || generator() % 3 == 0)
+                    board.stones[square / 64] |= 1ULL << (square % 64);
+            }
+            widePositions[variant].push_back(board);
+        }
+    }
+}
+
+static void checkwin(benchmark::State &state, const std::vector<position> *positions){
+    size_t n = 0;
+    branchMisses misses;
+    for(auto _ : state){
+        const position &board = (*positions)[n];
+        benchmark::DoNotOptimize(microCheckwin(board.x, board.o));
+        if(++n == positions->size())
+            n = 0;
+    }
+    misses.report(state);
+}
+
+static void validateMove(benchmark::State &state, const std::vector<position> *positions){
+    size_t n = 0;
+    branchMisses misses;
+    for(auto _ : state){
+        const position &board = (*positions)[n];
+        benchmark::DoNotOptimize(microValidateMove(board.move, board.x, board.o));
+        if(++n == positions->size())
+            n = 0;
+    }
+    misses.report(state);
+}
+
+static void getAIMove(benchmark::State &state, const std::vector<position> *positions, const double epsilon){
+    size_t n = 0;
+    microSetDifficulty(epsilon);
+    branchMisses misses;
+    for(auto _ : state){
+        const position &board = (*positions)[n];
+        benchmark::DoNotOptimize(microGetAIMove(board.x, board.o));
+        if(++n == positions->size())
+            n = 0;
+    }
+    misses.report(state);
+}
+
+static void getServerReply(benchmark::State &state, const std::vector<position> *positions, const double epsilon){
+    size_t n = 0;
+    microSetDifficulty(epsilon);
+    branchMisses misses;
+    for(auto _ : state){
+        const position &board = (*positions)[n];
+        benchmark::DoNotOptimize(microGetServerReply(board.x, board.o));
+        if(++n == positions->size())
+            n = 0;
+    }
+    misses.report(state);
+}
+
+static void isWinningMove(benchmark::State &state, const int variant){
+    const std::vector<widePosition> &positions = widePositions[variant];
+    size_t n = 0;
+    branchMisses misses;
+    for(auto _ : state){
+        benchmark::DoNotOptimize(microIsWinningMove(variant, positions[n].stones, positions[n].square));
+        if(++n == positions.size())
+            n = 0;
+    }
+    misses.report(state);
+}
+
+static void classifyBoards(benchmark::State &state, const int classifier){
+    std::vector<signed char> states(exhaustiveBoards.size());
+    microClassifyBoards(classifier, exhaustivePacked.data(), states.data(), states.size());
+    for(size_t n = 0; n < states.size(); n++){
+        if(states[n] != microCheckwin(exhaustiveBoards[n].x, exhaustiveBoards[n].o)){
+            state.SkipWithError("differs from checkwin()");
+            return;
+        }
+    }
+    states.resize(randomBoards.size());
+    branchMisses misses;
+    for(auto _ : state){
+        microClassifyBoards(classifier, randomPacked.data(), states.data(), states.size());
+        benchmark::ClobberMemory();
+    }
+    misses.report(state);
+    state.counters["boards/s"] = benchmark::Counter(state.iterations() * states.size(), benchmark::Counter::kIsRate);
+}
+
+static void nextTimeout(benchmark::State &state){
+    microCreateShard(state.range(0), state.range(0));
+    branchMisses misses;
+    for(auto _ : state)
+        benchmark::DoNotOptimize(microGetNextTimeout());
+    misses.report(state);
+}
+
+static void refreshTimeout(benchmark::State &state){
+    const int numGames = state.range(0);
+    std::vector<int> ids(RANDOM_POSITIONS);
+    microCreateShard(numGames, numGames);
+    std::mt19937 generator(3800);
+    for(int &id : ids)
+        id = generator() % numGames;
+    size_t n = 0;
+    branchMisses misses;
+    for(auto _ : state){
+        //timeouts stay spread over the same window instead of piling up in one slot
+        microRefreshTimeout(ids[n], ids[n] % 30000);
+        if(++n == ids.size())
+            n = 0;
+    }
+    misses.report(state);
+}
+
+static void packResumeToken(benchmark::State &state){
+    unsigned char token[MICRO_TOKEN_SIZE];
+    size_t n = 0;
+    branchMisses misses;
+    for(auto _ : state){
+        const position &board = randomInProgress[n];
+        microPackResumeToken(board.x, board.o, n & 0xFF, token);
+        benchmark::DoNotOptimize(token);
+        if(++n == randomInProgress.size())
+            n = 0;
+    }
+    misses.report(state);
+}
+
+//every token verified once before the timing, a MAC mismatch would time the early exit instead
+static void unpackResumeToken(benchmark::State &state){
+    std::vector<unsigned char> tokens(randomInProgress.size() * MICRO_TOKEN_SIZE);
+    for(size_t n = 0; n < randomInProgress.size(); n++){
+        microPackResumeToken(randomInProgress[n].x, randomInProgress[n].o, n & 0xFF, &tokens[n * MICRO_TOKEN_SIZE]);
+        if(!microUnpackResumeToken(&tokens[n * MICRO_TOKEN_SIZE])){
+            state.SkipWithError("token doesn't verify");
+            return;
+        }
+    }
+    size_t n = 0;
+    branchMisses misses;
+    for(auto _ : state){
+        benchmark::DoNotOptimize(microUnpackResumeToken(&tokens[n * MICRO_TOKEN_SIZE]));
+        if(++n == randomInProgress.size())
+            n = 0;
+    }
+    misses.report(state);
+}
+
+//a tenth of the games taken, as after a wave of clients has left
+static void occupiedScan(benchmark::State &state){
+    microCreateShard(state.range(0), state.range(0) / 10);
+    branchMisses misses;
+    for(auto _ : state)
+        benchmark::DoNotOptimize(microCountClients());
+    misses.report(state);
+}
+
+BENCHMARK_CAPTURE(checkwin, exhaustive, &exhaustiveBoards);
+BENCHMARK_CAPTURE(checkwin, random, &randomBoards);
+BENCHMARK_CAPTURE(validateMove, exhaustive, &exhaustiveMoves);
+BENCHMARK_CAPTURE(validateMove, random, &randomMoves);
+BENCHMARK_CAPTURE(getAIMove, exhaustive/random, &exhaustiveInProgress, RANDOM);
+BENCHMARK_CAPTURE(getAIMove, exhaustive/perfect, &exhaustiveInProgress, PERFECT);
+BENCHMARK_CAPTURE(getAIMove, random/random, &randomInProgress, RANDOM);
+BENCHMARK_CAPTURE(getAIMove, random/perfect, &randomInProgress, PERFECT);
+BENCHMARK_CAPTURE(getServerReply, exhaustive/random, &exhaustiveInProgress, RANDOM);
+BENCHMARK_CAPTURE(getServerReply, exhaustive/perfect, &exhaustiveInProgress, PERFECT);
+BENCHMARK_CAPTURE(getServerReply, random/random, &randomInProgress, RANDOM);
+BENCHMARK_CAPTURE(getServerReply, random/perfect, &randomInProgress, PERFECT);
+//variants[] order
+BENCHMARK_CAPTURE(isWinningMove, 4x4, 1);
+BENCHMARK_CAPTURE(isWinningMove, 5x5, 2);
+BENCHMARK_CAPTURE(isWinningMove, connect_four, 3);
+BENCHMARK_CAPTURE(isWinningMove, gomoku, 4);
+BENCHMARK(packResumeToken);
+BENCHMARK(unpackResumeToken);
+BENCHMARK(nextTimeout)->Arg(10000)->Arg(100000)->Arg(1000000);
+BENCHMARK(refreshTimeout)->Arg(10000)->Arg(100000)->Arg(1000000);
+BENCHMARK(occupiedScan)->Arg(10000)->Arg(100000)->Arg(1000000);
+
+int main(int argc, char **argv){
+    microInitialize(RANDOM);
+    generatePositions();
+    //only the kernels this CPU runs
+    for(int classifier = 0; microGetClassifierName(classifier) != NULL; classifier++)
+        benchmark::RegisterBenchmark((std::string("classifyBoards/") + microGetClassifierName(classifier)).c_str(),
+                                     classifyBoards, classifier);
+    benchmark::Initialize(&argc, argv);
+    if(benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
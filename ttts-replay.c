@@ -0,0 +1,551 @@
+/*
+ * @ttts-replay.c
+ * Reader for the TicTacToe server's --journal files
+ * Memory maps the journal files and replays them, either to rebuild every game played in one game slot
+ * or to compute aggregate stats (outcomes, game lengths and durations, resend rates) over all of them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+const unsigned char NEWGAME = 0x00;
+const unsigned char MOVE = 0x01;
+const unsigned char GAMEOVER = 0x02;
+const unsigned char RESUME = 0x03;
+const unsigned char TOKEN = 0x04;
+
+#define JOURNAL_MAGIC "TTTSJRNL"
+#define JOURNAL_FORMAT 1
+#define CACHE_LINE_SIZE 64
+#define MAX_THREADS 64
+#define MAX_SQUARES 225
+#define NUM_VARIANTS 5
+#define LATENCY_SUB_BUCKET_BITS 3 //same buckets as the server's stats, 12.5% precision
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS)
+
+//same values as the server's enum journalEvent
+enum journalEvent { JOURNAL_RECEIVED, JOURNAL_SENT, JOURNAL_CLOSED, JOURNAL_STONE };
+//how a game ended, indexes results.outcomes
+enum outcome { SERVER_WIN, CLIENT_WIN, DRAW, ABANDONED, NUM_OUTCOMES };
+
+/**
+ * Same layout as the server's struct journalRecord.
+ */
+struct journalRecord{
+    uint64_t timestamp;
+    uint32_t id;
+    uint8_t source;
+    uint8_t command;
+    uint8_t position;
+    uint8_t seqNum;
+};
+
+/**
+ * Same layout as the server's struct journalHeader.
+ */
+struct journalHeader{
+    char magic[8];
+    uint32_t format;
+    uint32_t recordSize;
+    int64_t realtimeOffset;
+    uint32_t sequence;
+    unsigned char padding[CACHE_LINE_SIZE - 28];
+};
+
+/**
+ * A board the server hosts, in the order of the server's variants[].
+ */
+struct variant{
+    int rows;
+    int columns;
+    int winLength;
+    const char *name;
+};
+
+static const struct variant variants[NUM_VARIANTS] = {
+        {3, 3, 3, "3x3"},
+        {4, 4, 4, "4x4"},
+        {5, 5, 4, "5x5"},
+        {6, 7, 4, "connect four"},
+        {15, 15, 5, "gomoku"},
+};
+
+/**
+ * The game in one slot of one shard, as far as the journal has been replayed.
+ */
+struct slot{
+    int isInProgress;
+    int variant;
+    unsigned char squares[MAX_SQUARES]; //0 open, 1 X (the server), 2 O (the client)
+    int moves;
+    int winner; //0, or the player whose stone completed a line
+    int lastSent; //seqNum of the last frame the server sent, -1 before the first
+    int lastReceived; //seqNum of the last MOVE the client sent, -1 before the first
+    int tokenMove; //the move that came with a TOKEN, placed once the server answers it, 0 for none
+    int tokenSeqNum;
+    uint64_t startedAt;
+    uint64_t lastAt;
+    int number; //games started in this slot so far
+};
+
+/**
+ * Everything stats adds up.
+ */
+struct results{
+    uint64_t records;
+    uint64_t games;
+    uint64_t resumed; //games that started with RESUME or TOKEN
+    uint64_t outcomes[NUM_VARIANTS][NUM_OUTCOMES];
+    uint64_t lengths[MAX_SQUARES + 1]; //finished games by number of stones on the final board
+    uint64_t durationBuckets[LATENCY_BUCKETS];
+    uint64_t maxDuration;
+    uint64_t sent;
+    uint64_t resent;
+    uint64_t received;
+    uint64_t repeated;
+    uint64_t firstAt;
+    uint64_t lastAt;
+};
+
+//slots[shard] holds numSlots[shard] slots, grown as higher ids turn up
+static struct slot *slots[MAX_THREADS];
+static uint32_t numSlots[MAX_THREADS];
+static struct results results;
+//game mode: the slot to print, -1 for stats
+static int showShard = -1;
+static uint32_t showID;
+//realtimeOffset of the file being replayed
+static int64_t realtimeOffset;
+
+/**
+ * Maps a journal file and replays every record in it.
+ * @param path
+ * @return 1 on success, 0 if the file can't be read or isn't a journal
+ */
+int replayFile(const char *path);
+/**
+ * Applies one record to its slot, and to the results or the printout.
+ * @param record
+ */
+void replayRecord(const struct journalRecord *record);
+/**
+ * @param shard
+ * @param id
+ * @return the slot, allocated on first use
+ */
+struct slot *getSlot(int shard, uint32_t id);
+/**
+ * Clears a slot for a new game on a variant.
+ * @param slot
+ * @param variant
+ * @param timestamp
+ */
+void startGame(struct slot *slot, int variant, uint64_t timestamp);
+/**
+ * Ends the slot's game and counts it, does nothing if there is none.
+ * @param slot
+ * @param shard
+ * @param id
+ */
+void endGame(struct slot *slot, int shard, uint32_t id);
+/**
+ * Puts a player's stone on an open square and checks the lines through it, does nothing if the square is taken.
+ * @param slot
+ * @param square 1 based
+ * @param player 1 for X, 2 for O
+ */
+void placeStone(struct slot *slot, int square, int player);
+/**
+ * @param slot
+ * @return how the slot's game stands, ABANDONED while nobody has won and the board isn't full
+ */
+enum outcome getOutcome(const struct slot *slot);
+/**
+ * Prints a slot's board, X for the server and O for the client.
+ * @param slot
+ */
+void printBoard(const struct slot *slot);
+/**
+ * Prints a record as a line of a rebuilt game.
+ * @param slot
+ * @param record
+ */
+void printRecord(const struct slot *slot, const struct journalRecord *record);
+/**
+ * @param nanos
+ * @return index into results.durationBuckets, see the server's getLatencyBucket()
+ */
+int getLatencyBucket(uint64_t nanos);
+/**
+ * @param bucket
+ * @return largest duration in nanoseconds that falls into the bucket
+ */
+uint64_t getLatencyBucketLimit(int bucket);
+/**
+ * Prints the aggregate stats.
+ * @param numFiles
+ * @param seconds time taken to replay the files
+ */
+void printResults(int numFiles, double seconds);
+int main(int argc, char *argv[]){
+    int first;
+    if(argc >= 3 && strcmp(argv[1], "stats") == 0){
+        first = 2;
+    }
+    else if(argc >= 5 && strcmp(argv[1], "game") == 0){
+        showShard = strtol(argv[2], NULL, 10);
+        showID = strtoul(argv[3], NULL, 10);
+        if(showShard < 0 || showShard >= MAX_THREADS){
+            printf("shard must be between 0 and %i\n", MAX_THREADS - 1);
+            exit(EXIT_FAILURE);
+        }
+        first = 4;
+    }
+    else{
+        printf("usage is: ttts-replay stats <journal file>...\n"
+               "          ttts-replay game <shard> <game id> <journal file>...\n"
+               "journal files are replayed in the order given, e.g. ttts-replay stats journal.*\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int n = first; n < argc; n++){
+        if(!replayFile(argv[n]))
+            exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if(showShard == -1){
+        //whatever is still going when the journal ends counts as abandoned, like a game the server lost track of
+        for(int shard = 0; shard < MAX_THREADS; shard++){
+            for(uint32_t id = 0; id < numSlots[shard]; id++)
+                endGame(&slots[shard][id], shard, id);
+        }
+        printResults(argc - first, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    else if(showID < numSlots[showShard] && slots[showShard][showID].isInProgress){
+        printf("(journal ends here)\n");
+        printBoard(&slots[showShard][showID]);
+    }
+    return 0;
+}
+
+int replayFile(const char *path){
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if(fd == -1 || fstat(fd, &info) != 0){
+        perror("replayFile:\topen():");
+        return 0;
+    }
+    if(info.st_size < (off_t)sizeof(struct journalHeader)){
+        printf("%s is too short to be a journal\n", path);
+        close(fd);
+        return 0;
+    }
+    const unsigned char *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        perror("replayFile:\tmmap():");
+        return 0;
+    }
+    madvise((void *)data, info.st_size, MADV_SEQUENTIAL);
+    const struct journalHeader *header = (const struct journalHeader *)data;
+    if(memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 || header->format != JOURNAL_FORMAT
+       || header->recordSize != sizeof(struct journalRecord)){
+        printf("%s is not a journal this tool can read\n", path);
+        munmap((void *)data, info.st_size);
+        return 0;
+    }
+    realtimeOffset = header->realtimeOffset;
+    //a server that stopped mid write leaves a partial record at the end
+    size_t numRecords = (info.st_size - sizeof(struct journalHeader)) / sizeof(struct journalRecord);
+    const struct journalRecord *records = (const struct journalRecord *)(header + 1);
+    for(size_t n = 0; n < numRecords; n++)
+        replayRecord(&records[n]);
+    results.records += numRecords;
+    munmap((void *)data, info.st_size);
+    return 1;
+}
+
+void replayRecord(const struct journalRecord *record){
+    int shard = record->source >> 2;
+    enum journalEvent event = record->source & 3;
+    struct slot *slot = getSlot(shard, record->id);
+    if(slot == NULL)
+        return;
+    int isShown = shard == showShard && record->id == showID;
+    if(results.firstAt == 0)
+        results.firstAt = record->timestamp;
+    results.lastAt = record->timestamp;
+
+    if(event == JOURNAL_RECEIVED){
+        //a NEWGAME during a game is the client asking for the first move again, not a new game
+        if((record->command == NEWGAME && !slot->isInProgress) || record->command == RESUME
+           || record->command == TOKEN){
+            endGame(slot, shard, record->id);
+            //a TOKEN's position is the client's next move, tokens only ever carry the classic board
+            startGame(slot, record->command != TOKEN && record->position < NUM_VARIANTS ? record->position : 0,
+                      record->timestamp);
+            results.games++;
+            if(record->command == RESUME || record->command == TOKEN)
+                results.resumed++;
+            if(record->command == TOKEN){
+                //the board follows as STONE records, the move goes on top of it if the server took it
+                slot->tokenMove = record->position;
+                slot->tokenSeqNum = record->seqNum;
+            }
+            if(isShown){
+                char when[64];
+                time_t seconds = (time_t)(((int64_t)record->timestamp + realtimeOffset) / 1000000000);
+                strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+                printf("\ngame %i in slot %i/%u, %s, started %s\n", slot->number, shard, record->id,
+                       variants[slot->variant].name, when);
+            }
+        }
+        if(!slot->isInProgress)
+            return;
+        if(record->command == MOVE){
+            results.received++;
+            if((int)record->seqNum <= slot->lastReceived)
+                results.repeated++;
+            else
+                slot->lastReceived = record->seqNum;
+            placeStone(slot, record->position, 2);
+        }
+        slot->lastAt = record->timestamp;
+        if(isShown)
+            printRecord(slot, record);
+        if(record->command == GAMEOVER)
+            endGame(slot, shard, record->id);
+    }
+    else if(event == JOURNAL_SENT){
+        if(!slot->isInProgress)
+            return;
+        results.sent++;
+        //a TOKEN carries the seqNum of the move before it
+        if(record->seqNum == slot->lastSent && record->command != TOKEN)
+            results.resent++;
+        slot->lastSent = record->seqNum;
+        if(slot->tokenMove != 0){
+            if((int)record->seqNum == slot->tokenSeqNum + 1){
+                placeStone(slot, slot->tokenMove, 2);
+                slot->lastReceived = slot->tokenSeqNum;
+            }
+            slot->tokenMove = 0;
+        }
+        if(record->command == MOVE)
+            placeStone(slot, record->position, 1);
+        slot->lastAt = record->timestamp;
+        if(isShown)
+            printRecord(slot, record);
+        if(record->command == GAMEOVER)
+            endGame(slot, shard, record->id);
+    }
+    else if(event == JOURNAL_STONE){
+        if(slot->isInProgress)
+            placeStone(slot, record->position, record->command);
+    }
+    else if(slot->isInProgress){ //JOURNAL_CLOSED
+        if(isShown)
+            printRecord(slot, record);
+        endGame(slot, shard, record->id);
+    }
+}
+
+struct slot *getSlot(const int shard, const uint32_t id){
+    if(id >= numSlots[shard]){
+        uint32_t count = numSlots[shard] == 0 ? 64 : numSlots[shard];
+        while(count <= id)
+            count *= 2;
+        struct slot *grown = realloc(slots[shard], count * sizeof(struct slot));
+        if(grown == NULL){
+            perror("getSlot:\trealloc():");
+            return NULL;
+        }
+        memset(grown + numSlots[shard], 0, (count - numSlots[shard]) * sizeof(struct slot));
+        slots[shard] = grown;
+        numSlots[shard] = count;
+    }
+    return &slots[shard][id];
+}
+
+void startGame(struct slot *slot, const int variant, const uint64_t timestamp){
+    int number = slot->number;
+    memset(slot, 0, sizeof(struct slot));
+    slot->isInProgress = 1;
+    slot->variant = variant;
+    slot->lastSent = -1;
+    slot->lastReceived = -1;
+    slot->startedAt = timestamp;
+    slot->lastAt = timestamp;
+    slot->number = number + 1;
+}
+
+void endGame(struct slot *slot, const int shard, const uint32_t id){
+    if(!slot->isInProgress)
+        return;
+    slot->isInProgress = 0;
+    enum outcome outcome = getOutcome(slot);
+    results.outcomes[slot->variant][outcome]++;
+    if(outcome != ABANDONED){
+        results.lengths[slot->moves]++;
+        uint64_t duration = slot->lastAt - slot->startedAt;
+        results.durationBuckets[getLatencyBucket(duration)]++;
+        if(duration > results.maxDuration)
+            results.maxDuration = duration;
+    }
+    if(shard == showShard && id == showID){
+        const char *names[NUM_OUTCOMES] = {"server won", "client won", "draw", "abandoned"};
+        printf("%s after %i stones\n", names[outcome], slot->moves);
+        printBoard(slot);
+    }
+}
+
+void placeStone(struct slot *slot, const int square, const int player){
+    const struct variant *variant = &variants[slot->variant];
+    if(square < 1 || square > variant->rows * variant->columns || slot->squares[square - 1] != 0)
+        return;
+    slot->squares[square - 1] = player;
+    slot->moves++;
+    if(slot->winner != 0)
+        return;
+    //same walk as the server's win kernels
+    const int steps[4][2] = {{0, 1}, {1, 0}, {1, 1}, {1, -1}};
+    const int row = (square - 1) / variant->columns;
+    const int column = (square - 1) % variant->columns;
+    for(int direction = 0; direction < 4; direction++){
+        int run = 1;
+        for(int sign = -1; sign <= 1; sign += 2){
+            int r = row + sign * steps[direction][0];
+            int c = column + sign * steps[direction][1];
+            while(r >= 0 && r < variant->rows && c >= 0 && c < variant->columns
+                  && slot->squares[r * variant->columns + c] == player){
+                run++;
+                r += sign * steps[direction][0];
+                c += sign * steps[direction][1];
+            }
+        }
+        if(run >= variant->winLength)
+            slot->winner = player;
+    }
+}
+
+enum outcome getOutcome(const struct slot *slot){
+    if(slot->winner == 1)
+        return SERVER_WIN;
+    if(slot->winner == 2)
+        return CLIENT_WIN;
+    if(slot->moves == variants[slot->variant].rows * variants[slot->variant].columns)
+        return DRAW;
+    return ABANDONED;
+}
+
+void printBoard(const struct slot *slot){
+    const struct variant *variant = &variants[slot->variant];
+    for(int row = 0; row < variant->rows; row++){
+        for(int column = 0; column < variant->columns; column++)
+            printf(" %c", ".XO"[slot->squares[row * variant->columns + column]]);
+        printf("\n");
+    }
+}
+
+void printRecord(const struct slot *slot, const struct journalRecord *record){
+    const char *commands[] = {"NEWGAME", "MOVE", "GAMEOVER", "RESUME", "TOKEN"};
+    enum journalEvent event = record->source & 3;
+    printf("%10.3f ms  ", (record->timestamp - slot->startedAt) / 1e6);
+    if(event == JOURNAL_CLOSED){
+        printf("connection closed\n");
+        return;
+    }
+    printf("%s  %-8s position %3i  seq %3i\n", event == JOURNAL_SENT ? "server ->" : "client ->",
+           record->command <= TOKEN ? commands[record->command] : "invalid", record->position, record->seqNum);
+}
+
+int getLatencyBucket(const uint64_t nanos){
+    const int subBuckets = 1 << LATENCY_SUB_BUCKET_BITS;
+    if(nanos < subBuckets)
+        return (int)nanos;
+    int highestBit = 63 - __builtin_clzll(nanos);
+    int subBucket = (int)(nanos >> (highestBit - LATENCY_SUB_BUCKET_BITS)) & (subBuckets - 1);
+    return ((highestBit - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS) + subBucket;
+}
+
+uint64_t getLatencyBucketLimit(const int bucket){
+    const int subBuckets = 1 << LATENCY_SUB_BUCKET_BITS;
+    if(bucket < subBuckets)
+        return bucket;
+    int shift = (bucket >> LATENCY_SUB_BUCKET_BITS) - 1;
+    uint64_t lowest = (uint64_t)(subBuckets + (bucket & (subBuckets - 1))) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+void printResults(const int numFiles, const double seconds){
+    const double quantiles[] = {0.5, 0.9, 0.99};
+    const char *names[NUM_OUTCOMES] = {"server won", "client won", "draws", "abandoned"};
+    uint64_t finished = 0;
+    uint64_t totals[NUM_OUTCOMES] = {0};
+    for(int variant = 0; variant < NUM_VARIANTS; variant++){
+        for(int outcome = 0; outcome < NUM_OUTCOMES; outcome++)
+            totals[outcome] += results.outcomes[variant][outcome];
+    }
+    finished = totals[SERVER_WIN] + totals[CLIENT_WIN] + totals[DRAW];
+
+    printf("replayed:\t%i file(s), %lu records in %.2f s (%.0f records/s)\n", numFiles, results.records, seconds,
+           seconds > 0 ? results.records / seconds : 0);
+    printf("span:\t\t%.1f s of play\n", (results.lastAt - results.firstAt) / 1e9);
+    printf("games:\t\t%lu (%lu started by RESUME or TOKEN), %lu finished\n", results.games, results.resumed, finished);
+    for(int variant = 0; variant < NUM_VARIANTS; variant++){
+        uint64_t *outcomes = results.outcomes[variant];
+        uint64_t played = outcomes[SERVER_WIN] + outcomes[CLIENT_WIN] + outcomes[DRAW];
+        if(played + outcomes[ABANDONED] == 0)
+            continue;
+        printf("%-13s\t", variants[variant].name);
+        for(int outcome = 0; outcome < NUM_OUTCOMES; outcome++){
+            printf("%s %lu", names[outcome], outcomes[outcome]);
+            if(outcome != ABANDONED && played > 0)
+                printf(" (%.1f%%)", 100.0 * outcomes[outcome] / played);
+            printf(outcome + 1 < NUM_OUTCOMES ? ", " : "\n");
+        }
+    }
+
+    if(finished > 0){
+        uint64_t stones = 0;
+        int longest = 0;
+        for(int moves = 0; moves <= MAX_SQUARES; moves++){
+            stones += moves * results.lengths[moves];
+            if(results.lengths[moves] > 0)
+                longest = moves;
+        }
+        printf("length:\t\tmean %.1f stones", (double)stones / finished);
+        int q = 0;
+        uint64_t seen = 0;
+        for(int moves = 0; moves <= MAX_SQUARES && q < 3; moves++){
+            seen += results.lengths[moves];
+            while(q < 3 && seen >= quantiles[q] * finished)
+                printf("  p%g %i", quantiles[q++] * 100, moves);
+        }
+        printf("  max %i\n", longest);
+
+        printf("duration (ms):\t");
+        q = 0;
+        seen = 0;
+        for(int bucket = 0; bucket < LATENCY_BUCKETS && q < 3; bucket++){
+            seen += results.durationBuckets[bucket];
+            while(q < 3 && seen >= quantiles[q] * finished)
+                printf("p%g %.1f  ", quantiles[q++] * 100, getLatencyBucketLimit(bucket) / 1e6);
+        }
+        printf("max %.1f\n", results.maxDuration / 1e6);
+    }
+
+    printf("resends:\tserver %lu of %lu frames (%.2f%%), client %lu of %lu moves (%.2f%%)\n",
+           results.resent, results.sent, results.sent > 0 ? 100.0 * results.resent / results.sent : 0,
+           results.repeated, results.received, results.received > 0 ? 100.0 * results.repeated / results.received : 0);
+}
@@ -12,54 +12,872 @@
  */
 
 const unsigned char VERSION = 0x06;
+const unsigned char EXTENDED_VERSION = 0x07; //VERSION with a 4 byte game id, see struct message
 
 const unsigned char NEWGAME = 0x00;
 const unsigned char MOVE = 0x01;
 const unsigned char GAMEOVER = 0x02;
 const unsigned char RESUME = 0x03;
+const unsigned char TOKEN = 0x04; //an evicted game's resume token, from the server and back from the client
+const unsigned char SERVER_FULL = 0xFF; //position of the GAMEOVER sent to a client turned away for lack of a free game
 
-const int MAX_GAMES = 5;
+const int DEFAULT_MAX_GAMES = 5;
 const int MAX_RESENDS = 3;
 const int GAME_TIMEOUT = 30;
 
+#define _GNU_SOURCE //accept4(), recvmmsg(), sendmmsg(), close_range()
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <strings.h>
 #include <sys/time.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <sys/random.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define MC_PORT 1818
 #define MC_GROUP "239.0.0.1"
 #define ROWS  3
 #define COLUMNS  3
+#define FULL_BOARD ((1 << (ROWS * COLUMNS)) - 1)
+#define NUM_BOARD_STATES 19683 //3^9, every square is open, X or O
 #define TIMETOWAIT 5
+#define MAX_EVENTS 64
+#define MAX_THREADS 64
+#define TIMER_TICK_MS 100
+#define TIMER_SLOTS 1024 //power of two, one lap of the wheel is TIMER_SLOTS * TIMER_TICK_MS
+#define GAME_BUFFER_SIZE 256 //power of two, room for several pipelined frames or a RESUME of the largest variant
+#define OUT_BUFFER_SIZE 64 //power of two, replies queued per game until the end of the loop iteration
+#define MAX_SQUARES 225 //squares of the largest variant, 15x15
+#define WIDE_BOARD_WORDS ((MAX_SQUARES + 63) / 64)
+#define DEFAULT_BACKLOG 1024 //per listening socket, the kernel caps it at net.core.somaxconn
+#define DEFAULT_DISCOVERY_BATCH 64
+#define MAX_DISCOVERY_BATCH 1024
+#define DISCOVERY_REPLY_SIZE 3
+#define UDP_BATCH 64 //datagrams received per recvmmsg() and replies sent per sendmmsg() on a --udp-port socket
+#define UDP_SOCKET_BUFFER (1 << 22) //SO_RCVBUF and SO_SNDBUF of a --udp-port socket, every client of a shard shares it
+#define MESSAGE_SIZE 5 //on the wire for VERSION
+#define EXTENDED_MESSAGE_SIZE 8 //on the wire for EXTENDED_VERSION
+#define CACHE_LINE_SIZE 64
+#define LOG_RING_SIZE 4096 //power of two, records buffered per thread before new ones are dropped
+#define LOG_MAX_ARGS 6
+#define LOG_IDLE_SLEEP_NS 1000000
+#define LATENCY_SUB_BUCKET_BITS 3 //HDR style histogram, 8 linear sub-buckets per power of two (12.5% precision)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_EXPORTED_POWERS 35 //Prometheus buckets at 1ns, 2ns, 4ns ... 2^34ns (~17s)
+#define URING_ENTRIES 256 //submission queue entries per shard, the completion queue gets 4 times as many
+#define URING_BUFFERS 1024 //power of two, receive buffers each shard provides to the kernel
+#define URING_BUFFER_SIZE 128
+#define URING_BUFFER_GROUP 0
+#define STATE_FILE_MAGIC "TTTSGAME"
+#define STATE_FILE_FORMAT 1
+#define JOURNAL_MAGIC "TTTSJRNL"
+#define JOURNAL_FORMAT 1
+#define JOURNAL_RING_SIZE 16384 //power of two, records buffered per shard before new ones are dropped
+#define JOURNAL_BATCH 65536 //records the journal thread collects before it writes them out
+#define DEFAULT_JOURNAL_SIZE 64 //MiB written to a journal file before the next one is started
+#define SELFPLAY_CHUNK 256 //--selfplay games a worker takes off its range at a time
+#define REPLICATION_MAGIC 0x54545452 //"TTTR"
+#define REPLICATION_FORMAT 1
+#define REPLICATION_RING_SIZE 4096 //power of two, deltas buffered per shard before new ones are dropped
+#define REPLICATION_INTERVAL_MS 5 //deltas are batched for this long before they go out
+#define REPLICATION_BATCH 100 //deltas per datagram, 1212 bytes fit any Ethernet MTU
+#define REPLICA_BUCKETS 4096 //power of two and at least 256, see findReplica()
+#define REPLICA_IN_PROGRESS 1 //replicaDelta.flags
+#define REPLICA_EXTENDED 2 //the game is played in EXTENDED_VERSION
+#define TOKEN_FORMAT 1
+#define TOKEN_SIZE 24 //follows the header of a TOKEN frame, see struct resumeToken
+#define TOKEN_LIFETIME 3600 //seconds a resume token is accepted for
+#define TOKEN_CLOCK_SKEW 60 //seconds a token may seem to be issued in the future, by a server whose clock is ahead
 
+//what an io_uring completion is for, kept in the low byte of its user_data (see URING_USER_DATA)
+enum uringOperation { URING_ACCEPT, URING_DISCOVERY, URING_RECV, URING_SEND, URING_CANCEL, URING_UPGRADE };
+//what a journalRecord stands for, stored in the low 2 bits of journalRecord.source
+enum journalEvent { JOURNAL_RECEIVED, JOURNAL_SENT, JOURNAL_CLOSED, JOURNAL_STONE };
+//how a RESUME compares to the replicas of peer servers' games, indexes metrics.resumeChecks
+enum resumeCheck { RESUME_VERIFIED, RESUME_RECOVERED, RESUME_MISMATCH, RESUME_UNKNOWN };
+//index into boardClassifiers[], slowest first
+enum classifierID { CLASSIFIER_SCALAR, CLASSIFIER_SSE2, CLASSIFIER_AVX2, NUM_CLASSIFIERS };
+//index into variants[], sent by the client in the position byte of NEWGAME and RESUME
+enum variantID { VARIANT_CLASSIC, VARIANT_4X4, VARIANT_5X5, VARIANT_CONNECT_FOUR, VARIANT_GOMOKU, NUM_VARIANTS };
+//what an upgradeMessage carries, a hand over is HELLO, one SHARD per shard, one GAME per live game and DONE
+enum upgradeMessageType { UPGRADE_HELLO, UPGRADE_SHARD, UPGRADE_GAME, UPGRADE_DONE };
+
+enum logLevel { LOG_ERROR, LOG_ACTION, LOG_DATA };
+
+/**
+ * Packs an io_uring request's operation, game id and the game's generation into its user_data, so a completion that
+ * arrives after the game's client has gone (see struct game) can be told apart from one for the current client.
+ */
+#define URING_USER_DATA(operation, id, generation) \
+        (((uint64_t)((generation) & 0xFFFFFF) << 40) | ((uint64_t)(id) << 8) | (operation))
+
+/**
+ * Logs a printf style message at the given level without formatting or writing anything on the calling thread.
+ * Below the configured level this costs a single compare. Arguments are captured as ints, so format strings may only
+ * use integer conversions (%i, %x, %c) and must be string literals.
+ */
+#define LOG(level, format, ...) do{ \
+        if((level) <= logLevel) \
+            pushLogRecord(format, (const int[LOG_MAX_ARGS]){__VA_ARGS__}, 0); \
+    }while(0)
+/**
+ * Like LOG at LOG_ERROR, with the description of the current errno appended the way perror() would.
+ */
+#define LOG_ERRNO(format, ...) do{ \
+        if(LOG_ERROR <= logLevel) \
+            pushLogRecord(format, (const int[LOG_MAX_ARGS]){__VA_ARGS__}, errno); \
+    }while(0)
+/**
+ * Increments a metrics counter. Every counter has a single writer (the shard's own thread), so a relaxed load and
+ * store is enough and no locked instruction is needed, the stats thread only ever reads.
+ */
+#define COUNT(counter) atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + 1, memory_order_relaxed)
+/**
+ * Sums one metrics counter over every shard, expects shards and numShards in scope.
+ */
+#define SUM_METRIC(field) ({ \
+        uint64_t total = 0; \
+        for(int n = 0; n < numShards; n++) \
+            total += atomic_load_explicit(&shards[n].metrics.field, memory_order_relaxed); \
+        total; })
+
+/**
+ * A protocol message. On the wire VERSION messages are 5 bytes: version, command, position, id, seqNum.
+ * EXTENDED_VERSION messages are 8 bytes, the same fields with id widened to 4 bytes in network byte order, so a
+ * server can host more than 256 games. A client picks the version with its first message and the server answers
+ * in kind. VERSION clients just see the low byte of their game's id.
+ */
 struct message{
     unsigned char version;
     unsigned char command;
     unsigned char position;
-    unsigned char id;
+    unsigned int id;
     unsigned char seqNum;
 };
 
+/**
+ * A board is stored as one bitmask per player, bit n-1 is set when square n holds that player's mark.
+ * The ASCII form ('1'-'9' for open squares, 'X'/'O' for taken ones) only exists on the wire for RESUME.
+ */
+struct board{
+    uint16_t x;
+    uint16_t o;
+};
+
+/**
+ * Board of a game on any variant but 3x3 (see struct variant), one bitmask per player spread over 64 bit words.
+ * Squares are numbered row by row from the top left, bit n-1 is set when square n holds that player's stone.
+ */
+struct wideBoard{
+    uint64_t x[WIDE_BOARD_WORDS];
+    uint64_t o[WIDE_BOARD_WORDS];
+    uint16_t moves; //stones on the board
+    unsigned char winner; //0 until a move completes a line, then 1 if X made it and 2 if O did
+};
+
+/**
+ * A board size and win length the server hosts. The client picks one by its index into variants[] in the position
+ * byte of NEWGAME or RESUME, 0 being plain 3x3 tic tac toe.
+ */
+struct variant{
+    unsigned char rows;
+    unsigned char columns;
+    unsigned char winLength; //stones needed in a row, column or diagonal, longer lines win as well
+    unsigned char hasGravity; //connect style, a stone can only go on the bottom row or on top of another stone
+    //1 if the stone just placed on square (0 based) completes a line, NULL for 3x3 which is looked up in winningMasks[]
+    int (*isWinningMove)(const uint64_t *stones, int square);
+};
+
+/**
+ * One implementation of classifyBoards(), see boardClassifiers[].
+ */
+struct boardClassifier{
+    const char *name;
+    void (*classify)(const struct board *boards, signed char *states, size_t count);
+};
+
+struct shard;
+
+//slots are cache line aligned so neighbouring games never share a line
 struct game{
-    char id;
-    double timeSinceCommunciation;
+    unsigned int id;
+    struct shard *shard; //shard that owns this game
     int isInProgress;
-    char board[ROWS][COLUMNS];
+    struct board board;
     int currentSeqNum;
     int resends;
     struct message lastMessage;
     int socket;
-    unsigned char buffer[sizeof(struct message)];
-    int bytesOfCurrentMessage;
+    //ring buffer the socket is read into directly, bufferHead and bufferTail only ever grow and are masked on access
+    unsigned char buffer[GAME_BUFFER_SIZE];
+    unsigned int bufferHead; //total bytes received
+    unsigned int bufferTail; //total bytes consumed by complete frames
+    unsigned char version; //protocol version the client chose, VERSION or EXTENDED_VERSION
+    unsigned char variant; //index into variants[], every variant but VARIANT_CLASSIC plays on shard->wideBoards[id]
+    unsigned int generation; //bumped every time a client is detached, only 24 bits make it into io_uring requests
+    //replies waiting to go out at the end of the loop iteration, the counters only ever grow and are masked on access
+    unsigned char outBuffer[OUT_BUFFER_SIZE];
+    unsigned int outHead; //total bytes queued
+    unsigned int outSent; //total bytes handed to the kernel
+    unsigned int outTail; //total bytes the kernel has sent
+    int sendsInFlight; //io_uring only
+    int isWaitingWritable; //epoll only, EPOLLOUT is armed because the socket took only part of the replies
+    int isSendPending; //on the shard's pendingSends list
+    int isClosingAfterSend; //io_uring only, evicted, closed once its resume token has been sent
+    int isReadStalled; //complete frames wait in buffer until the replies queued ahead of theirs make room
+    struct game *sendNext;
+    int unrecordedReplies; //replies to client frames whose latency is recorded when they are flushed
+    uint64_t readableAt; //shard->readableAt of the frames those replies answer
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * A game as kept in the --state-file mapping. Records are written with plain ordered stores and never synced,
+ * the page cache outlives a crashed process, so the next one finds every game as of its last reply.
+ * sequence is odd while a record is being written, a record left odd by a crash is discarded on recovery.
+ */
+struct gameRecord{
+    uint32_t sequence;
+    uint16_t x;
+    uint16_t o;
+    uint16_t currentSeqNum;
+    uint8_t isInProgress;
+    uint8_t version;
+    uint8_t resends;
+    uint8_t lastCommand;
+    uint8_t lastPosition;
+    uint8_t lastSeqNum;
+};
+
+/**
+ * Start of the --state-file, followed by every shard's records. A file written with another layout is started over.
+ */
+struct stateFileHeader{
+    char magic[8];
+    uint32_t format;
+    uint32_t numShards;
+    uint32_t maxGames;
+    unsigned char padding[CACHE_LINE_SIZE - 20];
+};
+
+/**
+ * One event in a --journal file, 16 bytes in host byte order. A game is identified by its shard and id, the slot's next
+ * game starts with its next received NEWGAME or RESUME.
+ * RECEIVED is a frame the server accepted from the client and SENT a frame it sent, both with the frame's command,
+ * position and seqNum. CLOSED is the game ending (command, position and seqNum are 0). A RESUME is followed by one
+ * STONE per stone on the client's board, with command 1 for X or 2 for O and position the square.
+ */
+struct journalRecord{
+    uint64_t timestamp; //CLOCK_MONOTONIC nanoseconds of the wakeup that produced it, see journalHeader.realtimeOffset
+    uint32_t id;
+    uint8_t source; //shard index << 2 | enum journalEvent
+    uint8_t command;
+    uint8_t position;
+    uint8_t seqNum;
+};
+
+/**
+ * Start of every journal file, followed by nothing but journalRecords. A file is cut short wherever the server
+ * stopped, the records in it are still whole up to the last multiple of recordSize.
+ */
+struct journalHeader{
+    char magic[8];
+    uint32_t format;
+    uint32_t recordSize;
+    int64_t realtimeOffset; //add to a record's timestamp to get CLOCK_REALTIME nanoseconds
+    uint32_t sequence; //number of the file in its series, the one in its name
+    unsigned char padding[CACHE_LINE_SIZE - 28];
+};
+
+/**
+ * Single producer single consumer ring of journal records, one per shard, drained by the journal thread.
+ */
+struct journalRing{
+    _Atomic unsigned int head; //next record to be written, only advanced by the shard
+    _Atomic unsigned int tail; //next record to be stored, only advanced by the journal thread
+    struct journalRecord records[JOURNAL_RING_SIZE];
+};
+
+/**
+ * The --journal writer, see runJournal().
+ */
+struct journalState{
+    const char *path; //files are path.000000, path.000001 ..., NULL without --journal
+    size_t fileSize; //bytes per file before the next one is started
+    struct journalRing *rings;
+    int numRings;
+    int fd; //file being written
+    uint32_t sequence; //its number
+    size_t written; //bytes written to it
+    _Atomic int isFlushed; //every record taken off the rings has been written
+};
+
+/**
+ * Latest state of one 3x3 game: how a shard hands it to the replication thread, and how it travels to peers in
+ * network byte order. Each delta carries the whole board, so a lost datagram is made up for by the game's next one.
+ */
+struct replicaDelta{
+    uint32_t id;
+    uint8_t shard;
+    uint8_t flags; //REPLICA_IN_PROGRESS, REPLICA_EXTENDED, a delta without REPLICA_IN_PROGRESS removes the replica
+    uint8_t seqNum; //of the last frame the server sent
+    uint8_t position; //of that frame, 0 if it wasn't a MOVE
+    uint16_t x;
+    uint16_t o;
+};
+
+/**
+ * Starts every replication datagram, followed by count deltas.
+ */
+struct replicationHeader{
+    uint32_t magic;
+    uint32_t node; //random id of the sending process, a server ignores its own datagrams
+    uint16_t port; //game port of the sender
+    uint8_t format;
+    uint8_t count;
+};
+
+/**
+ * A peer's game as last replicated to us, chained into replication.buckets by id.
+ */
+struct replica{
+    uint32_t node;
+    struct replicaDelta delta; //host byte order
+    uint64_t updatedAt; //CLOCK_MONOTONIC milliseconds
+    struct replica *next;
+};
+
+/**
+ * Single producer single consumer ring of deltas, one per shard, drained by the replication thread.
+ */
+struct replicationRing{
+    _Atomic unsigned int head; //next delta to be written, only advanced by the shard
+    _Atomic unsigned int tail; //next delta to be sent, only advanced by the replication thread
+    struct replicaDelta deltas[REPLICATION_RING_SIZE];
+};
+
+/**
+ * The --replicate sender and receiver, see runReplication().
+ */
+struct replicationState{
+    int sd; //joined to the replication group, -1 without --replicate
+    struct sockaddr_in group;
+    uint32_t node;
+    unsigned short port;
+    struct replicationRing *rings;
+    int numRings;
+    //the table of peers' games, written by the replication thread and read by shards handling a RESUME
+    pthread_mutex_t lock;
+    struct replica *buckets[REPLICA_BUCKETS];
+    _Atomic int numReplicas;
+    _Atomic uint64_t deltasSent;
+    _Atomic uint64_t deltasReceived;
+};
+
+/**
+ * An evicted 3x3 game, everything a server needs to carry it on. It travels behind the header of a TOKEN frame as
+ * TOKEN_SIZE bytes: TOKEN_FORMAT, version, seqNum, position, x, o, id and issuedAt in network byte order, then a
+ * SipHash-2-4 of those 16 bytes under tokenKey. Without the key nobody can make one up, so a server holding the
+ * same key can take the board on trust, unlike the one sent with a RESUME.
+ */
+struct resumeToken{
+    uint8_t version;
+    uint8_t seqNum; //of the server's last frame, the client's MOVE carries seqNum + 1
+    uint8_t position; //of that frame, the server's last move
+    struct board board;
+    uint32_t id; //of the game it was issued for, the client's TOKEN frame has to carry it
+    uint32_t issuedAt; //CLOCK_REALTIME seconds
+};
+
+/**
+ * A game's place in its shard's timer wheel. The entries live in an array of their own indexed by game id rather than
+ * in struct game, so the lookup every loop pass makes walks 16 byte entries instead of a cache line of each game.
+ */
+struct gameTimer{
+    uint64_t tick; //wheel tick at which the game times out, 0 when no timeout is scheduled
+    int next; //id of the next game in the slot, -1 at the end
+    int prev;
+};
+
+/**
+ * Hashed timing wheel holding the timeout of every game that has a client or is in progress. Each slot is a doubly
+ * linked list of game ids threaded through entries, so scheduling and cancelling are O(1) and a wakeup only visits the
+ * slots whose ticks have passed.
+ * Deadlines further out than one lap simply stay in their slot until the wheel comes around to their tick.
+ */
+struct timerWheel{
+    int slots[TIMER_SLOTS]; //id of the first game in each slot, -1 when empty
+    struct gameTimer *entries; //one per game
+    uint64_t currentTick; //last tick that has been processed
+    int count;
+};
+
+/**
+ * Where a --udp-port game's client is. Kept in an array of its own indexed by game id, like the timer entries, and
+ * chained by address into shard->udpBuckets, which is how a datagram finds its game.
+ */
+struct udpPeer{
+    struct sockaddr_in address;
+    int next; //id of the next game in the bucket, -1 at the end
+};
+
+/**
+ * recvmmsg()/sendmmsg() scratch space for a shard's --udp-port socket. Requests hold one frame each, a RESUME with
+ * the board behind it. Replies are copied out of the games' send queues, so a batch can be sent at any time.
+ */
+struct udpBatch{
+    struct mmsghdr requests[UDP_BATCH];
+    struct iovec requestIov[UDP_BATCH];
+    struct sockaddr_in requestAddresses[UDP_BATCH];
+    unsigned char requestData[UDP_BATCH][EXTENDED_MESSAGE_SIZE + MAX_SQUARES];
+    struct mmsghdr replies[UDP_BATCH];
+    struct iovec replyIov[UDP_BATCH];
+    struct sockaddr_in replyAddresses[UDP_BATCH];
+    unsigned char replyData[UDP_BATCH][EXTENDED_MESSAGE_SIZE + TOKEN_SIZE];
+    int numReplies;
+};
+
+/**
+ * Counters and the reply latency histogram for one shard. Only the shard's thread writes them (see COUNT),
+ * the stats thread sums every shard's copy when it is scraped.
+ */
+struct metrics{
+    _Atomic uint64_t commands[5]; //indexed by command, NEWGAME through TOKEN
+    _Atomic uint64_t invalidCommands;
+    _Atomic uint64_t duplicateResends;
+    _Atomic uint64_t timeoutResends;
+    _Atomic uint64_t prunedGames;
+    _Atomic uint64_t badVersionDisconnects;
+    _Atomic uint64_t badVariantDisconnects;
+    _Atomic uint64_t journalDropped;
+    _Atomic uint64_t replicationDropped;
+    _Atomic uint64_t resumeChecks[RESUME_UNKNOWN + 1]; //only counted with --replicate
+    _Atomic uint64_t acceptedConnections; //rejected ones included
+    _Atomic uint64_t rejectedConnections;
+    _Atomic uint64_t shortWrites;
+    _Atomic uint64_t discoveryOffers;
+    _Atomic uint64_t datagramsReceived; //--udp-port only
+    _Atomic uint64_t strayDatagrams; //too short, or for no game and not starting one
+    _Atomic uint64_t datagramsDropped; //replies the socket wouldn't take
+    _Atomic uint64_t tokensIssued; //idle games evicted
+    _Atomic uint64_t tokensRejected; //forged, expired, or for another game than the frame
+    _Atomic uint64_t syscalls; //made by the reactor thread on the move path, io_uring_enter() included
+    _Atomic uint64_t latencyCount;
+    _Atomic uint64_t latencySumNs;
+    _Atomic uint64_t latencyBuckets[LATENCY_BUCKETS]; //see getLatencyBucket()
+};
+
+/**
+ * One shard's io_uring instance, set up with raw syscalls. The rings are shared with the kernel, the shard's thread
+ * is the only one adding submissions or consuming completions.
+ */
+struct uring{
+    int fd;
+    unsigned int *sqHead;
+    unsigned int *sqTail;
+    unsigned int sqMask;
+    unsigned int sqEntries;
+    unsigned int sqLocalTail; //tail including entries that haven't been handed to the kernel yet
+    struct io_uring_sqe *sqes;
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe *cqes;
+    //receive buffers the kernel picks from for multishot recv, buffer n is URING_BUFFER_SIZE bytes at buffers + n * URING_BUFFER_SIZE
+    struct io_uring_buf_ring *bufferRing;
+    unsigned char *buffers;
+    unsigned short bufferTail;
+    int sendsInFlight; //over every game
+    int isQuiescing; //every request has been cancelled for an upgrade, completions don't rearm anything
+    int isCancelled; //the cancellation has completed
+    _Atomic uint64_t *syscalls; //the shard's metrics.syscalls
+};
+
+/**
+ * Everything owned by one reactor thread. Shards share nothing on the move path: each has its own
+ * SO_REUSEPORT listening socket (the kernel spreads incoming connections across them), epoll instance and games.
+ */
+struct shard{
+    int index;
+    struct game *games;
+    int numGames;
+    int *freeSlots; //stack of the ids of every game without a client, popped on accept and pushed by closeGame()
+    int numFreeSlots;
+    uint64_t *occupiedSlots; //bit per game, set while it is off freeSlots, so scans over the games skip the free ones
+    int listeningSD;
+    int multicastSD; //-1 for every shard but the one answering discovery multicasts
+    int udpSD; //SO_REUSEPORT socket bound to --udp-port, -1 without one. It is the socket of every game played over it
+    struct udpPeer *udpPeers; //one per game, NULL without --udp-port
+    int *udpBuckets; //id of the first game whose client hashes to each bucket, -1 when empty
+    unsigned int udpBucketMask;
+    struct udpBatch *udp;
+    int epollSD;
+    struct uring *uring; //NULL unless the shard runs runShardUring()
+    struct gameRecord *records; //this shard's slice of the --state-file, NULL without one
+    struct wideBoard *wideBoards; //one per game, only touched by games on a variant other than 3x3
+    struct journalRing *journal; //this shard's ring, NULL without --journal
+    struct replicationRing *replication; //this shard's ring, NULL without --replicate
+    struct game *pendingSends; //games with queued replies, linked through sendNext and flushed once per loop iteration
+    unsigned short portNum;
+    struct timerWheel timers;
+    uint64_t now; //CLOCK_MONOTONIC milliseconds, refreshed once per wakeup
+    uint64_t wokeAt; //CLOCK_MONOTONIC nanoseconds, when epoll_wait() last returned
+    uint64_t readableAt; //wokeAt while a readable game socket is being serviced, 0 otherwise
+    int isUpgradeRequested; //SIGUSR2 arrived, handled once the current wakeup is done
+    struct metrics metrics;
+    //recvmmsg()/sendmmsg() scratch space for discovery multicasts, only allocated for the shard that owns multicastSD
+    struct mmsghdr *discoveryRequests;
+    struct mmsghdr *discoveryReplies;
+    struct iovec *discoveryIov;
+    struct sockaddr_in *discoveryAddresses;
+    unsigned char (*discoveryData)[EXTENDED_MESSAGE_SIZE];
+    unsigned char discoveryOffers[2][DISCOVERY_REPLY_SIZE]; //offer for VERSION and EXTENDED_VERSION requests
+};
+
+/**
+ * One --selfplay thread. Its share of the games is the range [next, end) packed into one word, so the worker taking
+ * chunks off the front and idle workers stealing the back half are each a single compare and swap.
+ */
+struct selfPlayWorker{
+    _Atomic uint64_t range; //next game in the low 32 bits, end in the high 32 bits
+    int index;
+    pthread_t thread;
+    struct shard shard; //two games without sockets, the server's and the opponent's view of the board
+    uint64_t games;
+    uint64_t moves; //both players'
+    uint64_t outcomes[3]; //indexed by getWinner(), draws, X wins and O wins
+    uint64_t mismatches; //games the server ended on another board or outcome than the opponent saw
+    uint64_t steals;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/**
+ * One message on the --upgrade-socket. Descriptors travel alongside it as SCM_RIGHTS: the multicast and stats
+ * sockets with HELLO, the listening socket with SHARD and the client's socket with GAME (none for a recovered
+ * game still waiting for its client).
+ */
+struct upgradeMessage{
+    uint32_t type;
+    uint32_t numShards; //HELLO
+    uint32_t maxGames; //HELLO
+    uint32_t shard; //SHARD, GAME
+    uint32_t numGames; //SHARD
+    uint32_t id; //GAME
+    struct gameRecord record; //GAME
+    uint32_t variant; //GAME
+    struct wideBoard wideBoard; //GAME, on any variant but 3x3
+    uint32_t buffered; //GAME, bytes of an incomplete frame
+    unsigned char buffer[GAME_BUFFER_SIZE];
+    uint32_t unsent; //GAME, queued replies the socket hadn't taken yet
+    unsigned char outBuffer[OUT_BUFFER_SIZE];
+};
+
+/**
+ * Everything a hot upgrade needs, see handleUpgradeRequest().
+ */
+struct upgradeState{
+    const char *socketPath; //set by --upgrade-socket, NULL when upgrades are off
+    int eventSD; //eventfd the SIGUSR2 handler writes to, every shard watches it
+    pthread_barrier_t barrier; //every shard meets here before and after the hand over
+    struct shard *shards;
+    int numShards;
+    int maxGames;
+    int statsSD;
+    char **argv; //the replacement is started with these plus --takeover
+};
+
+/**
+ * Socket and shards served by the stats thread.
+ */
+struct statsServer{
+    int sd;
+    struct shard *shards;
+    int numShards;
+};
+
+/**
+ * One log line waiting to be formatted by the logging thread.
+ */
+struct logRecord{
+    const char *format;
+    int args[LOG_MAX_ARGS];
+    int error; //errno to describe after the formatted text, 0 for none
+};
+
+/**
+ * Single producer single consumer ring of log records. Each thread that logs owns one ring and is its only producer,
+ * the logging thread is the only consumer, so neither side ever takes a lock.
+ */
+struct logRing{
+    _Atomic unsigned int head; //next record to be written, only advanced by the owning thread
+    _Atomic unsigned int tail; //next record to be formatted, only advanced by the logging thread
+    _Atomic unsigned int dropped; //records thrown away because the ring was full
+    struct logRecord records[LOG_RING_SIZE];
+};
+
+//most verbose level that gets logged, set by --log-level
+static int logLevel = LOG_ACTION;
+//where the logging thread writes, set by --log-file
+static FILE *logOutput;
+static struct logRing *logRings;
+static int numLogRings;
+//ring owned by the calling thread, NULL before it has been handed one
+static __thread struct logRing *threadLogRing;
+
+//winningMasks[mask] is 1 when the squares in mask contain a full row, column or diagonal
+static unsigned char winningMasks[FULL_BOARD + 1];
+//the same rows, columns and diagonals as masks, for the kernels that check every line instead of looking boards up
+static const uint16_t winningLines[] = {
+        0007, 0070, 0700, // rows
+        0111, 0222, 0444, // columns
+        0421, 0124        // diagonals
+};
+/**
+ * classifyBoards() kernels: checkwin() one board after another, and the same with SSE2 on 4 and AVX2 on 8 boards at
+ * a time. The vector kernels leave the last few boards to checkwin().
+ */
+void classifyBoardsScalar(const struct board *boards, signed char *states, size_t count);
+void classifyBoardsSSE2(const struct board *boards, signed char *states, size_t count);
+void classifyBoardsAVX2(const struct board *boards, signed char *states, size_t count);
+static const struct boardClassifier boardClassifiers[NUM_CLASSIFIERS] = {
+        [CLASSIFIER_SCALAR] = {.name = "scalar", .classify = classifyBoardsScalar},
+        [CLASSIFIER_SSE2] = {.name = "sse2", .classify = classifyBoardsSSE2},
+        [CLASSIFIER_AVX2] = {.name = "avx2", .classify = classifyBoardsAVX2},
+};
+//set by initializeWinTable()
+static enum classifierID boardClassifier = CLASSIFIER_SCALAR;
+
+//base3Digits[mask] is the base 3 number with a 1 in every digit whose bit is set in mask, see getBoardIndex()
+static uint16_t base3Digits[FULL_BOARD + 1];
+//perfectMoves[getBoardIndex(board)] is the mask of every move that is optimal for X to play on board
+static uint16_t perfectMoves[NUM_BOARD_STATES];
+
+/**
+ * Win checks for the variants, see DEFINE_WIN_KERNEL.
+ * @param stones the mover's bitmask
+ * @param square 0 based square the mover just placed a stone on
+ * @return 1 if that stone completes a line of the variant's win length
+ */
+int isWinningMove4x4(const uint64_t *stones, int square);
+int isWinningMove5x5(const uint64_t *stones, int square);
+int isWinningMoveConnectFour(const uint64_t *stones, int square);
+int isWinningMoveGomoku(const uint64_t *stones, int square);
+static const struct variant variants[NUM_VARIANTS] = {
+        [VARIANT_CLASSIC] = {.rows = ROWS, .columns = COLUMNS, .winLength = 3, .isWinningMove = NULL},
+        [VARIANT_4X4] = {.rows = 4, .columns = 4, .winLength = 4, .isWinningMove = isWinningMove4x4},
+        [VARIANT_5X5] = {.rows = 5, .columns = 5, .winLength = 4, .isWinningMove = isWinningMove5x5},
+        [VARIANT_CONNECT_FOUR] = {.rows = 6, .columns = 7, .winLength = 4, .hasGravity = 1, .isWinningMove = isWinningMoveConnectFour},
+        [VARIANT_GOMOKU] = {.rows = 15, .columns = 15, .winLength = 5, .isWinningMove = isWinningMoveGomoku},
 };
+//number of discovery multicasts received and answered per recvmmsg()/sendmmsg() call, set by --discovery-batch
+static int discoveryBatchSize = DEFAULT_DISCOVERY_BATCH;
+//probability that the server's getAIMove() plays a random square instead of a perfect one, set by --difficulty
+static double aiEpsilon = 1.0;
+//set by --io uring, every shard then runs runShardUring() instead of runShard()
+static int useUring = 0;
+static int useNagle = 0; //--nagle, leave TCP_NODELAY off on game sockets
+static int listenBacklog = DEFAULT_BACKLOG;
+static unsigned short udpPort = 0; //--udp-port, 0 without one
+//idle 3x3 games are sent their resume token and freed after this many seconds, 0 to keep them, set by --evict-after
+static int evictAfter = 0;
+//SipHash key of every resume token, read from --token-key or random, which only this process can then verify
+static uint64_t tokenKey[2];
+static struct upgradeState upgrade = {.socketPath = NULL, .eventSD = -1, .statsSD = -1};
+static struct journalState journal = {.path = NULL, .fd = -1};
+static struct replicationState replication = {.sd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+//--selfplay workers and settings
+static struct selfPlayWorker *selfPlayWorkers;
+static int numSelfPlayWorkers;
+static unsigned char selfPlayVariant; //--variant
+static double opponentEpsilon = 1.0; //--opponent
+
+//per-thread state for getAIMove(), rand() serializes every caller on a global lock
+static __thread unsigned int aiSeed;
+/**
+ * Allocates one log ring per thread and starts the logging thread. Records logged before this, or from threads
+ * without a ring, are formatted synchronously.
+ * @param numRings number of threads that will log
+ * @return 1 on success, 0 on failure
+ */
+int startLogger(int numRings);
+/**
+ * Waits for the logging thread to take every record off the rings, before the process exits. exit() flushes what it
+ * has formatted. Every thread with a ring must be done logging.
+ */
+void waitForLogger(void);
+/**
+ * Hands a log record to the logging thread through the calling thread's ring. Use the LOG/LOG_ERRNO macros instead.
+ * @param format printf style string literal, integer conversions only
+ * @param args LOG_MAX_ARGS integers for format
+ * @param error errno to describe after the message, 0 for none
+ */
+void pushLogRecord(const char *format, const int args[LOG_MAX_ARGS], int error);
+/**
+ * Formats and writes a single record to logOutput.
+ * @param record
+ */
+void writeLogRecord(const struct logRecord *record);
+/**
+ * Logging thread, drains every ring in turn and sleeps briefly whenever they are all empty.
+ * @param arg unused
+ * @return never returns
+ */
+void *runLogger(void *arg);
+/**
+ * Allocates a journal ring per shard and starts the journal thread, which writes to journal.path.
+ * @param shards every shard, each is handed its ring
+ * @param numShards
+ * @return 1 on success, 0 on failure
+ */
+int startJournal(struct shard *shards, int numShards);
+/**
+ * Appends an event to the shard's journal ring, does nothing without --journal. Never blocks: when the ring is full
+ * the record is dropped and counted in journalDropped.
+ * @param game
+ * @param event
+ * @param command
+ * @param position
+ * @param seqNum
+ */
+void journalEvent(struct game *game, enum journalEvent event, unsigned char command, unsigned char position, unsigned char seqNum);
+/**
+ * Journals the stones of a game's board as STONE records, after a RESUME.
+ * @param game
+ */
+void journalBoard(struct game *game);
+/**
+ * Journal thread. Moves records from every ring into one large buffer and writes it out when it fills up or the rings
+ * run dry, starting a new file every journal.fileSize bytes.
+ * @param arg unused
+ * @return never returns
+ */
+void *runJournal(void *arg);
+/**
+ * Closes the current journal file and creates the next one in the series. Files that already exist are skipped, so
+ * a restarted or upgraded server carries on after the last file instead of overwriting it.
+ * @return 1 on success, 0 on failure
+ */
+int openJournalFile(void);
+/**
+ * Waits for the journal thread to write out everything the shards have journaled, before the process exits.
+ * Every shard must be stopped.
+ */
+void waitForJournal(void);
+/**
+ * Plays numGames games against the server's own AI without a socket, on numWorkers threads, and prints games/s and
+ * how the games ended. Every frame goes through handleClientMessage() as it would from a client: NEWGAME, MOVEs and
+ * GAMEOVER in, the server's replies back out of the game's output buffer. X plays at --difficulty, O at --opponent.
+ * @param numGames
+ * @param numWorkers
+ * @return 1 if the server and every opponent agreed on how each game went, 0 otherwise
+ */
+int runSelfPlay(uint32_t numGames, int numWorkers);
+/**
+ * One --selfplay thread, plays chunks of its own games and steals from the others once it runs out.
+ * @param arg its struct selfPlayWorker
+ * @return NULL
+ */
+void *runSelfPlayWorker(void *arg);
+/**
+ * Takes up to SELFPLAY_CHUNK games off the front of the worker's range. When the range is empty, the back half of
+ * the first other worker's range that has games left is moved over first.
+ * @param worker
+ * @return number of games taken, 0 once every range is empty
+ */
+uint32_t takeSelfPlayGames(struct selfPlayWorker *worker);
+/**
+ * Plays one game on the worker's shard, then checks the server's board against the opponent's.
+ * @param worker
+ * @param final the server's board when the game ended, 3x3 games only
+ * @return getWinner() of the opponent's board, -1 if the server stopped replying
+ */
+int playSelfPlayGame(struct selfPlayWorker *worker, struct board *final);
+/**
+ * Takes the next reply out of a --selfplay game's output buffer, where a client would read it from the socket.
+ * @param game
+ * @param reply
+ * @return 1 if there was one, 0 otherwise
+ */
+int readSelfPlayReply(struct game *game, struct message *reply);
+/**
+ * Joins the --replicate group and starts the replication thread, which sends our games to peer servers and keeps
+ * the replicas of theirs.
+ * @param target group:port, e.g. 239.0.0.2:1819
+ * @param shards every shard gets a ring to queue deltas on
+ * @param numShards
+ * @param portNum our game port, only sent along for the peers' logs
+ * @return 1 on success, 0 on failure
+ */
+int startReplication(const char *target, struct shard *shards, int numShards, unsigned short portNum);
+/**
+ * Queues a 3x3 game's state for the peers, does nothing without --replicate. Never blocks: when the ring is full the
+ * delta is dropped and counted in replicationDropped.
+ * @param game
+ * @param message last frame sent to the client, NULL once the game has ended
+ */
+void replicateGame(struct game *game, const struct message *message);
+/**
+ * Replication thread. Sends every delta the shards queued in the last REPLICATION_INTERVAL_MS in as few datagrams as
+ * they fit, applies the peers' datagrams to the replica table in between, and expires replicas nobody has updated
+ * for GAME_TIMEOUT seconds (their server is gone and their client never came back).
+ * @param arg unused
+ * @return never returns
+ */
+void *runReplication(void *arg);
+/**
+ * Drains every shard's ring into datagrams of up to REPLICATION_BATCH deltas and sends them to the group.
+ */
+void sendReplicationBatch(void);
+/**
+ * Applies one peer datagram to the replica table, anything malformed or sent by ourselves is ignored.
+ * @param data
+ * @param length
+ * @param now CLOCK_MONOTONIC milliseconds
+ */
+void applyReplicationDatagram(const unsigned char *data, int length, uint64_t now);
+/**
+ * Compares a RESUME against the replicas of every peer game with the same id, and takes the one it matches out of
+ * the table since the game lives here from now on. Replication lock must not be held.
+ * @param game with the client's board already copied in
+ * @param messageIn the RESUME
+ * @param matched the matching replica, when there is one
+ * @return RESUME_VERIFIED if a replica is at the client's last frame, with the client's own next move on top at most
+ *         RESUME_RECOVERED if a replica is one server move ahead of the client, the move its last frame lost
+ *         RESUME_MISMATCH if there are replicas with that id but the client's board fits none of them
+ *         RESUME_UNKNOWN if there are none, or the game isn't 3x3
+ */
+enum resumeCheck checkResume(const struct game *game, struct message messageIn, struct replicaDelta *matched);
+/**
+ * @param node
+ * @param shard
+ * @param id
+ * @return the replica of that peer game, NULL if there is none. Replication lock must be held.
+ */
+struct replica *findReplica(uint32_t node, int shard, uint32_t id);
 /**
  * Creates a UDP socket configured to be a member of a multicast group as defined in spec document.
  * In practice if a server goes down in the middle of a game, a client can multicast to this group to request a server to pick up the game.
@@ -72,20 +890,62 @@ int createMulticastSocket(int *sd, struct sockaddr_in *multicast_address);
  * @param sd uninitialized int to be converted into socket
  * @param portNum
  * @param server_address
+ * @param backlog length of the pending connection queue handed to listen()
+ * @return 1 on success, 0 on failure
+ */
+int createListeningSocket(int *sd, int portNum, struct sockaddr_in *server_address, int backlog);
+/**
+ * Creates a non blocking SO_REUSEPORT UDP socket bound to portNum on every address, for games played over datagrams.
+ * @param sd uninitialized int to be converted into socket
+ * @param portNum
  * @return 1 on success, 0 on failure
  */
-int createListeningSocket(int *sd, int portNum, struct sockaddr_in *server_address);
+int createDatagramSocket(int *sd, int portNum);
+/**
+ * Fills winningMasks[], must be called once before any game is played.
+ */
+void initializeWinTable(void);
+/**
+ * Checks if a gameover state on a board has been reached by looking both players' masks up in winningMasks[].
+ * @param board
+ * @return 1 if someone has won, 0 on a draw, -1 if the game should go on
+ */
+int checkwin(struct board board);
+/**
+ * checkwin() of many boards at once, for analysis and self-play rather than the move path. Runs the fastest kernel in
+ * boardClassifiers[] the CPU supports, picked by initializeWinTable(). Every kernel gives exactly what checkwin()
+ * gives for boards whose masks fit in FULL_BOARD.
+ * @param boards
+ * @param states checkwin() of each board
+ * @param count
+ */
+void classifyBoards(const struct board *boards, signed char *states, size_t count);
+/**
+ * @return the fastest entry of boardClassifiers[] this CPU runs
+ */
+enum classifierID getBestBoardClassifier(void);
+/**
+ * checkwin() for a game on any variant.
+ * @param game
+ * @return 1 if someone has won, 0 on a draw, -1 if the game should go on
+ */
+int getGameState(const struct game *game);
+/**
+ * @param game
+ * @return the board a game on any variant but 3x3 plays on
+ */
+struct wideBoard *getWideBoard(const struct game *game);
 /**
- * Brute force checks if a gameover state on a board has been reached.
  * @param board
- * @return
+ * @return mask of the open squares, bit n-1 is set when square n is still available
  */
-int checkwin(char board[ROWS][COLUMNS]);
+unsigned short getLegalMoves(struct board board);
 /**
- * does the necessary math to transform move into a row and column, determines the mark to place on the board, and modifies board accordingly
- * assumes you have already validated the moves legality using validateMove()
+ * determines the mark to place on the board and sets the move's bit in that player's mask
+ * assumes you have already validated the moves legality using isLegalMove()
+ * On a variant other than 3x3 it also runs the variant's win check for the new stone.
  * @param game
- * @param move 0x01 - 0x09, corresponds to a square on the board.
+ * @param move 1 based square on the game's board
  */
 void makeMoveOnBoard(struct game *game, unsigned char move, int player);
 /**
@@ -98,18 +958,80 @@ void makeMoveOnBoard(struct game *game, unsigned char move, int player);
  */
 void tictactoeRound(struct game *game, unsigned char clientMove);
 /**
- * Terrible AI algorithm. Returns a random valid move.
- * Will return 255 if 50 unsuccessful attempts to find a valid move are made.
+ * Solves every board encoding with negamax and fills perfectMoves[], must be called once before any game is played.
+ */
+void initializeAITable(void);
+/**
+ * Scores a board for the player about to move: positive for a win, negative for a loss, 0 for a draw.
+ * Wins are worth more the sooner they happen, losses cost less the later they happen.
+ * Records the optimal moves in perfectMoves[] for boards where X is to move.
+ * @param board
+ * @param xToMove 1 if X is the player about to move
+ * @param scores memoized results, indexed by [xToMove][getBoardIndex(board)]
+ * @param solved marks which entries of scores are filled in
+ * @return score of board for the player about to move
+ */
+signed char negamax(struct board board, int xToMove, signed char scores[2][NUM_BOARD_STATES], unsigned char solved[2][NUM_BOARD_STATES]);
+/**
  * @param board
- * @return 1-9 move for the server to make.
+ * @return base 3 encoding of board (0 for an open square, 1 for X, 2 for O), an index into perfectMoves[]
  */
-unsigned char getAIMove(char board[ROWS][COLUMNS]);
+int getBoardIndex(struct board board);
 /**
- * Finds the first available game ID within the games array and returns the ID. Returns -1 if no games are available
- * @param games
+ * Picks X's move. With probability epsilon it is a uniformly random open square, otherwise it is
+ * one of the optimal moves for X (the server's mark) looked up in perfectMoves[].
+ * @param board
+ * @param epsilon aiEpsilon for the server's own moves
+ * @return 1-9 move for the server to make, or 255 if the board is full.
+ */
+unsigned char getAIMove(struct board board, double epsilon);
+/**
+ * Picks X's move on a variant other than 3x3. With probability epsilon it is a random legal square,
+ * otherwise it is a square that wins, failing that one that blocks the client's win, failing that a random one.
+ * @param variant
+ * @param board
+ * @param epsilon aiEpsilon for the server's own moves
+ * @return 1 based square for the server to play, or 255 if the board is full
+ */
+unsigned char getWideAIMove(const struct variant *variant, const struct wideBoard *board, double epsilon);
+/**
+ * @param game
+ * @return the server's move on any variant, see getAIMove() and getWideAIMove()
+ */
+unsigned char getServerMove(const struct game *game);
+/**
+ * O's move, picked by the same AI as the server's with the players swapped.
+ * @param game
+ * @param epsilon probability of a random move
+ * @return 1 based square, or 255 if the board is full
+ */
+unsigned char getOpponentMove(const struct game *game, double epsilon);
+/**
+ * @param game
+ * @return 1 if X has a line on the game's board, 2 if O has, 0 if neither
+ */
+int getWinner(const struct game *game);
+/**
+ * Takes a game without a client off the shard's free list in O(1). The slot is handed out as it was left,
+ * accepting a client and initializeGame() reset what a new game needs.
+ * @param shard
  * @return id of game if a game is available, otherwise -1
  */
-int getAvailableGameID(const struct game games[MAX_GAMES]);
+int allocateGameSlot(struct shard *shard);
+/**
+ * Returns a game's slot to its shard's free list.
+ * @param shard
+ * @param game
+ */
+void releaseGameSlot(struct shard *shard, struct game *game);
+/**
+ * Walks the games that are off the free list without touching the free ones, for(id = getNextOccupiedSlot(shard, 0);
+ * id != -1; id = getNextOccupiedSlot(shard, id + 1)).
+ * @param shard
+ * @param id first id to look at
+ * @return lowest occupied id from id on, -1 if there is none
+ */
+int getNextOccupiedSlot(const struct shard *shard, int id);
 /**
  * Initializes a game object to have all necessary information to begin a game.
  * @param game to be initialized
@@ -117,45 +1039,163 @@ int getAvailableGameID(const struct game games[MAX_GAMES]);
  */
 int initializeGame(struct game *game);
 /**
- * Increments the value of .timeSinceCommunication for all game objects within games where .isInProgress is true.
- * @param games
- * @param time number of seconds to increment .timeSinceCommunication by
- * @param resetID if this is not -1, the game with this ID will have its time set to 0 instead of incremented. otherwise it is ignored.
+ * @return CLOCK_MONOTONIC time in milliseconds
  */
-void incrementTimeSinceCommunication(struct game games[], double time, int resetID);
+uint64_t getMonotonicMillis(void);
 /**
- * For any game whose timeSinceCommunication > GAME_TIMEOUT:
- * If resends equals or exceeds MAX_RESENDS, end the game (set isInProgress & timeSinceCommunication to 0)
- * If resends is less than MAX_RESENDS, resend the last message to the client.
- * For any game within the array whose timeSinceCommunication > GAME_TIMEOUT _AND_ whose resends is greater than MAX_RESENDS .isInProgress = 0 and .timeSinceCommunication = 0
+ * @return CLOCK_MONOTONIC time in nanoseconds
  */
-void manageTimedOutGames(struct game *games);
+uint64_t getMonotonicNanos(void);
 /**
- * Validates a move against a tic tac toe board to make sure the square is available
- * (ripped from lab 4 client code)
- * @param move
- * @param board
- * @return 1 on valid, 0 on invalid
+ * @param nanos latency
+ * @return index into metrics.latencyBuckets, values below 8 get their own bucket, above that every power of two
+ * is split into 8 equal sub-buckets
  */
-int validateMove(unsigned char move, char board[ROWS][COLUMNS]);
+int getLatencyBucket(uint64_t nanos);
 /**
- * Given an unparsed buffer containing data from a client, assigns values to a message object appropriately according to protocol
- * @param buffer
- * @return Initialized message object
+ * @param bucket index into metrics.latencyBuckets
+ * @return largest latency in nanoseconds that falls into the bucket
  */
-struct message parsePacketFromBuffer(unsigned char buffer[]);
+uint64_t getLatencyBucketLimit(int bucket);
 /**
- * Wrapper function for sendto which includes log commands.
- * @param game
- * @param message
+ * Adds one reply latency to a shard's histogram.
+ * @param metrics
+ * @param nanos time from the game's socket becoming readable to the reply being sent
  */
-void sendPacketToClient(struct game* game, struct message* message);
+void recordLatency(struct metrics *metrics, uint64_t nanos);
 /**
- * Copies a 1 dimensional array of each square's state to a 3x3 board state.
+ * Records the latency of every reply to a client frame the game has queued since its last flush.
  * @param game
- * @param buffer
+ * @param now CLOCK_MONOTONIC nanoseconds the replies are handed to the kernel at
  */
-void copyBoardStateToGame(struct game* game, unsigned char buffer[9]);
+void recordReplyLatencies(struct game *game, uint64_t now);
+/**
+ * Sums every shard's metrics and writes them in the Prometheus text exposition format.
+ * @param output
+ * @param shards
+ * @param numShards
+ */
+void writeMetrics(FILE *output, struct shard *shards, int numShards);
+/**
+ * Creates a TCP socket on the loopback interface for the stats thread and starts it.
+ * @param portNum
+ * @param sd socket to serve, -1 to create one, which is stored back
+ * @param shards whose metrics are served
+ * @param numShards
+ * @return 1 on success, 0 on failure
+ */
+int startStatsServer(unsigned short portNum, int *sd, struct shard *shards, int numShards);
+/**
+ * Creates the stats thread's TCP socket on the loopback interface.
+ * @param sd uninitialized int to be converted into socket
+ * @param portNum
+ * @return 1 on success, 0 on failure
+ */
+int createStatsSocket(int *sd, unsigned short portNum);
+/**
+ * Stats thread, answers every connection on the stats socket with an HTTP response holding writeMetrics() output.
+ * @param arg struct statsServer describing the socket and shards
+ * @return never returns
+ */
+void *runStatsServer(void *arg);
+/**
+ * (Re)schedules a game's timeout for the given deadline, removing any timeout it already had.
+ * @param wheel
+ * @param game
+ * @param deadline CLOCK_MONOTONIC milliseconds
+ */
+void scheduleGameTimeout(struct timerWheel *wheel, struct game *game, uint64_t deadline);
+/**
+ * Removes a game's timeout from the wheel, does nothing if none is scheduled.
+ * @param wheel
+ * @param game
+ */
+void cancelGameTimeout(struct timerWheel *wheel, struct game *game);
+/**
+ * @param wheel
+ * @param now CLOCK_MONOTONIC milliseconds
+ * @return milliseconds until the next slot holding a timeout comes up, which may be before that timeout is due if it
+ * is more than a lap away, or -1 if the wheel is empty (suitable for epoll_wait)
+ */
+int getNextTimeout(const struct timerWheel *wheel, uint64_t now);
+/**
+ * For every game whose timeout has passed:
+ * If resends equals or exceeds MAX_RESENDS, end the game and close its socket so the slot can be handed to a new client.
+ * If resends is less than MAX_RESENDS, resend the last message to the client and schedule another timeout.
+ * If no game is in progress (it ended, or the client never started one), close the socket the client left open.
+ * Only games whose timeout actually expired are touched.
+ * @param shard
+ */
+void manageTimedOutGames(struct shard *shard);
+/**
+ * Validates a move against a tic tac toe board to make sure the square is available
+ * (ripped from lab 4 client code)
+ * @param move
+ * @param board
+ * @return 1 on valid, 0 on invalid
+ */
+int validateMove(unsigned char move, struct board board);
+/**
+ * validateMove() for a variant other than 3x3, which also enforces the variant's gravity.
+ * @param variant
+ * @param board
+ * @param move 1 based square
+ * @return 1 on valid, 0 on invalid
+ */
+int validateWideMove(const struct variant *variant, const struct wideBoard *board, unsigned char move);
+/**
+ * @param game
+ * @param move 1 based square
+ * @return 1 if the move is legal on the game's board, 0 otherwise
+ */
+int isLegalMove(const struct game *game, unsigned char move);
+/**
+ * Given an unparsed buffer containing data from a client, assigns values to a message object appropriately according to protocol
+ * @param buffer
+ * @return Initialized message object
+ */
+struct message parsePacketFromBuffer(const unsigned char buffer[]);
+/**
+ * Writes a message in its wire format, which depends on message->version (see struct message).
+ * @param message
+ * @param buffer at least EXTENDED_MESSAGE_SIZE bytes
+ * @return number of bytes written
+ */
+int serializeMessage(const struct message *message, unsigned char *buffer);
+/**
+ * Saves, journals and queues a reply with queueReply(), it goes out when the loop iteration ends.
+ * @param game
+ * @param message
+ */
+void sendPacketToClient(struct game* game, struct message* message);
+/**
+ * Copies a reply into the game's output buffer and puts the game on the shard's pendingSends list.
+ * Nothing is sent until flushSends() or flushUringSends().
+ * @param game
+ * @param wire serialized message
+ * @param length
+ */
+void queueReply(struct game *game, const unsigned char *wire, int length);
+/**
+ * Writes every game's queued replies with one sendmsg() per game, the epoll counterpart of flushUringSends().
+ * Games still waiting for EPOLLOUT are left to writeQueuedReplies().
+ * @param shard
+ */
+void flushSends(struct shard *shard);
+/**
+ * Writes as much of a game's output buffer as the socket takes, and arms EPOLLOUT for the rest or disarms it once
+ * there is no rest. Closes the game if the socket fails. A stalled game that has room for a reply again goes
+ * back to its frames.
+ * @param shard
+ * @param game
+ */
+void writeQueuedReplies(struct shard *shard, struct game *game);
+/**
+ * Converts a 1 dimensional array of each square's ASCII state ('X', 'O' or anything else for an open square) to the game's board.
+ * @param game with its variant already set
+ * @param buffer one byte per square of the variant's board, row by row
+ */
+void copyBoardStateToGame(struct game* game, const unsigned char *buffer);
 /**
  * Generates a reply (move or gameover) based on board state.
  * Checks if the board is in a game over state, if so returns a valid GAMEOVER packet
@@ -164,512 +1204,4252 @@ void copyBoardStateToGame(struct game* game, unsigned char buffer[9]);
  * @return the generated reply
  */
 struct message getServerReply(struct game* game);
+/**
+ * Drains all data currently available on a game's socket. Game sockets are registered edge-triggered,
+ * so this keeps reading straight into the game's ring buffer until the kernel reports EAGAIN,
+ * handing every complete frame in the buffer to handleClientMessage() after each read.
+ * A stalled game (see handleBufferedFrames()) stops reading and leaves the rest in the socket.
+ * Afterwards the game's timeout is pushed back GAME_TIMEOUT seconds while its client is
+ * connected, so a client that hangs on after its game ended is closed too.
+ * @param shard that owns the game
+ * @param game
+ */
+void handleGameData(struct shard *shard, struct game *game);
+/**
+ * Parses and handles every complete frame sitting in a game's ring buffer. A frame is a message, followed by
+ * the board state when the command is RESUME. Incomplete frames are left in the buffer for the next read.
+ * So are complete ones once the output buffer has no room for another reply. The game is then isReadStalled,
+ * and goes back to them when its replies drain (see writeQueuedReplies() and handleUringCompletion()).
+ * @param game
+ * @return the game now holding the socket, which differs from game if it adopted a recovered game
+ * (see adoptOrphanGame()), or NULL if the socket was closed while handling a frame
+ */
+struct game *handleBufferedFrames(struct game *game);
+/**
+ * VERSION clients from before board variants leave whatever they like in the position byte of NEWGAME and RESUME,
+ * so a variant the server doesn't host means 3x3 for them. EXTENDED_VERSION clients get dropped for it.
+ * @param version of the frame
+ * @param position byte of a NEWGAME or RESUME frame
+ * @return index into variants[] the client asked for, NUM_VARIANTS if the client has to be dropped
+ */
+unsigned char getRequestedVariant(unsigned char version, unsigned char position);
+/**
+ * A game recovered from the --state-file has no client until one reconnects. When a new client's first frame is a
+ * MOVE for such a game on this shard, the client's socket and any frames behind the MOVE are moved over to it
+ * and the client's own slot is released, so the game carries on where it was without a RESUME.
+ * @param game the new client's game
+ * @param messageIn the client's first message
+ * @return the game now holding the socket
+ */
+struct game *adoptOrphanGame(struct game *game, struct message messageIn);
+/**
+ * Maps the --state-file, creating or starting it over when it doesn't match the current layout.
+ * @param path
+ * @param numShards
+ * @param maxGames
+ * @return the first shard's records, followed by the others' (see getStateFileSlice()), or NULL on failure
+ */
+struct gameRecord *openStateFile(const char *path, int numShards, int maxGames);
+/**
+ * @param shard index of the shard
+ * @param numShards
+ * @param maxGames
+ * @return offset of the shard's first record, every slice starts on its own cache line
+ */
+size_t getStateFileSlice(int shard, int numShards, int maxGames);
+/**
+ * Writes a game's state to its record in the --state-file, does nothing without one.
+ * @param game
+ * @param lastMessage the message the client will be sent last, game->lastMessage may not be updated yet
+ */
+void saveGameRecord(struct game *game, const struct message *lastMessage);
+/**
+ * Copies a game's state into a record, everything but the record's sequence.
+ * @param game
+ * @param lastMessage the message the client will be sent last
+ * @param record
+ */
+void packGameRecord(const struct game *game, const struct message *lastMessage, struct gameRecord *record);
+/**
+ * Restores a game from its record if the record holds a complete game in progress. The game gets a fresh timeout
+ * and no socket, it waits for its client in adoptOrphanGame().
+ * @param shard
+ * @param game
+ * @param record
+ * @return 1 if the game was restored, 0 if the slot is free
+ */
+int restoreGameRecord(struct shard *shard, struct game *game, const struct gameRecord *record);
+/**
+ * Acts on a single complete message received from the client attached to a game (see protocol).
+ * @param game
+ * @param messageIn
+ * @param gameState one byte per square of the variant following a RESUME message, the token following a TOKEN message,
+ *                  NULL for every other command
+ * @return 1 if the game's socket is still open, 0 if it was closed while handling the message
+ */
+int handleClientMessage(struct game *game, struct message messageIn, const unsigned char *gameState);
+/**
+ * Closes a game's socket (which also removes it from the epoll set or ends its io_uring requests) and marks the game
+ * as no longer in progress. A --udp-port game's address is detached from it instead.
+ * @param game
+ */
+void closeGame(struct game *game);
+/**
+ * @param game
+ * @return milliseconds a game waits for its client before manageTimedOutGames() acts, evictAfter for the games it evicts
+ */
+int getGameTimeout(const struct game *game);
+/**
+ * Sends an idle 3x3 game's client a TOKEN frame, the server's last move and seqNum followed by the game's resume token,
+ * and closes the game. The client can carry on later, on this or any server with the same --token-key, by sending
+ * the token back in a TOKEN frame with its next move.
+ * @param game in progress and waiting for its client
+ */
+void evictGame(struct game *game);
+/**
+ * Takes a game on from the token in a client's TOKEN frame, and plays the client's move in it, or sends the server's
+ * last frame again when the frame doesn't carry the next seqNum.
+ * @param game the client's game
+ * @param messageIn the TOKEN frame
+ * @param wire the TOKEN_SIZE bytes following it
+ * @return 1 if the game's socket is still open, 0 if the token was rejected and the game closed
+ */
+int resumeFromToken(struct game *game, struct message messageIn, const unsigned char *wire);
+/**
+ * @param game
+ * @param issuedAt CLOCK_REALTIME seconds
+ * @param wire TOKEN_SIZE bytes to write the game's resume token to
+ */
+void packResumeToken(const struct game *game, uint32_t issuedAt, unsigned char *wire);
+/**
+ * @param wire TOKEN_SIZE bytes of a resume token
+ * @param now CLOCK_REALTIME seconds
+ * @param token filled in from the token, whether it is valid or not
+ * @return 1 if the token was made with tokenKey and is no older than TOKEN_LIFETIME, 0 otherwise
+ */
+int unpackResumeToken(const unsigned char *wire, uint32_t now, struct resumeToken *token);
+/**
+ * SipHash-2-4, a keyed hash that is also a MAC when the key is secret, cheap enough for a handful of bytes per eviction.
+ * @param key
+ * @param data
+ * @param length
+ * @return the 64 bit hash of data under key
+ */
+uint64_t sipHash(const uint64_t key[2], const unsigned char *data, size_t length);
+/**
+ * Fills tokenKey[] with the first 16 bytes of a file, or at random when path is NULL.
+ * @param path
+ * @return 1 on success, 0 on failure
+ */
+int loadTokenKey(const char *path);
+/**
+ * Sets up one shard: its own SO_REUSEPORT listening socket (and --udp-port socket), epoll instance (io_uring
+ * instance with --io uring) and slice of the game table. The multicast socket, if not -1, is serviced by this shard as well.
+ * @param shard to be initialized
+ * @param index of the shard, shard 0 runs on the main thread
+ * @param numGames number of game slots owned by this shard
+ * @param portNum
+ * @param listeningSD listening socket handed over by the previous process, -1 to create one
+ * @param multicastSD socket to service from this shard, or -1
+ * @param records numGames records to recover games from and save them to, or NULL
+ * @return 1 on success, 0 on failure
+ */
+int initializeShard(struct shard *shard, int index, int numGames, unsigned short portNum, int listeningSD,
+                    int multicastSD, struct gameRecord *records);
+/**
+ * Accepts every connection waiting on the shard's listening socket, up to listenBacklog of them, and gives each a
+ * free game or turns it away with rejectConnection().
+ * @param shard
+ */
+void acceptConnections(struct shard *shard);
+/**
+ * Turns away a connection there is no free game for: sends a GAMEOVER with position SERVER_FULL, so the client can
+ * look for another server at once instead of waiting for a reply, then closes it.
+ * @param shard
+ * @param sd accepted socket
+ */
+void rejectConnection(struct shard *shard, int sd);
+/**
+ * Answers a batch of up to discoveryBatchSize discovery multicasts with a single recvmmsg() and a single sendmmsg().
+ * Every well formed request (2 bytes, VERSION or EXTENDED_VERSION) gets an offer of that version + NBO port if this shard has a free game.
+ * Under epoll the socket is level-triggered, so anything left over is picked up on the next pass of the event loop,
+ * after the game sockets that were ready alongside it have been serviced.
+ * @param shard owning the multicast socket
+ * @return number of multicasts received, a full batch means more may be waiting
+ */
+int handleDiscoveryRequests(struct shard *shard);
+/**
+ * Receives a batch of up to UDP_BATCH datagrams on the shard's --udp-port socket with a single recvmmsg() and hands
+ * each one to its game as a frame. A datagram's game is the one its source address is attached to, a NEWGAME or
+ * RESUME from an address without one gets a free game (or SERVER_FULL), and the frame's game id is then checked by
+ * handleClientMessage() like on any socket. Replies go out with the shard's other replies in flushSends().
+ * The socket is level-triggered, so anything left over is picked up on the next pass of the event loop.
+ * @param shard
+ * @return number of datagrams received
+ */
+int handleDatagrams(struct shard *shard);
+/**
+ * @param shard
+ * @param address of a datagram's sender
+ * @return the game that address is attached to, NULL if there is none
+ */
+struct game *findDatagramGame(struct shard *shard, const struct sockaddr_in *address);
+/**
+ * Gives an address without a game one: a free game for NEWGAME, RESUME and TOKEN, turning the client away with SERVER_FULL
+ * if there is none, or with a --state-file the recovered game a MOVE names.
+ * @param shard
+ * @param address of the datagram's sender
+ * @param messageIn the datagram's frame
+ * @return the game, NULL if the datagram doesn't start one
+ */
+struct game *attachDatagramClient(struct shard *shard, const struct sockaddr_in *address, struct message messageIn);
+/**
+ * Takes a game's client off the shard's address table, see closeGame().
+ * @param shard
+ * @param game
+ */
+void detachDatagramClient(struct shard *shard, struct game *game);
+/**
+ * @param shard
+ * @param address
+ * @return index into shard->udpBuckets
+ */
+unsigned int getDatagramBucket(const struct shard *shard, const struct sockaddr_in *address);
+/**
+ * @param game
+ * @return 1 if the game's client plays over the shard's --udp-port socket
+ */
+int isDatagramGame(const struct game *game);
+/**
+ * Moves a game's queued replies into the shard's reply batch, one datagram per frame, sending the batch whenever it
+ * fills up. A datagram either goes out whole or not at all, so the queue is always left empty.
+ * @param shard
+ * @param game
+ */
+void queueDatagramReplies(struct shard *shard, struct game *game);
+/**
+ * @param shard
+ * @param address to send to
+ * @return room for a frame of EXTENDED_MESSAGE_SIZE + TOKEN_SIZE bytes at the end of the reply batch, whose iov_len
+ *         the caller sets
+ */
+unsigned char *addDatagramReply(struct shard *shard, const struct sockaddr_in *address);
+/**
+ * Sends the shard's reply batch with sendmmsg(). Whatever the socket won't take is dropped and counted, the games'
+ * timeouts resend it like any datagram lost on the way.
+ * @param shard
+ */
+void sendDatagramReplies(struct shard *shard);
+/**
+ * Event loop for one shard. Never returns; every game slot, socket and timer it touches belongs to this shard alone,
+ * so no locking happens on the move path.
+ * @param arg the struct shard to run
+ * @return never returns
+ */
+void *runShard(void *arg);
+/**
+ * Pushes a game's timeout back getGameTimeout() while its client is connected, otherwise cancels it.
+ * Called after the data from every readable socket has been handled.
+ * @param shard that owns the game
+ * @param game
+ */
+void refreshGameTimeout(struct shard *shard, struct game *game);
+/**
+ * Creates a shard's io_uring instance, maps its rings and registers its receive buffer ring.
+ * @param shard
+ * @return 1 on success, 0 on failure
+ */
+int initializeUring(struct shard *shard);
+/**
+ * @param uring
+ * @return the next free submission queue entry, zeroed. Pending entries are submitted first if the queue is full.
+ */
+struct io_uring_sqe *getUringSqe(struct uring *uring);
+/**
+ * Submits every pending entry and waits for at least one completion, all with a single io_uring_enter().
+ * @param uring
+ * @param timeout milliseconds to wait for a completion, -1 to wait forever, 0 to only submit
+ * @return 1 on success, 0 if the wait timed out or was interrupted
+ */
+int enterUring(struct uring *uring, int timeout);
+/**
+ * Arms a multishot accept on the shard's listening socket, accepted sockets are non-blocking.
+ * @param shard
+ */
+void queueUringAccept(struct shard *shard);
+/**
+ * Arms a multishot poll on the shard's multicast socket, discovery requests are still read with recvmmsg().
+ * @param shard
+ */
+void queueUringDiscovery(struct shard *shard);
+/**
+ * Arms a multishot recv on a game's socket that fills buffers from the shard's buffer ring.
+ * @param shard
+ * @param game
+ */
+void queueUringRecv(struct shard *shard, struct game *game);
+/**
+ * Queues one send, or two linked sends when the data wraps around the end of the output buffer, for every game with
+ * unsent replies and no send in flight. A game with sends in flight is picked up again when they complete, so a
+ * game's bytes always leave in order.
+ * @param shard
+ */
+void flushUringSends(struct shard *shard);
+/**
+ * Hands a receive buffer back to the kernel.
+ * @param uring
+ * @param bufferID
+ */
+void recycleUringBuffer(struct uring *uring, unsigned short bufferID);
+/**
+ * Appends data received for a game to its ring buffer and handles every complete frame, in as many rounds as the
+ * ring needs to take it all.
+ * @param shard
+ * @param game
+ * @param data
+ * @param length
+ */
+void handleUringGameData(struct shard *shard, struct game *game, const unsigned char *data, int length);
+/**
+ * Acts on a single io_uring completion. Completions for a game whose client has since gone are dropped.
+ * @param shard
+ * @param cqe
+ */
+void handleUringCompletion(struct shard *shard, const struct io_uring_cqe *cqe);
+/**
+ * Event loop for one shard on io_uring, selected with --io uring. Replies queued while handling completions are
+ * submitted together with the next wait, so a busy shard makes a single io_uring_enter() per pass of the loop.
+ * @param arg the struct shard to run
+ * @return never returns
+ */
+void *runShardUring(void *arg);
+/**
+ * Handles every completion the kernel has posted so far.
+ * @param shard
+ */
+void handleUringCompletions(struct shard *shard);
+/**
+ * Arms every long lived request a shard needs: accept, the discovery and upgrade polls and a recv per connected game.
+ * @param shard
+ */
+void armUringShard(struct shard *shard);
+/**
+ * Cancels every request on a shard's io_uring ahead of an upgrade, then handles whatever completes until every
+ * reply has been sent, so no data sits in a provided buffer or output buffer when the sockets are handed over.
+ * @param shard
+ */
+void quiesceUringShard(struct shard *shard);
+/**
+ * SIGUSR2 handler, wakes every shard through upgrade.eventSD.
+ * @param signal
+ */
+void handleUpgradeSignal(int signal);
+/**
+ * Sets up hot upgrades: the eventfd and barrier the shards use and the SIGUSR2 handler.
+ * @param argv the server's arguments, the replacement is started with them
+ * @param numShards
+ * @param maxGames
+ * @return 1 on success, 0 on failure
+ */
+int startUpgradeListener(char **argv, int numShards, int maxGames);
+/**
+ * Stops the shard for an upgrade. Once every shard has stopped, shard 0 hands everything over to a replacement
+ * process and exits. If that fails every shard carries on as before.
+ * @param shard
+ */
+void handleUpgradeRequest(struct shard *shard);
+/**
+ * Starts the replacement (this executable, with --takeover) and sends it every socket and game over
+ * upgrade.socketPath. Every shard must be stopped.
+ * @return 1 once the replacement has acknowledged everything, 0 on failure (the replacement is killed)
+ */
+int handOverToReplacement(void);
+/**
+ * Sends HELLO, every SHARD, every GAME and DONE, see struct upgradeMessage.
+ * @param sd connected --upgrade-socket
+ * @return 1 on success, 0 on failure
+ */
+int sendUpgradeState(int sd);
+/**
+ * @param sd
+ * @param message
+ * @param sockets descriptors to pass with the message
+ * @param numSockets at most 2
+ * @return 1 on success, 0 on failure
+ */
+int sendUpgradeMessage(int sd, const struct upgradeMessage *message, const int *sockets, int numSockets);
+/**
+ * @param sd
+ * @param message
+ * @param sockets room for 2 descriptors passed with the message
+ * @param numSockets number of descriptors that came with it
+ * @return 1 on success, 0 on failure
+ */
+int receiveUpgradeMessage(int sd, struct upgradeMessage *message, int *sockets, int *numSockets);
+/**
+ * Connects to the process being replaced and receives its sockets, called by the replacement before its shards exist.
+ * @param numShards must match the previous process
+ * @param maxGames must match the previous process
+ * @param multicastSD
+ * @param statsSD -1 if the previous process had none
+ * @param listeningSDs one per shard
+ * @return the connected --upgrade-socket, or -1 on failure
+ */
+int receiveUpgradeSockets(int numShards, int maxGames, int *multicastSD, int *statsSD, int *listeningSDs);
+/**
+ * Receives every game into the now initialized shards, rebuilds their free lists and acknowledges the hand over.
+ * @param sd from receiveUpgradeSockets(), closed afterwards
+ * @param shards
+ * @param numShards
+ * @return 1 on success, 0 on failure
+ */
+int receiveUpgradeGames(int sd, struct shard *shards, int numShards);
 int main (int argc, char *argv[]) {
-    srand(time(NULL));
-
-    struct timespec start, stop;
-    double timeDiffSeconds;
-    struct sockaddr_in server_address, multicast_address;
-    struct sockaddr_in from_address;
+    struct sockaddr_in multicast_address;
     unsigned short portNum;
-    socklen_t fromLength;
-    int rc;
-    unsigned char bufferIn[sizeof(struct message)];
-    fd_set socketSet;
-    int maxSD;
-    if (argc != 2) {
-        printf("usage is: ttts <port-number>\n");
+    int maxGames = DEFAULT_MAX_GAMES;
+    int numThreads = 1;
+
+    const struct option longOptions[] = {
+            {"max-games", required_argument, NULL, 'g'},
+            {"threads", required_argument, NULL, 't'},
+            {"difficulty", required_argument, NULL, 'd'},
+            {"discovery-batch", required_argument, NULL, 'b'},
+            {"log-level", required_argument, NULL, 'l'},
+            {"log-file", required_argument, NULL, 'f'},
+            {"stats-port", required_argument, NULL, 's'},
+            {"io", required_argument, NULL, 'i'},
+            {"state-file", required_argument, NULL, 'S'},
+            {"upgrade-socket", required_argument, NULL, 'U'},
+            {"takeover", no_argument, NULL, 'T'},
+            {"journal", required_argument, NULL, 'j'},
+            {"journal-size", required_argument, NULL, 'J'},
+            {"nagle", no_argument, NULL, 'N'},
+            {"backlog", required_argument, NULL, 'B'},
+            {"replicate", required_argument, NULL, 'r'},
+            {"selfplay", required_argument, NULL, 'p'},
+            {"opponent", required_argument, NULL, 'o'},
+            {"variant", required_argument, NULL, 'v'},
+            {"udp-port", required_argument, NULL, 'u'},
+            {"evict-after", required_argument, NULL, 'e'},
+            {"token-key", required_argument, NULL, 'k'},
+            {NULL, 0, NULL, 0}
+    };
+    int opt;
+    int statsPort = 0;
+    const char *statePath = NULL;
+    int isTakeover = 0;
+    const char *replicationTarget = NULL;
+    long selfPlayGames = 0;
+    const char *tokenKeyPath = NULL;
+    int isLogLevelSet = 0;
+    while((opt = getopt_long(argc, argv, "g:t:d:b:l:f:s:i:S:U:Tj:J:NB:r:p:o:v:u:e:k:", longOptions, NULL)) != -1){
+        if(opt == 'g'){
+            maxGames = strtol(optarg, NULL, 10);
+        }
+        else if(opt == 't'){
+            numThreads = strtol(optarg, NULL, 10);
+        }
+        else if(opt == 'd' || opt == 'o'){
+            double *epsilon = opt == 'd' ? &aiEpsilon : &opponentEpsilon;
+            if(strcmp(optarg, "random") == 0)
+                *epsilon = 1.0;
+            else if(strcmp(optarg, "perfect") == 0)
+                *epsilon = 0.0;
+            else{
+                char *end;
+                *epsilon = strtod(optarg, &end);
+                if(end == optarg || *end != '\0' || *epsilon < 0 || *epsilon > 1){
+                    printf("%s must be random, perfect or the probability of a random move (0-1)\n",
+                           opt == 'd' ? "difficulty" : "opponent");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+        else if(opt == 'b'){
+            discoveryBatchSize = strtol(optarg, NULL, 10);
+            if(discoveryBatchSize < 1 || discoveryBatchSize > MAX_DISCOVERY_BATCH){
+                printf("discovery-batch must be between 1 and %i\n", MAX_DISCOVERY_BATCH);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(opt == 'l'){
+            isLogLevelSet = 1;
+            if(strcmp(optarg, "error") == 0)
+                logLevel = LOG_ERROR;
+            else if(strcmp(optarg, "action") == 0)
+                logLevel = LOG_ACTION;
+            else if(strcmp(optarg, "data") == 0)
+                logLevel = LOG_DATA;
+            else{
+                printf("log-level must be error, action or data\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(opt == 'f'){
+            logOutput = fopen(optarg, "a");
+            if(logOutput == NULL){
+                perror("main:\tfopen():");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(opt == 's'){
+            statsPort = strtol(optarg, NULL, 10);
+            if(statsPort < 1 || statsPort > 65535){
+                printf("stats-port must be between 1 and 65535\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(opt == 'i'){
+            if(strcmp(optarg, "epoll") == 0)
+                useUring = 0;
+            else if(strcmp(optarg, "uring") == 0)
+                useUring = 1;
+            else{
+                printf("io must be epoll or uring\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(opt == 'S'){
+            statePath = optarg;
+        }
+        else if(opt == 'U'){
+            upgrade.socketPath = optarg;
+        }
+        else if(opt == 'T'){
+            isTakeover = 1;
+        }
+        else if(opt == 'j'){
+            journal.path = optarg;
+        }
+        else if(opt == 'J'){
+            long megabytes = strtol(optarg, NULL, 10);
+            if(megabytes < 1){
+                printf("journal-size must be at least 1 (MiB)\n");
+                exit(EXIT_FAILURE);
+            }
+            journal.fileSize = (size_t)megabytes << 20;
+        }
+        else if(opt == 'N'){
+            useNagle = 1;
+        }
+        else if(opt == 'r'){
+            replicationTarget = optarg;
+        }
+        else if(opt == 'p'){
+            selfPlayGames = strtol(optarg, NULL, 10);
+            if(selfPlayGames < 1 || selfPlayGames > UINT32_MAX){
+                printf("selfplay must be between 1 and %u games\n", UINT32_MAX);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(opt == 'v'){
+            int variant = strtol(optarg, NULL, 10);
+            if(variant < 0 || variant >= NUM_VARIANTS){
+                printf("variant must be between 0 and %i\n", NUM_VARIANTS - 1);
+                exit(EXIT_FAILURE);
+            }
+            selfPlayVariant = variant;
+        }
+        else if(opt == 'u'){
+            long port = strtol(optarg, NULL, 10);
+            if(port < 1 || port > 65535){
+                printf("udp-port must be between 1 and 65535\n");
+                exit(EXIT_FAILURE);
+            }
+            udpPort = port;
+        }
+        else if(opt == 'e'){
+            evictAfter = strtol(optarg, NULL, 10);
+            if(evictAfter < 1){
+                printf("evict-after must be at least 1 (second)\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(opt == 'k'){
+            tokenKeyPath = optarg;
+        }
+        else if(opt == 'B'){
+            listenBacklog = strtol(optarg, NULL, 10);
+            if(listenBacklog < 1){
+                printf("backlog must be at least 1\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else{
+            optind = argc + 1; //force the usage message
+            break;
+        }
+    }
+    if (argc - optind != (selfPlayGames > 0 ? 0 : 1)) {
+        printf("usage is: ttts [--max-games <n>] [--threads <n>] [--difficulty random|perfect|<0-1>] [--discovery-batch <n>]\n"
+               "                [--log-level error|action|data] [--log-file <path>] [--stats-port <port>] [--io epoll|uring]\n"
+               "                [--state-file <path>] [--upgrade-socket <path>] [--journal <path>] [--journal-size <MiB>]\n"
+               "                [--nagle] [--backlog <n>] [--replicate <group>:<port>] [--udp-port <port>]\n"
+               "                [--evict-after <seconds>] [--token-key <path>] <port-number>\n"
+               "   or: ttts --selfplay <games> [--threads <n>] [--difficulty <X's>] [--opponent random|perfect|<0-1>]\n"
+               "                [--variant <0-%i>] [--log-level error|action|data] [--log-file <path>]\n", NUM_VARIANTS - 1);
+        exit(EXIT_FAILURE);
+    }
+    if(numThreads < 1 || numThreads > MAX_THREADS){
+        printf("threads must be between 1 and %i\n", MAX_THREADS);
+        exit(EXIT_FAILURE);
+    }
+    if(maxGames < numThreads){
+        printf("max-games must be at least %i\n", numThreads);
+        exit(EXIT_FAILURE);
+    }
+    //self-play needs no sockets, only the game logic and the logger
+    if(selfPlayGames > 0){
+        if(!isLogLevelSet)
+            logLevel = LOG_ERROR;
+        initializeWinTable();
+        initializeAITable();
+        if(!startLogger(numThreads)){
+            printf("\nCouldn't start logger, exiting.");
+            exit(EXIT_FAILURE);
+        }
+        int isConsistent = runSelfPlay(selfPlayGames, numThreads);
+        waitForLogger();
+        exit(isConsistent ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    //datagram games have no socket of their own to hand over, and io_uring has no recvmmsg()
+    if(udpPort != 0 && (useUring || upgrade.socketPath != NULL)){
+        printf("udp-port works with --io epoll and without --upgrade-socket only\n");
+        exit(EXIT_FAILURE);
+    }
+    if(isTakeover && upgrade.socketPath == NULL){
+        printf("takeover needs the --upgrade-socket of the process being replaced\n");
         exit(EXIT_FAILURE);
     }
 
-    int multicastSD;
-    if(!createMulticastSocket(&multicastSD, &multicast_address)){
-        printf("\nCouldn't create multicast socket, exiting.");
-        exit(EXIT_FAILURE);
+    //a replacement gets every socket from the process it replaces instead of creating its own
+    int multicastSD;
+    int statsSD = -1;
+    int listeningSDs[MAX_THREADS];
+    int upgradeSD = -1;
+    for(int n=0; n < numThreads; n++)
+        listeningSDs[n] = -1;
+    if(isTakeover){
+        upgradeSD = receiveUpgradeSockets(numThreads, maxGames, &multicastSD, &statsSD, listeningSDs);
+        if(upgradeSD == -1){
+            printf("\nCouldn't take over from the previous process, exiting.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if(!createMulticastSocket(&multicastSD, &multicast_address)){
+        printf("\nCouldn't create multicast socket, exiting.");
+        exit(EXIT_FAILURE);
+    }
+    if(upgrade.socketPath != NULL && !startUpgradeListener(argv, numThreads, maxGames)){
+        printf("\nCouldn't set up upgrades, exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    portNum = strtol(argv[optind], NULL, 10);
+
+    initializeWinTable();
+    initializeAITable();
+    if(!startLogger(numThreads)){
+        printf("\nCouldn't start logger, exiting.");
+        exit(EXIT_FAILURE);
+    }
+    if(!loadTokenKey(tokenKeyPath)){
+        printf("\nCouldn't load the token key, exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct shard *shards = calloc(numThreads, sizeof(struct shard));
+    if(shards == NULL){
+        perror("main:\tcalloc():");
+        exit(EXIT_FAILURE);
+    }
+    struct gameRecord *records = NULL;
+    if(statePath != NULL && (records = openStateFile(statePath, numThreads, maxGames)) == NULL){
+        printf("\nCouldn't open state file, exiting.");
+        exit(EXIT_FAILURE);
+    }
+    for(int n=0; n < numThreads; n++){
+        //spread the remainder over the first shards
+        int numGames = maxGames / numThreads + (n < maxGames % numThreads ? 1 : 0);
+        //there is a single multicast group membership, shard 0 answers discovery requests
+        struct gameRecord *shardRecords = records != NULL ? records + getStateFileSlice(n, numThreads, maxGames) : NULL;
+        if(!initializeShard(&shards[n], n, numGames, portNum, listeningSDs[n], n == 0 ? multicastSD : -1, shardRecords)){
+            printf("\nCouldn't create shard %i, exiting.", n);
+            exit(EXIT_FAILURE);
+        }
+    }
+    //loop passes only look at a game's timer entry and occupied bit, the rest is only touched by the game's own traffic
+    printf("\nEach game takes %zu bytes and a bit, %zu of them scanned by every loop pass\n",
+           sizeof(struct game) + sizeof(struct wideBoard) + sizeof(int) + sizeof(struct gameTimer)
+           + (records != NULL ? sizeof(struct gameRecord) : 0) + (udpPort != 0 ? sizeof(struct udpPeer) + sizeof(int) : 0),
+           sizeof(struct gameTimer));
+    if(journal.path != NULL && !startJournal(shards, numThreads)){
+        printf("\nCouldn't start journal, exiting.");
+        exit(EXIT_FAILURE);
+    }
+    if(replicationTarget != NULL && !startReplication(replicationTarget, shards, numThreads, portNum)){
+        printf("\nCouldn't start replication, exiting.");
+        exit(EXIT_FAILURE);
+    }
+    upgrade.shards = shards;
+    if(upgradeSD != -1 && !receiveUpgradeGames(upgradeSD, shards, numThreads)){
+        printf("\nCouldn't take over games from the previous process, exiting.");
+        exit(EXIT_FAILURE);
+    }
+
+    if((statsPort != 0 || statsSD != -1) && !startStatsServer(statsPort, &statsSD, shards, numThreads)){
+        printf("\nCouldn't start stats server, exiting.");
+        exit(EXIT_FAILURE);
+    }
+    upgrade.statsSD = statsSD;
+
+    printf("Waiting for play requests on %i thread(s)...\n", numThreads);
+
+    void *(*run)(void *) = useUring ? runShardUring : runShard;
+    for(int n=1; n < numThreads; n++){
+        pthread_t thread;
+        int rc = pthread_create(&thread, NULL, run, &shards[n]);
+        if(rc != 0){
+            printf("main:\tpthread_create(): %s\n", strerror(rc));
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    run(&shards[0]);
+}
+
+int initializeShard(struct shard *shard, const int index, const int numGames, const unsigned short portNum, const int listeningSD,
+                    const int multicastSD, struct gameRecord *records){
+    struct sockaddr_in server_address;
+    struct epoll_event event;
+
+    shard->index = index;
+    shard->numGames = numGames;
+    shard->portNum = portNum;
+    shard->multicastSD = multicastSD;
+    shard->listeningSD = listeningSD;
+    shard->udpSD = -1;
+    if(listeningSD == -1 && !createListeningSocket(&shard->listeningSD, portNum, &server_address, listenBacklog)){
+        return 0;
+    }
+    //a socket taken over from the previous process gets this process's backlog, listen() on it again only resizes it
+    if(listeningSD != -1 && (fcntl(listeningSD, F_SETFL, fcntl(listeningSD, F_GETFL) | O_NONBLOCK) != 0
+                             || listen(listeningSD, listenBacklog) != 0)){
+        perror("initializeShard:\tlisten():");
+        return 0;
+    }
+    //accepted sockets inherit TCP_NODELAY, replies are already coalesced per loop iteration so Nagle would only delay them
+    int noDelay = !useNagle;
+    if(setsockopt(shard->listeningSD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)) != 0){
+        perror("initializeShard:\tsetsockopt():");
+        return 0;
+    }
+
+    shard->games = aligned_alloc(CACHE_LINE_SIZE, numGames * sizeof(struct game));
+    shard->freeSlots = malloc(numGames * sizeof(int));
+    shard->occupiedSlots = calloc((numGames + 63) / 64, sizeof(uint64_t));
+    shard->wideBoards = calloc(numGames, sizeof(struct wideBoard));
+    shard->timers.entries = calloc(numGames, sizeof(struct gameTimer));
+    if(shard->games == NULL || shard->freeSlots == NULL || shard->occupiedSlots == NULL || shard->wideBoards == NULL
+       || shard->timers.entries == NULL){
+        perror("initializeShard:\taligned_alloc():");
+        return 0;
+    }
+    memset(shard->games, 0, numGames * sizeof(struct game));
+    memset(shard->timers.slots, 0xFF, sizeof(shard->timers.slots));
+    for(int n=0; n < numGames; n++){
+        shard->games[n].id = n;
+        shard->games[n].shard = shard;
+        shard->games[n].isInProgress = 0;
+        shard->games[n].bufferHead = 0;
+        shard->games[n].bufferTail = 0;
+        shard->games[n].socket = 0;
+    }
+    shard->records = records;
+    shard->now = getMonotonicMillis();
+    shard->timers.currentTick = shard->now / TIMER_TICK_MS;
+    //pushed in reverse so the lowest ids are handed out first, recovered games stay off the list until they end
+    shard->numFreeSlots = 0;
+    int recovered = 0;
+    for(int n=numGames - 1; n >= 0; n--){
+        if(records != NULL && restoreGameRecord(shard, &shard->games[n], &records[n])){
+            shard->occupiedSlots[n / 64] |= 1ULL << (n % 64);
+            recovered++;
+        }
+        else
+            shard->freeSlots[shard->numFreeSlots++] = n;
+    }
+    if(records != NULL)
+        printf("\nShard %i recovered %i game(s) from the state file\n", index, recovered);
+
+    if(udpPort != 0){
+        if(!createDatagramSocket(&shard->udpSD, udpPort))
+            return 0;
+        //at least as many buckets as games, so chains stay a game or two long
+        unsigned int numBuckets = 1;
+        while(numBuckets < (unsigned int)numGames)
+            numBuckets <<= 1;
+        shard->udpBucketMask = numBuckets - 1;
+        shard->udpPeers = calloc(numGames, sizeof(struct udpPeer));
+        shard->udpBuckets = malloc(numBuckets * sizeof(int));
+        shard->udp = calloc(1, sizeof(struct udpBatch));
+        if(shard->udpPeers == NULL || shard->udpBuckets == NULL || shard->udp == NULL){
+            perror("initializeShard:\tcalloc():");
+            return 0;
+        }
+        memset(shard->udpBuckets, 0xFF, numBuckets * sizeof(int));
+    }
+
+    if(multicastSD != -1){
+        int batch = discoveryBatchSize;
+        shard->discoveryRequests = calloc(batch, sizeof(struct mmsghdr));
+        shard->discoveryReplies = calloc(batch, sizeof(struct mmsghdr));
+        shard->discoveryIov = calloc(batch, sizeof(struct iovec));
+        shard->discoveryAddresses = calloc(batch, sizeof(struct sockaddr_in));
+        shard->discoveryData = calloc(batch, sizeof(*shard->discoveryData));
+        if(shard->discoveryRequests == NULL || shard->discoveryReplies == NULL || shard->discoveryIov == NULL
+           || shard->discoveryAddresses == NULL || shard->discoveryData == NULL){
+            perror("initializeShard:\tcalloc():");
+            return 0;
+        }
+        //every offer is the same version + NBO port
+        unsigned short nboPort = htons(portNum);
+        shard->discoveryOffers[0][0] = VERSION;
+        shard->discoveryOffers[1][0] = EXTENDED_VERSION;
+        memcpy(shard->discoveryOffers[0] + 1, &nboPort, 2);
+        memcpy(shard->discoveryOffers[1] + 1, &nboPort, 2);
+    }
+    if(useUring)
+        return initializeUring(shard);
+
+    // the listening and multicast sockets stay level-triggered, one backlog drain (or discovery batch) per wakeup.
+    // data.ptr tells the two apart from game sockets, whose data.ptr is the game itself.
+    shard->epollSD = epoll_create1(0);
+    if(shard->epollSD == -1){
+        perror("initializeShard:\tepoll_create1():");
+        return 0;
+    }
+    event.events = EPOLLIN;
+    if(multicastSD != -1){
+        event.data.ptr = &shard->multicastSD;
+        if(epoll_ctl(shard->epollSD, EPOLL_CTL_ADD, multicastSD, &event) != 0){
+            perror("initializeShard:\tepoll_ctl():");
+            return 0;
+        }
+    }
+    if(upgrade.eventSD != -1){
+        event.data.ptr = &upgrade.eventSD;
+        if(epoll_ctl(shard->epollSD, EPOLL_CTL_ADD, upgrade.eventSD, &event) != 0){
+            perror("initializeShard:\tepoll_ctl():");
+            return 0;
+        }
+    }
+    event.data.ptr = &shard->listeningSD;
+    if(epoll_ctl(shard->epollSD, EPOLL_CTL_ADD, shard->listeningSD, &event) != 0){
+        perror("initializeShard:\tepoll_ctl():");
+        return 0;
+    }
+    if(shard->udpSD != -1){
+        event.data.ptr = &shard->udpSD;
+        if(epoll_ctl(shard->epollSD, EPOLL_CTL_ADD, shard->udpSD, &event) != 0){
+            perror("initializeShard:\tepoll_ctl():");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void *runShard(void *arg){
+    struct shard *shard = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    aiSeed = time(NULL) ^ (shard->index * 2654435761u);
+    threadLogRing = &logRings[shard->index];
+
+    //replies a hot upgrade handed over go out before the first wait
+    flushSends(shard);
+    while (1) {
+        COUNT(shard->metrics.syscalls);
+        int numEvents = epoll_wait(shard->epollSD, events, MAX_EVENTS, getNextTimeout(&shard->timers, getMonotonicMillis()));
+        shard->wokeAt = getMonotonicNanos();
+        shard->now = shard->wokeAt / 1000000;
+
+        for(int n=0; n < numEvents; n++){
+            if(events[n].data.ptr == &shard->multicastSD){
+                handleDiscoveryRequests(shard);
+            }
+            else if(events[n].data.ptr == &upgrade.eventSD){
+                shard->isUpgradeRequested = 1;
+            }
+            else if(events[n].data.ptr == &shard->listeningSD){
+                acceptConnections(shard);
+            }
+            else if(events[n].data.ptr == &shard->udpSD){
+                handleDatagrams(shard);
+            }
+            else{
+                struct game *game = events[n].data.ptr;
+                if(events[n].events & EPOLLOUT)
+                    writeQueuedReplies(shard, game);
+                if(events[n].events & ~EPOLLOUT)
+                    handleGameData(shard, game);
+            }
+        }
+        manageTimedOutGames(shard);
+        flushSends(shard);
+        if(shard->isUpgradeRequested)
+            handleUpgradeRequest(shard);
+    }
+}
+
+void acceptConnections(struct shard *shard){
+    for(int n = 0; n < listenBacklog; n++){
+        COUNT(shard->metrics.syscalls);
+        int gameSD = accept4(shard->listeningSD, NULL, NULL, SOCK_NONBLOCK);
+        if(gameSD == -1 && errno == EINTR)
+            continue;
+        if(gameSD == -1){
+            //EAGAIN once the backlog is drained, anything else (EMFILE, ENOBUFS) is retried on the next wakeup
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_ERRNO("acceptConnections:\taccept()");
+            return;
+        }
+        COUNT(shard->metrics.acceptedConnections);
+        LOG(LOG_ACTION, "[ACTION]:\tGot connection request from a client, searching for an open game id...\n");
+        int id = allocateGameSlot(shard);
+        if(id == -1){
+            rejectConnection(shard, gameSD);
+            continue;
+        }
+        struct game *game = &shard->games[id];
+        struct epoll_event event = {.events = EPOLLIN | EPOLLET, .data.ptr = game};
+        COUNT(shard->metrics.syscalls);
+        if(epoll_ctl(shard->epollSD, EPOLL_CTL_ADD, gameSD, &event) != 0){
+            LOG_ERRNO("acceptConnections:\tepoll_ctl()");
+            close(gameSD);
+            releaseGameSlot(shard, game);
+            continue;
+        }
+        LOG(LOG_ACTION, "[ACTION]:\tCreated socket for game id %i on shard %i\n", id, shard->index);
+        game->socket = gameSD;
+        game->bufferHead = 0;
+        game->bufferTail = 0;
+        //a client that connects and never sends anything still has to give its slot back
+        scheduleGameTimeout(&shard->timers, game, shard->now + GAME_TIMEOUT * 1000);
+    }
+}
+
+void rejectConnection(struct shard *shard, const int sd){
+    LOG(LOG_ACTION, "[ACTION]:\tCouldn't find available game ID for game, rejecting.\n");
+    COUNT(shard->metrics.rejectedConnections);
+    //version 0x06 framing, the client hasn't told us its version yet
+    const unsigned char full[MESSAGE_SIZE] = {VERSION, GAMEOVER, SERVER_FULL, 0, 0};
+    COUNT(shard->metrics.syscalls);
+    send(sd, full, sizeof(full), MSG_NOSIGNAL | MSG_DONTWAIT);
+    //closing with unread data resets the connection, which can destroy the frame before the client reads it
+    unsigned char discard[GAME_BUFFER_SIZE];
+    do
+        COUNT(shard->metrics.syscalls);
+    while(recv(sd, discard, sizeof(discard), MSG_DONTWAIT) > 0);
+    COUNT(shard->metrics.syscalls);
+    close(sd);
+}
+
+int handleDiscoveryRequests(struct shard *shard){
+    for(int n = 0; n < discoveryBatchSize; n++){
+        shard->discoveryIov[n].iov_base = shard->discoveryData[n];
+        shard->discoveryIov[n].iov_len = sizeof(shard->discoveryData[n]);
+        memset(&shard->discoveryRequests[n].msg_hdr, 0, sizeof(struct msghdr));
+        shard->discoveryRequests[n].msg_hdr.msg_name = &shard->discoveryAddresses[n];
+        shard->discoveryRequests[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        shard->discoveryRequests[n].msg_hdr.msg_iov = &shard->discoveryIov[n];
+        shard->discoveryRequests[n].msg_hdr.msg_iovlen = 1;
+    }
+    COUNT(shard->metrics.syscalls);
+    int received = recvmmsg(shard->multicastSD, shard->discoveryRequests, discoveryBatchSize, MSG_DONTWAIT, NULL);
+    if(received <= 0)
+        return 0;
+
+    //a single free slot is enough to make an offer, whoever connects first gets it
+    if(shard->numFreeSlots == 0)
+        return received;
+
+    //clients get an offer in the version they asked with
+    struct iovec offerIov[2] = {
+            {.iov_base = shard->discoveryOffers[0], .iov_len = DISCOVERY_REPLY_SIZE},
+            {.iov_base = shard->discoveryOffers[1], .iov_len = DISCOVERY_REPLY_SIZE}
+    };
+    int replies = 0;
+    for(int n = 0; n < received; n++){
+        unsigned char version = shard->discoveryData[n][0];
+        if(shard->discoveryRequests[n].msg_len != 2 || (version != VERSION && version != EXTENDED_VERSION))
+            continue; //ignore any malformed multicasts
+        memset(&shard->discoveryReplies[replies].msg_hdr, 0, sizeof(struct msghdr));
+        shard->discoveryReplies[replies].msg_hdr.msg_name = &shard->discoveryAddresses[n];
+        shard->discoveryReplies[replies].msg_hdr.msg_namelen = shard->discoveryRequests[n].msg_hdr.msg_namelen;
+        shard->discoveryReplies[replies].msg_hdr.msg_iov = &offerIov[version == EXTENDED_VERSION];
+        shard->discoveryReplies[replies].msg_hdr.msg_iovlen = 1;
+        replies++;
+    }
+    LOG(LOG_DATA, "[DATA]:\tSENT\t%x %x\tto %i of %i discovery requests\n",
+           shard->discoveryOffers[0][1], shard->discoveryOffers[0][2], replies, received);
+    for(int n = 0; n < replies; n++)
+        COUNT(shard->metrics.discoveryOffers);
+    for(int sent = 0; sent < replies; ){
+        COUNT(shard->metrics.syscalls);
+        int rc = sendmmsg(shard->multicastSD, shard->discoveryReplies + sent, replies - sent, 0);
+        if(rc <= 0){
+            LOG_ERRNO("handleDiscoveryRequests:\tsendmmsg()");
+            break;
+        }
+        sent += rc;
+    }
+    return received;
+}
+
+int handleDatagrams(struct shard *shard){
+    struct udpBatch *batch = shard->udp;
+    for(int n = 0; n < UDP_BATCH; n++){
+        batch->requestIov[n].iov_base = batch->requestData[n];
+        batch->requestIov[n].iov_len = sizeof(batch->requestData[n]);
+        memset(&batch->requests[n].msg_hdr, 0, sizeof(struct msghdr));
+        batch->requests[n].msg_hdr.msg_name = &batch->requestAddresses[n];
+        batch->requests[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        batch->requests[n].msg_hdr.msg_iov = &batch->requestIov[n];
+        batch->requests[n].msg_hdr.msg_iovlen = 1;
+    }
+    COUNT(shard->metrics.syscalls);
+    int received = recvmmsg(shard->udpSD, batch->requests, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if(received <= 0)
+        return 0;
+
+    shard->readableAt = shard->wokeAt;
+    for(int n = 0; n < received; n++){
+        COUNT(shard->metrics.datagramsReceived);
+        const unsigned char *data = batch->requestData[n];
+        unsigned int length = batch->requests[n].msg_len;
+        //a datagram is exactly one frame, a RESUME with the board of its variant behind it
+        unsigned int headerLength = data[0] == EXTENDED_VERSION ? EXTENDED_MESSAGE_SIZE : MESSAGE_SIZE;
+        unsigned int frameLength = headerLength;
+        unsigned char variant = length >= MESSAGE_SIZE ? getRequestedVariant(data[0], data[2]) : NUM_VARIANTS;
+        if(length >= MESSAGE_SIZE && data[1] == RESUME && variant < NUM_VARIANTS)
+            frameLength += variants[variant].rows * variants[variant].columns;
+        else if(length >= MESSAGE_SIZE && data[1] == TOKEN)
+            frameLength += TOKEN_SIZE;
+        if(length < frameLength){
+            COUNT(shard->metrics.strayDatagrams);
+            continue;
+        }
+        struct message messageIn = parsePacketFromBuffer(data);
+        struct game *game = findDatagramGame(shard, &batch->requestAddresses[n]);
+        //a NEWGAME is only repeated until its reply arrives, past that the address belongs to a new client the
+        //kernel gave the port of one that went away without a GAMEOVER
+        if(game != NULL && messageIn.command == NEWGAME && game->isInProgress && game->currentSeqNum > 1){
+            LOG(LOG_ACTION, "[ACTION]:\tNEWGAME for game %i past its first move, its address has a new client\n", game->id);
+            closeGame(game);
+            cancelGameTimeout(&shard->timers, game);
+            game = NULL;
+        }
+        if(game == NULL && (game = attachDatagramClient(shard, &batch->requestAddresses[n], messageIn)) == NULL)
+            continue;
+        //a datagram client never hangs up, so even a finished game keeps a timeout to free it, see manageTimedOutGames()
+        if(handleClientMessage(game, messageIn, frameLength > headerLength ? data + headerLength : NULL))
+            scheduleGameTimeout(&shard->timers, game, shard->now + getGameTimeout(game));
+        else
+            cancelGameTimeout(&shard->timers, game);
+    }
+    shard->readableAt = 0;
+    return received;
+}
+
+struct game *findDatagramGame(struct shard *shard, const struct sockaddr_in *address){
+    for(int id = shard->udpBuckets[getDatagramBucket(shard, address)]; id != -1; id = shard->udpPeers[id].next){
+        const struct sockaddr_in *peer = &shard->udpPeers[id].address;
+        if(peer->sin_addr.s_addr == address->sin_addr.s_addr && peer->sin_port == address->sin_port)
+            return &shard->games[id];
+    }
+    return NULL;
+}
+
+struct game *attachDatagramClient(struct shard *shard, const struct sockaddr_in *address, const struct message messageIn){
+    struct game *game = NULL;
+    if(messageIn.command == NEWGAME || messageIn.command == RESUME || messageIn.command == TOKEN){
+        COUNT(shard->metrics.acceptedConnections);
+        int id = allocateGameSlot(shard);
+        if(id == -1){
+            LOG(LOG_ACTION, "[ACTION]:\tCouldn't find available game ID for datagram client, rejecting.\n");
+            COUNT(shard->metrics.rejectedConnections);
+            unsigned char *full = addDatagramReply(shard, address);
+            const unsigned char frame[MESSAGE_SIZE] = {VERSION, GAMEOVER, SERVER_FULL, 0, 0};
+            memcpy(full, frame, MESSAGE_SIZE);
+            shard->udp->replyIov[shard->udp->numReplies - 1].iov_len = MESSAGE_SIZE;
+            return NULL;
+        }
+        game = &shard->games[id];
+        game->bufferHead = 0;
+        game->bufferTail = 0;
+    }
+    else if(messageIn.command == MOVE && shard->records != NULL && messageIn.id < (unsigned int)shard->numGames){
+        //same as adoptOrphanGame(), a client of a recovered game carries on from a new address
+        struct game *orphan = &shard->games[messageIn.id];
+        if(orphan->isInProgress && orphan->socket <= 0 && orphan->version == messageIn.version)
+            game = orphan;
+    }
+    if(game == NULL){
+        COUNT(shard->metrics.strayDatagrams);
+        return NULL;
+    }
+    LOG(LOG_ACTION, "[ACTION]:\tAttached datagram client to game id %i on shard %i\n", game->id, shard->index);
+    unsigned int bucket = getDatagramBucket(shard, address);
+    shard->udpPeers[game->id].address = *address;
+    shard->udpPeers[game->id].next = shard->udpBuckets[bucket];
+    shard->udpBuckets[bucket] = game->id;
+    game->socket = shard->udpSD;
+    return game;
+}
+
+void detachDatagramClient(struct shard *shard, struct game *game){
+    int *link = &shard->udpBuckets[getDatagramBucket(shard, &shard->udpPeers[game->id].address)];
+    while(*link != -1 && *link != (int)game->id)
+        link = &shard->udpPeers[*link].next;
+    if(*link != -1)
+        *link = shard->udpPeers[game->id].next;
+}
+
+unsigned int getDatagramBucket(const struct shard *shard, const struct sockaddr_in *address){
+    uint64_t key = (uint64_t)address->sin_addr.s_addr << 16 | address->sin_port;
+    return (key * 0x9E3779B97F4A7C15ull) >> 32 & shard->udpBucketMask;
+}
+
+int isDatagramGame(const struct game *game){
+    return game->socket > 0 && game->socket == game->shard->udpSD;
+}
+
+void queueDatagramReplies(struct shard *shard, struct game *game){
+    const unsigned int mask = OUT_BUFFER_SIZE - 1;
+    while(game->outTail != game->outHead){
+        //replies never carry a board, their version says how long they are, and a TOKEN adds its token
+        int length = game->outBuffer[game->outTail & mask] == EXTENDED_VERSION ? EXTENDED_MESSAGE_SIZE : MESSAGE_SIZE;
+        if(game->outBuffer[(game->outTail + 1) & mask] == TOKEN)
+            length += TOKEN_SIZE;
+        unsigned char *data = addDatagramReply(shard, &shard->udpPeers[game->id].address);
+        for(int n = 0; n < length; n++)
+            data[n] = game->outBuffer[(game->outTail + n) & mask];
+        shard->udp->replyIov[shard->udp->numReplies - 1].iov_len = length;
+        game->outTail += length;
+    }
+    game->outSent = game->outTail;
+}
+
+unsigned char *addDatagramReply(struct shard *shard, const struct sockaddr_in *address){
+    struct udpBatch *batch = shard->udp;
+    if(batch->numReplies == UDP_BATCH)
+        sendDatagramReplies(shard);
+    int n = batch->numReplies++;
+    batch->replyAddresses[n] = *address;
+    batch->replyIov[n].iov_base = batch->replyData[n];
+    memset(&batch->replies[n].msg_hdr, 0, sizeof(struct msghdr));
+    batch->replies[n].msg_hdr.msg_name = &batch->replyAddresses[n];
+    batch->replies[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    batch->replies[n].msg_hdr.msg_iov = &batch->replyIov[n];
+    batch->replies[n].msg_hdr.msg_iovlen = 1;
+    return batch->replyData[n];
+}
+
+void sendDatagramReplies(struct shard *shard){
+    struct udpBatch *batch = shard->udp;
+    for(int sent = 0; sent < batch->numReplies; ){
+        COUNT(shard->metrics.syscalls);
+        int rc = sendmmsg(shard->udpSD, batch->replies + sent, batch->numReplies - sent, 0);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            for(; sent < batch->numReplies; sent++)
+                COUNT(shard->metrics.datagramsDropped);
+            break;
+        }
+        if(rc < 0){
+            //sendmmsg() stops at the first datagram that fails, skip just that one
+            LOG_ERRNO("sendDatagramReplies:\tsendmmsg()");
+            COUNT(shard->metrics.datagramsDropped);
+            sent++;
+            continue;
+        }
+        sent += rc;
+    }
+    batch->numReplies = 0;
+}
+
+void handleGameData(struct shard *shard, struct game *game){
+    shard->readableAt = shard->wokeAt;
+    //frames left behind until their replies had room go first
+    if(game->isReadStalled){
+        game->isReadStalled = 0;
+        struct game *owner = handleBufferedFrames(game);
+        if(owner != NULL)
+            game = owner;
+    }
+    while(game->socket > 0 && !game->isReadStalled){
+        //read into the free part of the ring, which wraps around the end of the buffer at most once
+        unsigned int used = game->bufferHead - game->bufferTail;
+        unsigned int start = game->bufferHead & (GAME_BUFFER_SIZE - 1);
+        unsigned int space = GAME_BUFFER_SIZE - used;
+        struct iovec iov[2];
+        iov[0].iov_base = game->buffer + start;
+        iov[0].iov_len = space < GAME_BUFFER_SIZE - start ? space : GAME_BUFFER_SIZE - start;
+        iov[1].iov_base = game->buffer;
+        iov[1].iov_len = space - iov[0].iov_len;
+        COUNT(shard->metrics.syscalls);
+        int rc = readv(game->socket, iov, iov[1].iov_len > 0 ? 2 : 1);
+        if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break; //socket drained, wait for the next edge
+        if(rc < 0 && errno == EINTR)
+            continue;
+
+        LOG(LOG_ACTION, "[ACTION]:\tData available for game id %i\n", game->id);
+
+        if(rc <= 0){ //disconnect
+            LOG(LOG_ACTION, "[ACTION]:\tBroken pipe for game %i, ending game and cleaning up\n", game->id);
+            closeGame(game);
+            break;
+        }
+        game->bufferHead += rc;
+        LOG(LOG_ACTION, "[ACTION]:\tReceived %i bytes for game %i, %i bytes buffered\n", rc, game->id, (int)(game->bufferHead - game->bufferTail));
+
+        struct game *owner = handleBufferedFrames(game);
+        if(owner == NULL)
+            break;
+        game = owner;
+    }
+    refreshGameTimeout(shard, game);
+    shard->readableAt = 0;
+}
+
+void refreshGameTimeout(struct shard *shard, struct game *game){
+    //a game that ended keeps its timeout too, for a client that never sends GAMEOVER or hangs up
+    if(game->socket > 0)
+        scheduleGameTimeout(&shard->timers, game, shard->now + getGameTimeout(game));
+    else
+        cancelGameTimeout(&shard->timers, game);
+}
+
+unsigned char getRequestedVariant(const unsigned char version, const unsigned char position){
+    if(position < NUM_VARIANTS)
+        return position;
+    return version == VERSION ? VARIANT_CLASSIC : NUM_VARIANTS;
+}
+
+struct game *handleBufferedFrames(struct game *game){
+    const unsigned int mask = GAME_BUFFER_SIZE - 1;
+    unsigned char scratch[EXTENDED_MESSAGE_SIZE + MAX_SQUARES]; //also room for EXTENDED_MESSAGE_SIZE + TOKEN_SIZE
+    while(game->bufferHead - game->bufferTail >= MESSAGE_SIZE){
+        //a frame gets at most one reply, a client pipelining frames faster than it reads the replies waits for them
+        if(OUT_BUFFER_SIZE - (game->outHead - game->outTail) < EXTENDED_MESSAGE_SIZE){
+            if(game->shard->uring == NULL && !game->isWaitingWritable){
+                writeQueuedReplies(game->shard, game);
+                if(game->socket <= 0)
+                    return NULL;
+            }
+            if(OUT_BUFFER_SIZE - (game->outHead - game->outTail) < EXTENDED_MESSAGE_SIZE){
+                game->isReadStalled = 1;
+                break;
+            }
+        }
+        unsigned int available = game->bufferHead - game->bufferTail;
+        unsigned char version = game->buffer[game->bufferTail & mask];
+        unsigned int headerLength = version == EXTENDED_VERSION ? EXTENDED_MESSAGE_SIZE : MESSAGE_SIZE;
+        unsigned int frameLength = headerLength;
+        if((version == VERSION || version == EXTENDED_VERSION) && game->buffer[(game->bufferTail + 1) & mask] == RESUME){
+            //one byte per square of the variant in the position byte, an unknown variant gets the client dropped
+            unsigned char variant = getRequestedVariant(version, game->buffer[(game->bufferTail + 2) & mask]);
+            if(variant < NUM_VARIANTS)
+                frameLength += variants[variant].rows * variants[variant].columns;
+        }
+        else if((version == VERSION || version == EXTENDED_VERSION) && game->buffer[(game->bufferTail + 1) & mask] == TOKEN)
+            frameLength += TOKEN_SIZE;
+        if(available < frameLength)
+            break; //rest of the frame hasn't arrived yet
+
+        //frames are parsed where they sit, unless they wrap around the end of the ring
+        const unsigned char *frame = game->buffer + (game->bufferTail & mask);
+        if((game->bufferTail & mask) + frameLength > GAME_BUFFER_SIZE){
+            for(unsigned int n = 0; n < frameLength; n++)
+                scratch[n] = game->buffer[(game->bufferTail + n) & mask];
+            frame = scratch;
+        }
+        game->bufferTail += frameLength;
+
+        struct message messageIn = parsePacketFromBuffer(frame);
+        if(game->shard->records != NULL)
+            game = adoptOrphanGame(game, messageIn);
+        if(!handleClientMessage(game, messageIn, frameLength > headerLength ? frame + headerLength : NULL))
+            return NULL;
+    }
+    return game;
+}
+
+struct game *adoptOrphanGame(struct game *game, const struct message messageIn){
+    struct shard *shard = game->shard;
+    //only a client that hasn't started a game here yet can be picking up an old one
+    if(game->isInProgress || messageIn.command != MOVE || messageIn.id >= (unsigned int)shard->numGames)
+        return game;
+    struct game *orphan = &shard->games[messageIn.id];
+    if(!orphan->isInProgress || orphan->socket > 0 || orphan->version != messageIn.version)
+        return game;
+
+    LOG(LOG_ACTION, "[ACTION]:\tClient reconnected to recovered game %i, adopting it\n", orphan->id);
+    orphan->socket = game->socket;
+    orphan->bufferHead = game->bufferHead - game->bufferTail;
+    orphan->bufferTail = 0;
+    for(unsigned int n = 0; n < orphan->bufferHead; n++)
+        orphan->buffer[n] = game->buffer[(game->bufferTail + n) & (GAME_BUFFER_SIZE - 1)];
+    if(shard->uring != NULL){
+        //stop the old slot's multishot recv, the client waits for our reply so nothing can be lost in between
+        struct io_uring_sqe *sqe = getUringSqe(shard->uring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_USER_DATA(URING_RECV, game->id, game->generation);
+        sqe->user_data = URING_USER_DATA(URING_CANCEL, 0, 0);
+        queueUringRecv(shard, orphan);
+    }
+    else{
+        struct epoll_event event = {.events = EPOLLIN | EPOLLET, .data.ptr = orphan};
+        COUNT(shard->metrics.syscalls);
+        if(epoll_ctl(shard->epollSD, EPOLL_CTL_MOD, orphan->socket, &event) != 0)
+            LOG_ERRNO("adoptOrphanGame:\tepoll_ctl()");
+    }
+    game->socket = 0;
+    game->generation++;
+    game->bufferHead = 0;
+    game->bufferTail = 0;
+    releaseGameSlot(shard, game);
+    return orphan;
+}
+
+int handleClientMessage(struct game *game, struct message messageIn, const unsigned char *gameState){
+    struct metrics *metrics = &game->shard->metrics;
+    int id = game->id;
+    //VERSION clients only ever see the low byte of the id
+    unsigned int wireID = messageIn.version == VERSION ? game->id & 0xFF : game->id;
+    if(messageIn.version != VERSION && messageIn.version != EXTENDED_VERSION){
+        // client is using wrong protocol, close up
+        LOG(LOG_ACTION, "[ACTION]:\tReceived bad version number (%i) from client, disconnecting...\n", messageIn.version);
+        COUNT(metrics->badVersionDisconnects);
+        closeGame(game);
+        return 0;
+    }
+    if(messageIn.command <= TOKEN)
+        COUNT(metrics->commands[messageIn.command]);
+    else
+        COUNT(metrics->invalidCommands);
+    if((messageIn.command == RESUME || (messageIn.command == NEWGAME && !game->isInProgress))
+       && getRequestedVariant(messageIn.version, messageIn.position) >= NUM_VARIANTS){
+        LOG(LOG_ACTION, "[ACTION]:\tClient asked for unknown variant %i, disconnecting...\n", messageIn.position);
+        COUNT(metrics->badVariantDisconnects);
+        closeGame(game);
+        return 0;
+    }
+    journalEvent(game, JOURNAL_RECEIVED, messageIn.command, messageIn.position, messageIn.seqNum);
+
+    if(messageIn.command == NEWGAME) {
+        if (game->isInProgress) { //handle protocol v4/5 issue related to dropped seq#1 packet
+            LOG(LOG_ACTION, "[ACTION]:\tReceived NEWGAME request from client with game already in progress.\n");
+            LOG(LOG_ACTION, "[ACTION]:\tAssuming client didn't get the first move resending last message.\n");
+            sendPacketToClient(game, &game->lastMessage);
+        }
+        else {
+            game->variant = getRequestedVariant(messageIn.version, messageIn.position);
+            initializeGame(game);
+            game->version = messageIn.version;
+            game->currentSeqNum = 1;
+            struct message reply = getServerReply(game);
+            memcpy(&game->lastMessage, &reply, sizeof(struct message));
+            LOG(LOG_ACTION, "[ACTION]\tCreated NEWGAME with id %i\n", id);
+            LOG(LOG_ACTION, "[ACTION]\tSent MOVE ( %i ) for game %i\n", reply.position, id);
+            sendPacketToClient(game, &reply);
+        }
+    }
+    else if(messageIn.command == MOVE){
+        if(!game->isInProgress){
+            LOG(LOG_ACTION, "[ACTION]:\tReceived a move for a game not in progress, ignoring.\n");
+        }
+        else if(messageIn.id != wireID){
+            LOG(LOG_ACTION, "[ACTION]:\tReceived move from client for game %i, but client is associated with game %i, ignoring\n",
+                   messageIn.id, id);
+        }
+        else{
+            //correct seq#, advance the game state
+            if (messageIn.seqNum == game->currentSeqNum + 1) {
+                game->resends = 0;
+                tictactoeRound(game, messageIn.position);
+            }
+                //dupe seq#, resend previous message
+            else if (messageIn.seqNum == game->currentSeqNum - 1) {
+                game->resends++;
+                COUNT(metrics->duplicateResends);
+                LOG(LOG_ACTION, "[ACTION]\tGame %i sent dupe message (sent seq %i, should be %i), resending last message (%i / %i)\n",
+                       id, messageIn.seqNum, game->currentSeqNum + 1,
+                       game->resends, MAX_RESENDS);
+                sendPacketToClient(game, &game->lastMessage);
+            }
+                //client is more than 1 move out of sync, abandon all hope
+            else if (messageIn.seqNum > game->currentSeqNum + 1) {
+                LOG(LOG_ACTION, "[ACTION]\tGame %i sent message more than 2 out of sync (sent %i, should be %i), ending game.\n",
+                       messageIn.id, messageIn.seqNum, game->currentSeqNum + 1);
+                game->isInProgress = 0;
+            }
+        }
+    }
+    else if(messageIn.command == GAMEOVER){
+        if(messageIn.id != wireID){
+            LOG(LOG_ACTION, "[ACTION]:\tReceived game over command for game %i but client is associated with game %i, ignoring.\n",
+                   messageIn.id, id);
+        }
+        else if(getGameState(game) == -1){
+            LOG(LOG_ACTION, "[ACTION]:\tReceived game over command for game %i but board is not in an endgame state, ignoring\n", id);
+        }
+        else{
+            LOG(LOG_ACTION, "[ACTION]:\tReceived game over command for game %i, cleaning up game + socket info.\n", id);
+            closeGame(game);
+            return 0;
+        }
+    }
+    else if(messageIn.command == RESUME){
+        //handleBufferedFrames() only hands over a RESUME once the full board state has arrived behind it
+        game->variant = getRequestedVariant(messageIn.version, messageIn.position);
+        initializeGame(game);
+        game->version = messageIn.version;
+        game->currentSeqNum = messageIn.seqNum;
+        LOG(LOG_ACTION, "[ACTION]:\tReceived RESUME command.\n");
+        copyBoardStateToGame(game, gameState);
+        struct replicaDelta replica;
+        enum resumeCheck check = RESUME_UNKNOWN;
+        if(replication.sd != -1){
+            check = checkResume(game, messageIn, &replica);
+            COUNT(metrics->resumeChecks[check]);
+        }
+        //the old server's last move never reached the client, play that move again rather than a new one
+        if(check == RESUME_RECOVERED){
+            LOG(LOG_ACTION, "[ACTION]:\tRESUME for game %i is one move behind its replica, resending MOVE %i\n", id, replica.position);
+            game->board.x = replica.x;
+        }
+        else if(check == RESUME_MISMATCH){
+            LOG(LOG_ACTION, "[ACTION]:\tRESUME for game %i matches no replica, going by the client's board\n", id);
+        }
+        journalBoard(game);
+        game->currentSeqNum++;
+        struct message reply;
+        //a replayed move that ended the game leaves nothing to play, getServerReply() sends the GAMEOVER for it
+        if(check == RESUME_RECOVERED && getGameState(game) == -1)
+            reply = (struct message){.version = game->version, .command = MOVE, .position = replica.position,
+                                     .id = game->id, .seqNum = game->currentSeqNum};
+        else
+            reply = getServerReply(game);
+        memcpy(&game->lastMessage, &reply, sizeof(struct message));
+        sendPacketToClient(game, &reply);
+    }
+    else if(messageIn.command == TOKEN){
+        //handleBufferedFrames() only hands over a TOKEN once the whole token has arrived behind it
+        return resumeFromToken(game, messageIn, gameState);
+    }
+    else{
+        LOG(LOG_ACTION, "[ACTION]:\tReceived invalid command from game with id %i, ignoring\n", id);
+    }
+    return 1;
+}
+
+void closeGame(struct game *game){
+    //a game only holds a slot while it has a client
+    if(game->socket > 0){
+        //io_uring requests hold their own reference to the socket, shutting it down ends them instead of leaving
+        //them armed until the kernel gets around to it
+        if(game->shard->uring != NULL){
+            COUNT(game->shard->metrics.syscalls);
+            shutdown(game->socket, SHUT_RDWR);
+            game->shard->uring->sendsInFlight -= game->sendsInFlight;
+        }
+        //the --udp-port socket stays open for every other game played over it
+        if(isDatagramGame(game)){
+            detachDatagramClient(game->shard, game);
+        }
+        else{
+            COUNT(game->shard->metrics.syscalls);
+            close(game->socket);
+        }
+        releaseGameSlot(game->shard, game);
+        game->generation++;
+    }
+    game->socket = 0;
+    game->isInProgress = 0;
+    game->bufferHead = 0;
+    game->bufferTail = 0;
+    game->outHead = 0;
+    game->outSent = 0;
+    game->outTail = 0;
+    game->sendsInFlight = 0;
+    game->isWaitingWritable = 0;
+    game->isClosingAfterSend = 0;
+    game->isReadStalled = 0;
+    game->unrecordedReplies = 0;
+    saveGameRecord(game, &game->lastMessage);
+    journalEvent(game, JOURNAL_CLOSED, 0, 0, 0);
+    replicateGame(game, NULL);
+}
+
+int getGameTimeout(const struct game *game){
+    return evictAfter > 0 && game->variant == VARIANT_CLASSIC ? evictAfter * 1000 : GAME_TIMEOUT * 1000;
+}
+
+void evictGame(struct game *game){
+    struct shard *shard = game->shard;
+    unsigned char wire[EXTENDED_MESSAGE_SIZE + TOKEN_SIZE];
+    struct message header = {.version = game->version, .command = TOKEN, .position = game->lastMessage.position,
+                             .id = game->id, .seqNum = game->currentSeqNum};
+    int length = serializeMessage(&header, wire);
+    packResumeToken(game, time(NULL), wire + length);
+    LOG(LOG_ACTION, "[ACTION]:\tGame %i has been idle for %i seconds, sending its resume token and freeing it\n",
+        game->id, evictAfter);
+    COUNT(shard->metrics.tokensIssued);
+    journalEvent(game, JOURNAL_SENT, TOKEN, header.position, header.seqNum);
+    queueReply(game, wire, length + TOKEN_SIZE);
+    //io_uring sends the token with the shard's next flush, shutting the socket down first would cancel it
+    if(shard->uring != NULL){
+        game->isInProgress = 0;
+        game->isClosingAfterSend = 1;
+        //a client that never reads its token is closed like any other idle one
+        scheduleGameTimeout(&shard->timers, game, shard->now + GAME_TIMEOUT * 1000);
+        return;
+    }
+    //out before the socket closes, a datagram client's goes with the shard's batch
+    writeQueuedReplies(shard, game);
+    closeGame(game);
+}
+
+int resumeFromToken(struct game *game, const struct message messageIn, const unsigned char *wire){
+    struct resumeToken token;
+    int isValid = unpackResumeToken(wire, time(NULL), &token);
+    //VERSION clients only ever saw the low byte of the id
+    unsigned int tokenID = messageIn.version == VERSION ? token.id & 0xFF : token.id;
+    if(!isValid || token.version != messageIn.version || messageIn.id != tokenID){
+        LOG(LOG_ACTION, "[ACTION]:\tReceived a forged or expired resume token, or one for another game, disconnecting...\n");
+        COUNT(game->shard->metrics.tokensRejected);
+        closeGame(game);
+        return 0;
+    }
+    game->variant = VARIANT_CLASSIC;
+    initializeGame(game);
+    game->version = token.version;
+    game->board = token.board;
+    game->currentSeqNum = token.seqNum;
+    game->lastMessage = (struct message){.version = token.version, .command = MOVE, .position = token.position,
+                                         .id = game->id, .seqNum = token.seqNum};
+    LOG(LOG_ACTION, "[ACTION]:\tResumed game %i from the token of game %i\n", game->id, (int)token.id);
+    journalBoard(game);
+    if(messageIn.seqNum == game->currentSeqNum + 1){
+        game->resends = 0;
+        tictactoeRound(game, messageIn.position);
+    }
+    else{
+        //the client lost our last move, or has no move to send with the token yet
+        sendPacketToClient(game, &game->lastMessage);
+    }
+    return 1;
+}
+
+void packResumeToken(const struct game *game, const uint32_t issuedAt, unsigned char *wire){
+    uint16_t x = htons(game->board.x);
+    uint16_t o = htons(game->board.o);
+    uint32_t id = htonl(game->id);
+    uint32_t nboIssuedAt = htonl(issuedAt);
+    wire[0] = TOKEN_FORMAT;
+    wire[1] = game->version;
+    wire[2] = game->currentSeqNum;
+    wire[3] = game->lastMessage.position;
+    memcpy(wire + 4, &x, sizeof(x));
+    memcpy(wire + 6, &o, sizeof(o));
+    memcpy(wire + 8, &id, sizeof(id));
+    memcpy(wire + 12, &nboIssuedAt, sizeof(nboIssuedAt));
+    uint64_t mac = sipHash(tokenKey, wire, 16);
+    memcpy(wire + 16, &mac, sizeof(mac));
+}
+
+int unpackResumeToken(const unsigned char *wire, const uint32_t now, struct resumeToken *token){
+    uint16_t x, o;
+    uint32_t id, issuedAt;
+    uint64_t mac;
+    memcpy(&x, wire + 4, sizeof(x));
+    memcpy(&o, wire + 6, sizeof(o));
+    memcpy(&id, wire + 8, sizeof(id));
+    memcpy(&issuedAt, wire + 12, sizeof(issuedAt));
+    memcpy(&mac, wire + 16, sizeof(mac));
+    token->version = wire[1];
+    token->seqNum = wire[2];
+    token->position = wire[3];
+    token->board.x = ntohs(x);
+    token->board.o = ntohs(o);
+    token->id = ntohl(id);
+    token->issuedAt = ntohl(issuedAt);
+    //the MAC covers the format byte, so a token of another format never gets this far
+    if(mac != sipHash(tokenKey, wire, 16) || wire[0] != TOKEN_FORMAT)
+        return 0;
+    //signed, so a token from a server whose clock is ahead is slightly negative rather than very old
+    int64_t age = (int64_t)now - token->issuedAt;
+    return age >= -TOKEN_CLOCK_SKEW && age <= TOKEN_LIFETIME;
+}
+
+#define SIP_ROTATE(value, bits) (((value) << (bits)) | ((value) >> (64 - (bits))))
+#define SIP_ROUND(v0, v1, v2, v3) do{ \
+        v0 += v1; v1 = SIP_ROTATE(v1, 13); v1 ^= v0; v0 = SIP_ROTATE(v0, 32); \
+        v2 += v3; v3 = SIP_ROTATE(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = SIP_ROTATE(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = SIP_ROTATE(v1, 17); v1 ^= v2; v2 = SIP_ROTATE(v2, 32); \
+    }while(0)
+
+uint64_t sipHash(const uint64_t key[2], const unsigned char *data, const size_t length){
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ull;
+    uint64_t v1 = key[1] ^ 0x646f72616e646f6dull;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ull;
+    uint64_t v3 = key[1] ^ 0x7465646279746573ull;
+    size_t n = 0;
+    for(; n + 8 <= length; n += 8){
+        uint64_t word;
+        memcpy(&word, data + n, sizeof(word)); //little endian hosts only, like the rest of the token's MAC
+        v3 ^= word;
+        SIP_ROUND(v0, v1, v2, v3);
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= word;
+    }
+    uint64_t last = (uint64_t)length << 56;
+    for(int shift = 0; n < length; n++, shift += 8)
+        last |= (uint64_t)data[n] << shift;
+    v3 ^= last;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= last;
+    v2 ^= 0xFF;
+    for(int round = 0; round < 4; round++)
+        SIP_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+int loadTokenKey(const char *path){
+    if(path == NULL){
+        if(getrandom(tokenKey, sizeof(tokenKey), 0) != sizeof(tokenKey)){
+            perror("loadTokenKey:\tgetrandom():");
+            return 0;
+        }
+        return 1;
+    }
+    unsigned char bytes[sizeof(tokenKey)];
+    FILE *file = fopen(path, "rb");
+    if(file == NULL){
+        perror("loadTokenKey:\tfopen():");
+        return 0;
+    }
+    size_t read = fread(bytes, 1, sizeof(bytes), file);
+    fclose(file);
+    if(read != sizeof(bytes)){
+        printf("loadTokenKey:\t%s holds fewer than %zu bytes\n", path, sizeof(bytes));
+        return 0;
+    }
+    memcpy(tokenKey, bytes, sizeof(tokenKey));
+    return 1;
+}
+
+int initializeUring(struct shard *shard){
+    struct uring *uring = calloc(1, sizeof(struct uring));
+    struct io_uring_params params;
+    if(uring == NULL){
+        perror("initializeUring:\tcalloc():");
+        return 0;
+    }
+    uring->syscalls = &shard->metrics.syscalls;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+    uring->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if(uring->fd == -1){
+        perror("initializeUring:\tio_uring_setup():");
+        return 0;
+    }
+    const unsigned int required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if((params.features & required) != required){
+        printf("initializeUring:\tkernel io_uring is too old, use --io epoll\n");
+        return 0;
+    }
+
+    //with IORING_FEAT_SINGLE_MMAP both rings live in one mapping
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    unsigned char *rings = mmap(NULL, sqSize > cqSize ? sqSize : cqSize, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    uring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if(rings == MAP_FAILED || uring->sqes == MAP_FAILED){
+        perror("initializeUring:\tmmap():");
+        return 0;
+    }
+    uring->sqHead = (unsigned int *)(rings + params.sq_off.head);
+    uring->sqTail = (unsigned int *)(rings + params.sq_off.tail);
+    uring->sqMask = *(unsigned int *)(rings + params.sq_off.ring_mask);
+    uring->sqEntries = params.sq_entries;
+    uring->sqLocalTail = *uring->sqTail;
+    //submission queue entries are always used in order, so the indirection array never changes
+    unsigned int *sqArray = (unsigned int *)(rings + params.sq_off.array);
+    for(unsigned int n = 0; n < params.sq_entries; n++)
+        sqArray[n] = n;
+    uring->cqHead = (unsigned int *)(rings + params.cq_off.head);
+    uring->cqTail = (unsigned int *)(rings + params.cq_off.tail);
+    uring->cqMask = *(unsigned int *)(rings + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+    uring->bufferRing = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uring->buffers = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+    if(uring->bufferRing == MAP_FAILED || uring->buffers == NULL){
+        perror("initializeUring:\tmmap():");
+        return 0;
+    }
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t)(uintptr_t)uring->bufferRing;
+    registration.ring_entries = URING_BUFFERS;
+    registration.bgid = URING_BUFFER_GROUP;
+    if(syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0){
+        perror("initializeUring:\tio_uring_register():");
+        return 0;
+    }
+    uring->bufferTail = 0;
+    for(int n = 0; n < URING_BUFFERS; n++)
+        recycleUringBuffer(uring, n);
+    shard->uring = uring;
+    return 1;
+}
+
+struct io_uring_sqe *getUringSqe(struct uring *uring){
+    if(uring->sqLocalTail - __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE) == uring->sqEntries)
+        enterUring(uring, 0);
+    struct io_uring_sqe *sqe = &uring->sqes[uring->sqLocalTail & uring->sqMask];
+    uring->sqLocalTail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int enterUring(struct uring *uring, const int timeout){
+    unsigned int toSubmit = uring->sqLocalTail - *uring->sqTail;
+    __atomic_store_n(uring->sqTail, uring->sqLocalTail, __ATOMIC_RELEASE);
+    //completions that are already waiting are handled before blocking
+    int wait = timeout != 0 && *uring->cqHead == __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+
+    unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec waitTime;
+    struct io_uring_getevents_arg waitArg;
+    void *arg = NULL;
+    size_t argSize = 0;
+    if(wait && timeout > 0){
+        waitTime.tv_sec = timeout / 1000;
+        waitTime.tv_nsec = (timeout % 1000) * 1000000LL;
+        memset(&waitArg, 0, sizeof(waitArg));
+        waitArg.sigmask_sz = _NSIG / 8;
+        waitArg.ts = (uint64_t)(uintptr_t)&waitTime;
+        flags |= IORING_ENTER_EXT_ARG;
+        arg = &waitArg;
+        argSize = sizeof(waitArg);
+    }
+    if(toSubmit == 0 && !wait)
+        return 1;
+    COUNT(*uring->syscalls);
+    if(syscall(__NR_io_uring_enter, uring->fd, toSubmit, wait ? 1 : 0, flags, arg, argSize) < 0){
+        if(errno != ETIME && errno != EINTR)
+            LOG_ERRNO("enterUring:\tio_uring_enter()");
+        return 0;
+    }
+    return 1;
+}
+
+void queueUringAccept(struct shard *shard){
+    struct io_uring_sqe *sqe = getUringSqe(shard->uring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = shard->listeningSD;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = URING_USER_DATA(URING_ACCEPT, 0, 0);
+}
+
+void queueUringDiscovery(struct shard *shard){
+    struct io_uring_sqe *sqe = getUringSqe(shard->uring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = shard->multicastSD;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_USER_DATA(URING_DISCOVERY, 0, 0);
+}
+
+void queueUringRecv(struct shard *shard, struct game *game){
+    struct io_uring_sqe *sqe = getUringSqe(shard->uring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = game->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_USER_DATA(URING_RECV, game->id, game->generation);
+}
+
+void flushUringSends(struct shard *shard){
+    struct game *game = shard->pendingSends;
+    shard->pendingSends = NULL;
+    uint64_t now = getMonotonicNanos();
+    for(; game != NULL; game = game->sendNext){
+        game->isSendPending = 0;
+        if(game->socket <= 0)
+            continue;
+        recordReplyLatencies(game, now);
+        if(game->sendsInFlight > 0 || game->outSent == game->outHead)
+            continue;
+        unsigned int start = game->outSent & (OUT_BUFFER_SIZE - 1);
+        unsigned int length = game->outHead - game->outSent;
+        unsigned int first = length < OUT_BUFFER_SIZE - start ? length : OUT_BUFFER_SIZE - start;
+        //linked so the wrapped part can't go out before the first part, a short first send cancels the second
+        struct io_uring_sqe *sqe = getUringSqe(shard->uring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = game->socket;
+        sqe->addr = (uint64_t)(uintptr_t)(game->outBuffer + start);
+        sqe->len = first;
+        sqe->user_data = URING_USER_DATA(URING_SEND, game->id, game->generation);
+        game->sendsInFlight++;
+        shard->uring->sendsInFlight++;
+        if(first < length){
+            sqe->flags = IOSQE_IO_LINK;
+            sqe = getUringSqe(shard->uring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = game->socket;
+            sqe->addr = (uint64_t)(uintptr_t)game->outBuffer;
+            sqe->len = length - first;
+            sqe->user_data = URING_USER_DATA(URING_SEND, game->id, game->generation);
+            game->sendsInFlight++;
+            shard->uring->sendsInFlight++;
+        }
+        game->outSent = game->outHead;
+    }
+}
+
+void recycleUringBuffer(struct uring *uring, const unsigned short bufferID){
+    struct io_uring_buf *buffer = &uring->bufferRing->bufs[uring->bufferTail & (URING_BUFFERS - 1)];
+    buffer->addr = (uint64_t)(uintptr_t)(uring->buffers + bufferID * URING_BUFFER_SIZE);
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = bufferID;
+    uring->bufferTail++;
+    __atomic_store_n(&uring->bufferRing->tail, uring->bufferTail, __ATOMIC_RELEASE);
+}
+
+void handleUringGameData(struct shard *shard, struct game *game, const unsigned char *data, int length){
+    shard->readableAt = shard->wokeAt;
+    LOG(LOG_ACTION, "[ACTION]:\tReceived %i bytes for game %i\n", length, game->id);
+    //frames left behind until their replies had room go first
+    if(game->isReadStalled){
+        game->isReadStalled = 0;
+        struct game *owner = handleBufferedFrames(game);
+        if(owner != NULL)
+            game = owner;
+    }
+    //unless it stalls, handleBufferedFrames() leaves less than a frame behind, so every round makes room for the next
+    while(length > 0 && game->socket > 0){
+        unsigned int space = GAME_BUFFER_SIZE - (game->bufferHead - game->bufferTail);
+        if(space == 0){
+            //a multishot recv can't be held back like an epoll read, and this client sent a buffer full of frames
+            //without reading a single reply
+            LOG(LOG_ERROR, "[ERROR]:\tGame %i sent frames past a full buffer without reading its replies, closing it\n",
+                game->id);
+            closeGame(game);
+            cancelGameTimeout(&shard->timers, game);
+            break;
+        }
+        unsigned int chunk = (unsigned int)length < space ? (unsigned int)length : space;
+        for(unsigned int n = 0; n < chunk; n++)
+            game->buffer[(game->bufferHead + n) & (GAME_BUFFER_SIZE - 1)] = data[n];
+        game->bufferHead += chunk;
+        data += chunk;
+        length -= (int)chunk;
+        struct game *owner = handleBufferedFrames(game);
+        if(owner == NULL)
+            break;
+        game = owner;
+    }
+    refreshGameTimeout(shard, game);
+    shard->readableAt = 0;
+}
+
+void handleUringCompletion(struct shard *shard, const struct io_uring_cqe *cqe){
+    enum uringOperation operation = cqe->user_data & 0xFF;
+    unsigned int id = (cqe->user_data >> 8) & 0xFFFFFFFF;
+    unsigned int generation = cqe->user_data >> 40;
+    //an upgrade cancels every request and rearms them itself if it falls through
+    int isArmed = (cqe->flags & IORING_CQE_F_MORE) || shard->uring->isQuiescing;
+
+    if(operation == URING_ACCEPT){
+        if(cqe->res < 0){
+            errno = -cqe->res;
+            if(errno != ECANCELED)
+                LOG_ERRNO("handleUringCompletion:\taccept()");
+        }
+        else{
+            COUNT(shard->metrics.acceptedConnections);
+            LOG(LOG_ACTION, "[ACTION]:\tGot connection request from a client, searching for an open game id...\n");
+            int slot = allocateGameSlot(shard);
+            if(slot == -1){
+                rejectConnection(shard, cqe->res);
+            }
+            else{
+                struct game *game = &shard->games[slot];
+                LOG(LOG_ACTION, "[ACTION]:\tCreated socket for game id %i on shard %i\n", slot, shard->index);
+                game->socket = cqe->res;
+                game->bufferHead = 0;
+                game->bufferTail = 0;
+                scheduleGameTimeout(&shard->timers, game, shard->now + GAME_TIMEOUT * 1000);
+                if(!shard->uring->isQuiescing)
+                    queueUringRecv(shard, game);
+            }
+        }
+        if(!isArmed)
+            queueUringAccept(shard);
+        return;
+    }
+    if(operation == URING_DISCOVERY){
+        //the poll only fires when a new multicast arrives, so don't leave any behind
+        while(cqe->res > 0 && handleDiscoveryRequests(shard) == discoveryBatchSize)
+            ;
+        if(!isArmed)
+            queueUringDiscovery(shard);
+        return;
+    }
+    if(operation == URING_UPGRADE){
+        if(cqe->res > 0)
+            shard->isUpgradeRequested = 1;
+        return;
+    }
+    if(operation == URING_CANCEL){
+        if(id == 1) //see quiesceUringShard()
+            shard->uring->isCancelled = 1;
+        return;
+    }
+
+    struct game *game = &shard->games[id];
+    int isCurrent = game->socket > 0 && (game->generation & 0xFFFFFF) == generation;
+    if(operation == URING_RECV){
+        int hasBuffer = cqe->flags & IORING_CQE_F_BUFFER;
+        unsigned short bufferID = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if(isCurrent){
+            LOG(LOG_ACTION, "[ACTION]:\tData available for game id %i\n", game->id);
+            if(cqe->res > 0){
+                //an evicted game has nothing left to play, anything its client sends now is dropped
+                if(!game->isClosingAfterSend)
+                    handleUringGameData(shard, game, shard->uring->buffers + bufferID * URING_BUFFER_SIZE, cqe->res);
+            }
+            else if(cqe->res != -ENOBUFS && cqe->res != -ECANCELED){ //disconnect, out of buffers just means rearming below
+                LOG(LOG_ACTION, "[ACTION]:\tBroken pipe for game %i, ending game and cleaning up\n", game->id);
+                closeGame(game);
+                cancelGameTimeout(&shard->timers, game);
+            }
+            if(!isArmed && game->socket > 0)
+                queueUringRecv(shard, game);
+        }
+        if(hasBuffer)
+            recycleUringBuffer(shard->uring, bufferID);
+    }
+    else if(operation == URING_SEND && isCurrent){
+        game->sendsInFlight--;
+        shard->uring->sendsInFlight--;
+        if(cqe->res > 0){
+            game->outTail += cqe->res;
+        }
+        else if(cqe->res != -ECANCELED){
+            errno = -cqe->res;
+            LOG_ERRNO("handleUringCompletion:\tsend()");
+            closeGame(game);
+            cancelGameTimeout(&shard->timers, game);
+            return;
+        }
+        //an evicted game is closed once its token is out
+        if(game->isClosingAfterSend && game->sendsInFlight == 0 && game->outTail == game->outHead){
+            closeGame(game);
+            cancelGameTimeout(&shard->timers, game);
+        }
+        //once nothing is in flight, send whatever a short send left behind along with anything queued since
+        else if(game->sendsInFlight == 0 && game->outTail != game->outHead){
+            game->outSent = game->outTail;
+            if(!game->isSendPending){
+                game->isSendPending = 1;
+                game->sendNext = shard->pendingSends;
+                shard->pendingSends = game;
+            }
+        }
+        //the replies that went out made room for the frames a stalled game left behind
+        if(game->socket > 0 && game->isReadStalled
+           && OUT_BUFFER_SIZE - (game->outHead - game->outTail) >= EXTENDED_MESSAGE_SIZE)
+            handleUringGameData(shard, game, NULL, 0);
+    }
+}
+
+void handleUringCompletions(struct shard *shard){
+    struct uring *uring = shard->uring;
+    unsigned int head = *uring->cqHead;
+    unsigned int tail = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++)
+        handleUringCompletion(shard, &uring->cqes[head & uring->cqMask]);
+    __atomic_store_n(uring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+void armUringShard(struct shard *shard){
+    queueUringAccept(shard);
+    if(shard->multicastSD != -1)
+        queueUringDiscovery(shard);
+    if(upgrade.eventSD != -1){
+        struct io_uring_sqe *sqe = getUringSqe(shard->uring);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = upgrade.eventSD;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = URING_USER_DATA(URING_UPGRADE, 0, 0);
+    }
+    for(int n = getNextOccupiedSlot(shard, 0); n != -1; n = getNextOccupiedSlot(shard, n + 1)){
+        if(shard->games[n].socket > 0)
+            queueUringRecv(shard, &shard->games[n]);
+    }
+}
+
+void quiesceUringShard(struct shard *shard){
+    struct uring *uring = shard->uring;
+    uring->isQuiescing = 1;
+    uring->isCancelled = 0;
+    struct io_uring_sqe *sqe = getUringSqe(uring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = URING_USER_DATA(URING_CANCEL, 1, 0);
+
+    //data that arrived before the cancellation is handled as usual, and every reply goes out before we stop
+    uint64_t deadline = getMonotonicMillis() + TIMETOWAIT * 1000;
+    while(!uring->isCancelled || uring->sendsInFlight > 0 || shard->pendingSends != NULL){
+        if(getMonotonicMillis() > deadline){
+            LOG(LOG_ERROR, "[ERROR]:\tShard %i still had %i sends in flight when it stopped for the upgrade\n",
+                shard->index, uring->sendsInFlight);
+            break;
+        }
+        flushUringSends(shard);
+        enterUring(uring, TIMER_TICK_MS);
+        shard->wokeAt = getMonotonicNanos();
+        shard->now = shard->wokeAt / 1000000;
+        handleUringCompletions(shard);
+    }
+}
+
+void *runShardUring(void *arg){
+    struct shard *shard = arg;
+    struct uring *uring = shard->uring;
+
+    aiSeed = time(NULL) ^ (shard->index * 2654435761u);
+    threadLogRing = &logRings[shard->index];
+
+    armUringShard(shard);
+    while(1){
+        flushUringSends(shard);
+        enterUring(uring, getNextTimeout(&shard->timers, getMonotonicMillis()));
+        shard->wokeAt = getMonotonicNanos();
+        shard->now = shard->wokeAt / 1000000;
+        handleUringCompletions(shard);
+        manageTimedOutGames(shard);
+        if(shard->isUpgradeRequested)
+            handleUpgradeRequest(shard);
+    }
+}
+
+void handleUpgradeSignal(int signal){
+    uint64_t one = 1;
+    write(upgrade.eventSD, &one, sizeof(one)); //async-signal-safe, unlike anything that would wake the shards directly
+}
+
+int startUpgradeListener(char **argv, const int numShards, const int maxGames){
+    upgrade.argv = argv;
+    upgrade.numShards = numShards;
+    upgrade.maxGames = maxGames;
+    upgrade.eventSD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(upgrade.eventSD == -1){
+        perror("startUpgradeListener:\teventfd():");
+        return 0;
+    }
+    int rc = pthread_barrier_init(&upgrade.barrier, NULL, numShards);
+    if(rc != 0){
+        printf("startUpgradeListener:\tpthread_barrier_init(): %s\n", strerror(rc));
+        return 0;
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleUpgradeSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(SIGUSR2, &action, NULL) != 0){
+        perror("startUpgradeListener:\tsigaction():");
+        return 0;
+    }
+    return 1;
+}
+
+void handleUpgradeRequest(struct shard *shard){
+    shard->isUpgradeRequested = 0;
+    if(shard->uring != NULL)
+        quiesceUringShard(shard);
+    LOG(LOG_ACTION, "[ACTION]:\tShard %i stopped for an upgrade\n", shard->index);
+    pthread_barrier_wait(&upgrade.barrier);
+
+    //every shard is parked now, so shard 0 can read all of their games
+    if(shard->index == 0){
+        if(handOverToReplacement()){
+            waitForJournal();
+            printf("Handed every game over to the replacement process, exiting.\n");
+            fflush(stdout);
+            exit(EXIT_SUCCESS);
+        }
+        LOG(LOG_ERROR, "[ERROR]:\tUpgrade failed, carrying on\n");
+        uint64_t count;
+        read(upgrade.eventSD, &count, sizeof(count));
+    }
+    pthread_barrier_wait(&upgrade.barrier);
+    if(shard->uring != NULL){
+        shard->uring->isQuiescing = 0;
+        armUringShard(shard);
+    }
+}
+
+int handOverToReplacement(void){
+    struct sockaddr_un address;
+    struct timeval tv = {.tv_sec = TIMETOWAIT, .tv_usec = 0};
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, upgrade.socketPath, sizeof(address.sun_path) - 1);
+
+    int listenSD = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(listenSD == -1){
+        LOG_ERRNO("handOverToReplacement:\tsocket()");
+        return 0;
+    }
+    unlink(upgrade.socketPath);
+    if(bind(listenSD, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listenSD, 1) != 0){
+        LOG_ERRNO("handOverToReplacement:\tbind()");
+        close(listenSD);
+        return 0;
+    }
+    setsockopt(listenSD, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    //the replacement is started with our own arguments, and only gets the descriptors we send it
+    char *argv[128];
+    int argc = 0;
+    for(char **arg = upgrade.argv; *arg != NULL && argc < 126; arg++){
+        if(strcmp(*arg, "--takeover") != 0)
+            argv[argc++] = *arg;
+    }
+    argv[argc++] = "--takeover";
+    argv[argc] = NULL;
+    pid_t child = fork();
+    if(child == 0){
+        close_range(3, ~0U, 0);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    if(child == -1){
+        LOG_ERRNO("handOverToReplacement:\tfork()");
+        close(listenSD);
+        unlink(upgrade.socketPath);
+        return 0;
+    }
+
+    int sd = accept(listenSD, NULL, NULL);
+    close(listenSD);
+    unlink(upgrade.socketPath);
+    int isHandedOver = 0;
+    if(sd == -1){
+        LOG_ERRNO("handOverToReplacement:\taccept()");
+    }
+    else{
+        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        unsigned char ack;
+        isHandedOver = sendUpgradeState(sd) && recv(sd, &ack, sizeof(ack), 0) == sizeof(ack);
+        close(sd);
+    }
+    if(!isHandedOver){
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+    }
+    return isHandedOver;
+}
+
+int sendUpgradeState(const int sd){
+    struct upgradeMessage message;
+    memset(&message, 0, sizeof(message));
+    message.type = UPGRADE_HELLO;
+    message.numShards = upgrade.numShards;
+    message.maxGames = upgrade.maxGames;
+    int sockets[2] = {upgrade.shards[0].multicastSD, upgrade.statsSD};
+    if(!sendUpgradeMessage(sd, &message, sockets, upgrade.statsSD != -1 ? 2 : 1))
+        return 0;
+
+    int numGames = 0;
+    for(int n = 0; n < upgrade.numShards; n++){
+        struct shard *shard = &upgrade.shards[n];
+        memset(&message, 0, sizeof(message));
+        message.type = UPGRADE_SHARD;
+        message.shard = n;
+        message.numGames = shard->numGames;
+        if(!sendUpgradeMessage(sd, &message, &shard->listeningSD, 1))
+            return 0;
+    }
+    //the replacement initializes its shards between the last SHARD and the first GAME
+    for(int n = 0; n < upgrade.numShards; n++){
+        struct shard *shard = &upgrade.shards[n];
+        for(int id = getNextOccupiedSlot(shard, 0); id != -1; id = getNextOccupiedSlot(shard, id + 1)){
+            struct game *game = &shard->games[id];
+            if(game->socket <= 0 && !game->isInProgress)
+                continue;
+            memset(&message, 0, sizeof(message));
+            message.type = UPGRADE_GAME;
+            message.shard = n;
+            message.id = id;
+            packGameRecord(game, &game->lastMessage, &message.record);
+            message.variant = game->variant;
+            if(game->variant != VARIANT_CLASSIC)
+                message.wideBoard = *getWideBoard(game);
+            message.buffered = game->bufferHead - game->bufferTail;
+            for(unsigned int byte = 0; byte < message.buffered; byte++)
+                message.buffer[byte] = game->buffer[(game->bufferTail + byte) & (GAME_BUFFER_SIZE - 1)];
+            //io_uring shards sent everything before they stopped, an epoll game waiting for EPOLLOUT hasn't
+            message.unsent = game->outHead - game->outTail;
+            for(unsigned int byte = 0; byte < message.unsent; byte++)
+                message.outBuffer[byte] = game->outBuffer[(game->outTail + byte) & (OUT_BUFFER_SIZE - 1)];
+            if(!sendUpgradeMessage(sd, &message, &game->socket, game->socket > 0 ? 1 : 0))
+                return 0;
+            numGames++;
+        }
+    }
+    memset(&message, 0, sizeof(message));
+    message.type = UPGRADE_DONE;
+    if(!sendUpgradeMessage(sd, &message, NULL, 0))
+        return 0;
+    LOG(LOG_ACTION, "[ACTION]:\tHanded %i game(s) over to the replacement process\n", numGames);
+    return 1;
+}
+
+int sendUpgradeMessage(const int sd, const struct upgradeMessage *message, const int *sockets, const int numSockets){
+    union{
+        struct cmsghdr header;
+        char space[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = {.iov_base = (void *)message, .iov_len = sizeof(*message)};
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    if(numSockets > 0){
+        memset(&control, 0, sizeof(control));
+        header.msg_control = control.space;
+        header.msg_controllen = CMSG_SPACE(numSockets * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(numSockets * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), sockets, numSockets * sizeof(int));
+    }
+    if(sendmsg(sd, &header, MSG_NOSIGNAL) != sizeof(*message)){
+        LOG_ERRNO("sendUpgradeMessage:\tsendmsg()");
+        return 0;
+    }
+    return 1;
+}
+
+int receiveUpgradeMessage(const int sd, struct upgradeMessage *message, int *sockets, int *numSockets){
+    union{
+        struct cmsghdr header;
+        char space[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = {.iov_base = message, .iov_len = sizeof(*message)};
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control.space;
+    header.msg_controllen = sizeof(control.space);
+    if(recvmsg(sd, &header, MSG_CMSG_CLOEXEC) != sizeof(*message) || header.msg_flags & (MSG_TRUNC | MSG_CTRUNC)){
+        perror("receiveUpgradeMessage:\trecvmsg():");
+        return 0;
+    }
+    *numSockets = 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+    if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+        *numSockets = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(sockets, CMSG_DATA(cmsg), *numSockets * sizeof(int));
+    }
+    return 1;
+}
+
+int receiveUpgradeSockets(const int numShards, const int maxGames, int *multicastSD, int *statsSD, int *listeningSDs){
+    struct sockaddr_un address;
+    struct timeval tv = {.tv_sec = TIMETOWAIT, .tv_usec = 0};
+    struct upgradeMessage message;
+    int sockets[2];
+    int numSockets;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, upgrade.socketPath, sizeof(address.sun_path) - 1);
+    int sd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(sd == -1 || connect(sd, (struct sockaddr *)&address, sizeof(address)) != 0){
+        perror("receiveUpgradeSockets:\tconnect():");
+        return -1;
+    }
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if(!receiveUpgradeMessage(sd, &message, sockets, &numSockets) || message.type != UPGRADE_HELLO || numSockets < 1){
+        close(sd);
+        return -1;
+    }
+    if(message.numShards != numShards || message.maxGames != maxGames){
+        printf("receiveUpgradeSockets:\tprevious process runs %u thread(s) and %u game(s)\n", message.numShards, message.maxGames);
+        close(sd);
+        return -1;
+    }
+    *multicastSD = sockets[0];
+    *statsSD = numSockets > 1 ? sockets[1] : -1;
+    for(int n = 0; n < numShards; n++){
+        if(!receiveUpgradeMessage(sd, &message, sockets, &numSockets) || message.type != UPGRADE_SHARD
+           || message.shard != n || numSockets != 1){
+            close(sd);
+            return -1;
+        }
+        listeningSDs[n] = sockets[0];
+    }
+    return sd;
+}
+
+int receiveUpgradeGames(const int sd, struct shard *shards, const int numShards){
+    struct upgradeMessage message;
+    int sockets[2];
+    int numSockets;
+    int numGames = 0;
+    while(1){
+        if(!receiveUpgradeMessage(sd, &message, sockets, &numSockets)){
+            close(sd);
+            return 0;
+        }
+        if(message.type == UPGRADE_DONE)
+            break;
+        if(message.type != UPGRADE_GAME || message.shard >= numShards || message.id >= shards[message.shard].numGames
+           || message.buffered > GAME_BUFFER_SIZE || message.unsent > OUT_BUFFER_SIZE || message.variant >= NUM_VARIANTS){
+            close(sd);
+            return 0;
+        }
+        struct shard *shard = &shards[message.shard];
+        struct game *game = &shard->games[message.id];
+        if(!restoreGameRecord(shard, game, &message.record))
+            game->version = message.record.version;
+        game->variant = message.variant;
+        if(game->variant != VARIANT_CLASSIC)
+            *getWideBoard(game) = message.wideBoard;
+        if(numSockets == 1){
+            game->socket = sockets[0];
+            memcpy(game->buffer, message.buffer, message.buffered);
+            game->bufferHead = message.buffered;
+            game->bufferTail = 0;
+            //frames the previous process stalled on are picked up once the replies below have gone out
+            game->isReadStalled = message.buffered >= MESSAGE_SIZE;
+            //the shard's first flush sends whatever the previous process couldn't
+            if(message.unsent > 0){
+                memcpy(game->outBuffer, message.outBuffer, message.unsent);
+                game->outHead = message.unsent;
+                game->outTail = 0;
+                game->outSent = 0;
+                game->isSendPending = 1;
+                game->sendNext = shard->pendingSends;
+                shard->pendingSends = game;
+            }
+            //io_uring shards arm their recvs when they start
+            struct epoll_event event = {.events = EPOLLIN | EPOLLET, .data.ptr = game};
+            if(!useUring && epoll_ctl(shard->epollSD, EPOLL_CTL_ADD, game->socket, &event) != 0)
+                perror("receiveUpgradeGames:\tepoll_ctl():");
+        }
+        numGames++;
+    }
+    //only games that came over without a client or a game are free
+    for(int n = 0; n < numShards; n++){
+        struct shard *shard = &shards[n];
+        shard->numFreeSlots = 0;
+        for(int id = shard->numGames - 1; id >= 0; id--){
+            if(shard->games[id].socket <= 0 && !shard->games[id].isInProgress)
+                shard->freeSlots[shard->numFreeSlots++] = id;
+            else
+                shard->occupiedSlots[id / 64] |= 1ULL << (id % 64);
+        }
+    }
+    //the previous process exits once it knows we have everything
+    unsigned char ack = 1;
+    int isAcknowledged = send(sd, &ack, sizeof(ack), MSG_NOSIGNAL) == sizeof(ack);
+    close(sd);
+    printf("\nTook over %i game(s) from the previous process\n", numGames);
+    return isAcknowledged;
+}
+
+int createMulticastSocket(int *sd, struct sockaddr_in *multicast_address) {
+    struct ip_mreq mreq;
+
+    multicast_address->sin_family = AF_INET;
+    multicast_address->sin_addr.s_addr = htonl(INADDR_ANY);
+    multicast_address->sin_port = htons(MC_PORT);
+
+    mreq.imr_multiaddr.s_addr = inet_addr(MC_GROUP);
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+    *sd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(*sd==-1){
+        perror("createMulticastSocket:\tsocket():");
+        return 0;
+    }
+    //a restarted server must be able to bind while the old socket is still being torn down (io_uring does that asynchronously)
+    int reuseAddress = 1;
+    if(setsockopt(*sd, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress)) != 0){
+        perror("createMulticastSocket:\tsetsockopt():");
+        return 0;
+    }
+    socklen_t addrLen = sizeof(struct sockaddr_in);
+    int rc = bind(*sd, (struct sockaddr *)multicast_address, addrLen);
+    if(rc != 0){
+        perror("createMulticastSocket:\tbind():");
+        return 0;
+    }
+    rc = setsockopt(*sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    if(rc != 0){
+        perror("createMulticastSocket:\tsetsockopt():");
+        return 0;
+    }
+
+    return 1;
+}
+
+int createDatagramSocket(int *sd, int portNum){
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(portNum), .sin_addr.s_addr = INADDR_ANY};
+    *sd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if(*sd == -1){
+        perror("createDatagramSocket:\tsocket():");
+        return 0;
+    }
+    //one socket per shard, the kernel hashes each client's address to the same one every time
+    int reusePort = 1;
+    if(setsockopt(*sd, SOL_SOCKET, SO_REUSEPORT, &reusePort, sizeof(reusePort)) != 0){
+        perror("createDatagramSocket:\tsetsockopt():");
+        close(*sd);
+        return 0;
+    }
+    //the kernel caps these at net.core.rmem_max and wmem_max, which is only a problem under a burst it can't take
+    int bufferSize = UDP_SOCKET_BUFFER;
+    setsockopt(*sd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+    setsockopt(*sd, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    if(bind(*sd, (struct sockaddr *)&address, sizeof(address)) != 0){
+        perror("createDatagramSocket:\tbind():");
+        close(*sd);
+        return 0;
+    }
+    return 1;
+}
+
+int createListeningSocket(int *sd, int portNum, struct sockaddr_in *server_address, int backlog){
+    struct timeval tv;
+    tv.tv_sec = TIMETOWAIT;
+    tv.tv_usec = 0;
+
+    server_address->sin_family = AF_INET;
+    server_address->sin_port = htons(portNum);
+    server_address->sin_addr.s_addr = INADDR_ANY;
+    *sd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0); //non blocking so acceptConnections() can drain it
+    if (*sd==-1){
+        perror("createListeningSocket:\tsocket():");
+        return 0;
+    }
+    if (setsockopt(*sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {//set socket timeout
+        perror("createListeningSocket:\tsetsockopt():");
+        close(*sd);
+        return 0;
+    }
+    int reusePort = 1;
+    if (setsockopt(*sd, SOL_SOCKET, SO_REUSEPORT, &reusePort, sizeof(reusePort))) {//one listening socket per shard
+        perror("createListeningSocket:\tsetsockopt():");
+        close(*sd);
+        return 0;
+    }
+    socklen_t fromLength = sizeof(struct sockaddr_in);
+    int rc = bind(*sd, (struct sockaddr *)server_address, fromLength);
+    if(rc != 0){
+        perror("createListeningSocket:\tbind():");
+        return 0;
+    }
+    rc = listen(*sd, backlog);
+    if(rc != 0){
+        perror("createListeningSocket:\tlisten():");
+        return 0;
+    }
+    return 1;
+}
+
+void initializeWinTable(void){
+    for(int mask = 0; mask <= FULL_BOARD; mask++){
+        winningMasks[mask] = 0;
+        for(int n = 0; n < sizeof(winningLines) / sizeof(winningLines[0]); n++){
+            if((mask & winningLines[n]) == winningLines[n])
+                winningMasks[mask] = 1;
+        }
+    }
+    boardClassifier = getBestBoardClassifier();
+}
+
+int checkwin(const struct board board)
+{
+    /************************************************************************/
+    /* table lookup to see if someone won, or if there is a draw            */
+    /* return a 0 if the game is 'over' and return -1 if game should go on  */
+    /************************************************************************/
+    if (winningMasks[board.x] | winningMasks[board.o])
+        return 1;
+    else if ((board.x | board.o) == FULL_BOARD)
+        return 0; // Return of 0 means game over
+    else
+        return  - 1; // return of -1 means keep playing
+}
+
+void classifyBoards(const struct board *boards, signed char *states, const size_t count){
+    boardClassifiers[boardClassifier].classify(boards, states, count);
+}
+
+enum classifierID getBestBoardClassifier(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return CLASSIFIER_AVX2;
+#endif
+    //SSE2's 4 boards at a time lose to checkwin()'s inlined table lookup, it is only kept for ttts-micro to compare
+    return CLASSIFIER_SCALAR;
+}
+
+void classifyBoardsScalar(const struct board *boards, signed char *states, const size_t count){
+    for(size_t n = 0; n < count; n++)
+        states[n] = checkwin(boards[n]);
+}
+
+/*
+ * The vector kernels load boards as they lie in memory, x in the low and o in the high half of a 32 bit lane.
+ * A 16 bit compare per line finds either player's win, a 32 bit compare then merges the two halves of each board.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void classifyBoardsSSE2(const struct board *boards, signed char *states, const size_t count){
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i keepPlaying = _mm_set1_epi32(-1);
+    const __m128i halfMask = _mm_set1_epi32(0xFFFF);
+    const __m128i fullBoard = _mm_set1_epi32(FULL_BOARD);
+    __m128i lines[sizeof(winningLines) / sizeof(winningLines[0])];
+    for(int line = 0; line < sizeof(winningLines) / sizeof(winningLines[0]); line++)
+        lines[line] = _mm_set1_epi16(winningLines[line]);
+    size_t n = 0;
+    for(; n + 4 <= count; n += 4){
+        __m128i board = _mm_loadu_si128((const __m128i *)(boards + n));
+        __m128i won = zero;
+        for(int line = 0; line < sizeof(lines) / sizeof(lines[0]); line++)
+            won = _mm_or_si128(won, _mm_cmpeq_epi16(_mm_and_si128(board, lines[line]), lines[line]));
+        __m128i notWon = _mm_cmpeq_epi32(won, zero);
+        __m128i occupied = _mm_and_si128(_mm_or_si128(board, _mm_srli_epi32(board, 16)), halfMask);
+        //-1 on boards still in play, 0 on full ones, then 1 wherever someone has won
+        __m128i state = _mm_sub_epi32(keepPlaying, _mm_cmpeq_epi32(occupied, fullBoard));
+        state = _mm_or_si128(_mm_and_si128(notWon, state), _mm_andnot_si128(notWon, one));
+        __m128i packed = _mm_packs_epi16(_mm_packs_epi32(state, state), zero);
+        int32_t bytes = _mm_cvtsi128_si32(packed);
+        memcpy(states + n, &bytes, sizeof(bytes));
+    }
+    classifyBoardsScalar(boards + n, states + n, count - n);
+}
+
+__attribute__((target("avx2")))
+void classifyBoardsAVX2(const struct board *boards, signed char *states, const size_t count){
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i keepPlaying = _mm256_set1_epi32(-1);
+    const __m256i halfMask = _mm256_set1_epi32(0xFFFF);
+    const __m256i fullBoard = _mm256_set1_epi32(FULL_BOARD);
+    //packing works within each 128 bit half, this gathers the two halves' 4 bytes
+    const __m256i gather = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+    __m256i lines[sizeof(winningLines) / sizeof(winningLines[0])];
+    for(int line = 0; line < sizeof(winningLines) / sizeof(winningLines[0]); line++)
+        lines[line] = _mm256_set1_epi16(winningLines[line]);
+    size_t n = 0;
+    for(; n + 8 <= count; n += 8){
+        __m256i board = _mm256_loadu_si256((const __m256i *)(boards + n));
+        __m256i won = zero;
+        for(int line = 0; line < sizeof(lines) / sizeof(lines[0]); line++)
+            won = _mm256_or_si256(won, _mm256_cmpeq_epi16(_mm256_and_si256(board, lines[line]), lines[line]));
+        __m256i notWon = _mm256_cmpeq_epi32(won, zero);
+        __m256i occupied = _mm256_and_si256(_mm256_or_si256(board, _mm256_srli_epi32(board, 16)), halfMask);
+        __m256i state = _mm256_sub_epi32(keepPlaying, _mm256_cmpeq_epi32(occupied, fullBoard));
+        state = _mm256_or_si256(_mm256_and_si256(notWon, state), _mm256_andnot_si256(notWon, one));
+        __m256i packed = _mm256_packs_epi16(_mm256_packs_epi32(state, state), zero);
+        _mm_storel_epi64((__m128i *)(states + n), _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(packed, gather)));
+    }
+    classifyBoardsScalar(boards + n, states + n, count - n);
+}
+#else
+void classifyBoardsSSE2(const struct board *boards, signed char *states, const size_t count){
+    classifyBoardsScalar(boards, states, count);
+}
+
+void classifyBoardsAVX2(const struct board *boards, signed char *states, const size_t count){
+    classifyBoardsScalar(boards, states, count);
+}
+#endif
+
+unsigned short getLegalMoves(const struct board board){
+    return ~(board.x | board.o) & FULL_BOARD;
+}
+
+int getGameState(const struct game *game){
+    if(game->variant == VARIANT_CLASSIC)
+        return checkwin(game->board);
+    const struct wideBoard *board = getWideBoard(game);
+    if(board->winner != 0)
+        return 1;
+    const struct variant *variant = &variants[game->variant];
+    return board->moves == variant->rows * variant->columns ? 0 : -1;
+}
+
+struct wideBoard *getWideBoard(const struct game *game){
+    return &game->shard->wideBoards[game->id];
+}
+
+/**
+ * Walks away from square along the 4 line directions, both ways, counting the mover's stones until a gap or the edge.
+ * Only DEFINE_WIN_KERNEL calls it, always inlined with the variant's dimensions as constants, so every kernel gets
+ * its own copy with the loops unrolled and the divisions by the column count turned into multiplications.
+ */
+static inline __attribute__((always_inline)) int isLineThrough(const uint64_t *stones, const int square,
+                                                              const int rows, const int columns, const int winLength){
+    const int steps[4][2] = {{0, 1}, {1, 0}, {1, 1}, {1, -1}}; //row and column step of a row, column and both diagonals
+    const int row = square / columns;
+    const int column = square % columns;
+    for(int direction = 0; direction < 4; direction++){
+        int run = 1;
+        for(int sign = -1; sign <= 1; sign += 2){
+            int r = row + sign * steps[direction][0];
+            int c = column + sign * steps[direction][1];
+            while(run < winLength && r >= 0 && r < rows && c >= 0 && c < columns
+                  && (stones[(r * columns + c) / 64] >> ((r * columns + c) % 64) & 1)){
+                run++;
+                r += sign * steps[direction][0];
+                c += sign * steps[direction][1];
+            }
+        }
+        if(run >= winLength)
+            return 1;
+    }
+    return 0;
+}
+
+//a win check specialized for one board size and win length, only the lines through the new stone are looked at
+#define DEFINE_WIN_KERNEL(name, rows, columns, winLength) \
+    int name(const uint64_t *stones, const int square){ \
+        return isLineThrough(stones, square, rows, columns, winLength); \
+    }
+
+DEFINE_WIN_KERNEL(isWinningMove4x4, 4, 4, 4)
+DEFINE_WIN_KERNEL(isWinningMove5x5, 5, 5, 4)
+DEFINE_WIN_KERNEL(isWinningMoveConnectFour, 6, 7, 4)
+DEFINE_WIN_KERNEL(isWinningMoveGomoku, 15, 15, 5)
+
+void tictactoeRound(struct game *game, unsigned char clientMove){
+    const int CLIENT = 2;
+    game->currentSeqNum += 2; //account for both client and server response
+    if(isLegalMove(game, clientMove)){
+        makeMoveOnBoard(game, clientMove, CLIENT);
+        LOG(LOG_ACTION, "[ACTION]:\tFor game %i, Player 2 made MOVE: %i\n", game->id, clientMove);
+    }
+    else{
+        LOG(LOG_ACTION, "[ACTION]:\tFor game %i, Player 2 made illegal MOVE: %i, aborting game\n", game->id, clientMove);
+        game->isInProgress = 0;
+        return;
+    }
+    struct message reply = getServerReply(game);
+    sendPacketToClient(game, &reply);
+    memcpy(&game->lastMessage, &reply, sizeof(struct message));
+}
+
+void makeMoveOnBoard(struct game *game, unsigned char move, int player){
+    if(game->variant == VARIANT_CLASSIC){
+        uint16_t *mark = (player%2==1) ? &game->board.x : &game->board.o;
+        *mark |= 1 << (move-1);
+        return;
+    }
+    struct wideBoard *board = getWideBoard(game);
+    uint64_t *stones = (player%2==1) ? board->x : board->o;
+    stones[(move-1) / 64] |= 1ULL << ((move-1) % 64);
+    board->moves++;
+    if(board->winner == 0 && variants[game->variant].isWinningMove(stones, move-1))
+        board->winner = (player%2==1) ? 1 : 2;
+}
+
+int getBoardIndex(const struct board board){
+    return base3Digits[board.x] + 2 * base3Digits[board.o];
+}
+
+signed char negamax(struct board board, int xToMove, signed char scores[2][NUM_BOARD_STATES], unsigned char solved[2][NUM_BOARD_STATES]){
+    int index = getBoardIndex(board);
+    if(solved[xToMove][index])
+        return scores[xToMove][index];
+
+    unsigned short legal = getLegalMoves(board);
+    int openSquares = __builtin_popcount(legal);
+    signed char best;
+    if(winningMasks[board.x] | winningMasks[board.o]){
+        best = -(openSquares + 1); //whoever moved last has already won
+    }
+    else if(legal == 0){
+        best = 0;
+    }
+    else{
+        best = -127;
+        uint16_t bestMoves = 0;
+        for(int square = 0; square < ROWS * COLUMNS; square++){
+            if(!(legal & (1 << square)))
+                continue;
+            struct board next = board;
+            if(xToMove)
+                next.x |= 1 << square;
+            else
+                next.o |= 1 << square;
+            signed char score = -negamax(next, !xToMove, scores, solved);
+            if(score > best){
+                best = score;
+                bestMoves = 0;
+            }
+            if(score == best)
+                bestMoves |= 1 << square;
+        }
+        if(xToMove)
+            perfectMoves[index] = bestMoves;
+    }
+    scores[xToMove][index] = best;
+    solved[xToMove][index] = 1;
+    return best;
+}
+
+void initializeAITable(void){
+    for(int mask = 0; mask <= FULL_BOARD; mask++){
+        int digit = 1;
+        base3Digits[mask] = 0;
+        for(int square = 0; square < ROWS * COLUMNS; square++){
+            if(mask & (1 << square))
+                base3Digits[mask] += digit;
+            digit *= 3;
+        }
+    }
+
+    //scratch space for the search, only perfectMoves[] is kept
+    signed char (*scores)[NUM_BOARD_STATES] = calloc(2, sizeof(*scores));
+    unsigned char (*solved)[NUM_BOARD_STATES] = calloc(2, sizeof(*solved));
+    if(scores == NULL || solved == NULL){
+        perror("initializeAITable:\tcalloc():");
+        exit(EXIT_FAILURE);
+    }
+    //RESUME can hand us any board, so solve every encoding rather than just the reachable ones
+    for(int mask = 0; mask <= FULL_BOARD; mask++){
+        for(int other = mask; ; other = (other - 1) & mask){
+            struct board board = {.x = mask & ~other, .o = other};
+            negamax(board, 1, scores, solved);
+            if(other == 0)
+                break;
+        }
+    }
+    free(scores);
+    free(solved);
+}
+
+unsigned char getAIMove(const struct board board, const double epsilon){
+    unsigned short candidates = getLegalMoves(board);
+    if(candidates == 0) //board is full
+        return 255;
+    int playRandom = epsilon >= 1.0 || (epsilon > 0 && rand_r(&aiSeed) < epsilon * RAND_MAX);
+    if(!playRandom && perfectMoves[getBoardIndex(board)] != 0)
+        candidates = perfectMoves[getBoardIndex(board)];
+
+    //pick one of the candidate squares at random so perfect play doesn't repeat the same game every time
+    int skip = rand_r(&aiSeed) % __builtin_popcount(candidates);
+    while(skip-- > 0)
+        candidates &= candidates - 1;
+    return __builtin_ctz(candidates) + 1;
+}
+
+unsigned char getWideAIMove(const struct variant *variant, const struct wideBoard *board, const double epsilon){
+    unsigned char candidates[MAX_SQUARES];
+    int numCandidates = 0;
+    for(int square = 1; square <= variant->rows * variant->columns; square++){
+        if(validateWideMove(variant, board, square))
+            candidates[numCandidates++] = square;
+    }
+    if(numCandidates == 0) //board is full
+        return 255;
+    int playRandom = epsilon >= 1.0 || (epsilon > 0 && rand_r(&aiSeed) < epsilon * RAND_MAX);
+    if(!playRandom){
+        //our own win first, then the square the client would win on
+        uint64_t stones[WIDE_BOARD_WORDS];
+        for(int player = 0; player < 2; player++){
+            memcpy(stones, player == 0 ? board->x : board->o, sizeof(stones));
+            for(int n = 0; n < numCandidates; n++){
+                int square = candidates[n] - 1;
+                stones[square / 64] |= 1ULL << (square % 64);
+                int isWin = variant->isWinningMove(stones, square);
+                stones[square / 64] &= ~(1ULL << (square % 64));
+                if(isWin)
+                    return candidates[n];
+            }
+        }
+    }
+    return candidates[rand_r(&aiSeed) % numCandidates];
+}
+
+unsigned char getServerMove(const struct game *game){
+    if(game->variant == VARIANT_CLASSIC)
+        return getAIMove(game->board, aiEpsilon);
+    return getWideAIMove(&variants[game->variant], getWideBoard(game), aiEpsilon);
+}
+
+unsigned char getOpponentMove(const struct game *game, const double epsilon){
+    if(game->variant == VARIANT_CLASSIC){
+        //perfectMoves[] covers every encoding, with the marks swapped it holds O's best moves as well
+        struct board swapped = {.x = game->board.o, .o = game->board.x};
+        return getAIMove(swapped, epsilon);
+    }
+    struct wideBoard swapped = *getWideBoard(game);
+    memcpy(swapped.x, getWideBoard(game)->o, sizeof(swapped.x));
+    memcpy(swapped.o, getWideBoard(game)->x, sizeof(swapped.o));
+    return getWideAIMove(&variants[game->variant], &swapped, epsilon);
+}
+
+int getWinner(const struct game *game){
+    if(game->variant != VARIANT_CLASSIC)
+        return getWideBoard(game)->winner;
+    if(winningMasks[game->board.x])
+        return 1;
+    return winningMasks[game->board.o] ? 2 : 0;
+}
+
+int allocateGameSlot(struct shard *shard){
+    if(shard->numFreeSlots == 0)
+        return -1;
+    int id = shard->freeSlots[--shard->numFreeSlots];
+    shard->occupiedSlots[id / 64] |= 1ULL << (id % 64);
+    return id;
+}
+
+void releaseGameSlot(struct shard *shard, struct game *game){
+    shard->occupiedSlots[game->id / 64] &= ~(1ULL << (game->id % 64));
+    shard->freeSlots[shard->numFreeSlots++] = game->id;
+}
+
+int getNextOccupiedSlot(const struct shard *shard, const int id){
+    if(id >= shard->numGames)
+        return -1;
+    int word = id / 64;
+    uint64_t bits = shard->occupiedSlots[word] & (~0ULL << (id % 64));
+    while(bits == 0){
+        if(++word == (shard->numGames + 63) / 64)
+            return -1;
+        bits = shard->occupiedSlots[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+int initializeGame(struct game *game){
+    game->isInProgress = 1;
+    game->currentSeqNum = 0;
+    game->resends = 0;
+    memset(&game->lastMessage, 0, sizeof(struct message));
+    /* this just initializing the shared state aka the board */
+    game->board.x = 0;
+    game->board.o = 0;
+    if(game->variant != VARIANT_CLASSIC)
+        memset(getWideBoard(game), 0, sizeof(struct wideBoard));
+    return 0;
+}
+
+//ripped from client from lab4
+///Very simple function to validate user input
+int validateMove(unsigned char move, const struct board board){
+    //move corresponds to a square on the board
+    if(move < 0x01 || move > 0x09)
+        return 0;
+    //the square is available if neither player's mask has its bit set
+    return (getLegalMoves(board) >> (move-1)) & 1;
+}
+
+int validateWideMove(const struct variant *variant, const struct wideBoard *board, unsigned char move){
+    const int squares = variant->rows * variant->columns;
+    if(move < 1 || move > squares)
+        return 0;
+    const int square = move - 1;
+    if((board->x[square / 64] | board->o[square / 64]) >> (square % 64) & 1)
+        return 0;
+    //with gravity a stone has to rest on the bottom row or on another stone
+    const int below = square + variant->columns;
+    return !variant->hasGravity || below >= squares || ((board->x[below / 64] | board->o[below / 64]) >> (below % 64) & 1);
+}
+
+int isLegalMove(const struct game *game, unsigned char move){
+    if(game->variant == VARIANT_CLASSIC)
+        return validateMove(move, game->board);
+    return validateWideMove(&variants[game->variant], getWideBoard(game), move);
+}
+
+uint64_t getMonotonicMillis(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t getMonotonicNanos(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void scheduleGameTimeout(struct timerWheel *wheel, struct game *game, const uint64_t deadline){
+    cancelGameTimeout(wheel, game);
+    //round up so a game never fires before its deadline
+    uint64_t tick = (deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if(tick <= wheel->currentTick)
+        tick = wheel->currentTick + 1;
+    int *slot = &wheel->slots[tick & (TIMER_SLOTS - 1)];
+    struct gameTimer *entry = &wheel->entries[game->id];
+    entry->tick = tick;
+    entry->prev = -1;
+    entry->next = *slot;
+    if(*slot != -1)
+        wheel->entries[*slot].prev = game->id;
+    *slot = game->id;
+    wheel->count++;
+}
+
+void cancelGameTimeout(struct timerWheel *wheel, struct game *game){
+    struct gameTimer *entry = &wheel->entries[game->id];
+    if(entry->tick == 0)
+        return;
+    if(entry->prev != -1)
+        wheel->entries[entry->prev].next = entry->next;
+    else
+        wheel->slots[entry->tick & (TIMER_SLOTS - 1)] = entry->next;
+    if(entry->next != -1)
+        wheel->entries[entry->next].prev = entry->prev;
+    entry->tick = 0;
+    entry->next = -1;
+    entry->prev = -1;
+    wheel->count--;
+}
+
+int getNextTimeout(const struct timerWheel *wheel, const uint64_t now){
+    if(wheel->count == 0)
+        return -1;
+    uint64_t nowTick = now / TIMER_TICK_MS;
+    uint64_t nextTick = wheel->currentTick + TIMER_SLOTS;
+    //wake at the first non-empty slot without walking its entries. A slot whose entries are all a lap or more away
+    //(only deadlines more than TIMER_SLOTS ticks out) wakes the thread once per lap for nothing,
+    //manageTimedOutGames() leaves those entries be
+    for(uint64_t tick = wheel->currentTick + 1; tick <= wheel->currentTick + TIMER_SLOTS; tick++){
+        if(wheel->slots[tick & (TIMER_SLOTS - 1)] != -1){
+            nextTick = tick;
+            break;
+        }
+    }
+    if(nextTick <= nowTick)
+        return 0;
+    return (int)((nextTick * TIMER_TICK_MS) - now);
+}
+
+void manageTimedOutGames(struct shard *shard){
+    struct timerWheel *wheel = &shard->timers;
+    uint64_t nowTick = shard->now / TIMER_TICK_MS;
+    if(wheel->currentTick == 0 || wheel->count == 0)
+        wheel->currentTick = nowTick;
+    //after a long stall every slot is visited once instead of every tick that was missed
+    uint64_t firstTick = wheel->currentTick + 1;
+    if(nowTick >= TIMER_SLOTS && firstTick < nowTick - TIMER_SLOTS + 1)
+        firstTick = nowTick - TIMER_SLOTS + 1;
+
+    for(uint64_t tick = firstTick; tick <= nowTick; tick++){
+        int id = wheel->slots[tick & (TIMER_SLOTS - 1)];
+        while(id != -1){
+            int next = wheel->entries[id].next;
+            //the game itself is only touched once its timeout has come
+            if(wheel->entries[id].tick <= nowTick){
+                struct game *game = &shard->games[id];
+                cancelGameTimeout(wheel, game);
+                if(!game->isInProgress){
+                    //the game ended, or never started, and its client is still holding on to the slot
+                    if(game->socket > 0){
+                        LOG(LOG_ACTION, "[ACTION]:\tClosed idle client of game %i, which has no game in progress\n", game->id);
+                        COUNT(shard->metrics.prunedGames);
+                        closeGame(game);
+                    }
+                }
+                else if(game->socket <= 0){
+                    LOG(LOG_ACTION, "[ACTION]:\tNobody came back for recovered game %i, freeing it\n", game->id);
+                    game->isInProgress = 0;
+                    saveGameRecord(game, &game->lastMessage);
+                    releaseGameSlot(shard, game);
+                }
+                else if(evictAfter > 0 && game->variant == VARIANT_CLASSIC && getGameState(game) == -1){
+                    evictGame(game);
+                }
+                else if(game->resends < MAX_RESENDS){
+                    game->resends++;
+                    COUNT(shard->metrics.timeoutResends);
+                    LOG(LOG_ACTION, "[ACTION]:\tFor game %i, resent last message ( %i / %i resends )\n", game->id, game->resends, MAX_RESENDS);
+                    sendPacketToClient(game, &game->lastMessage);
+                    scheduleGameTimeout(wheel, game, shard->now + GAME_TIMEOUT * 1000);
+                }
+                else{
+                    LOG(LOG_ACTION, "[ACTION]:\tPruned timed out game with ID %i\n", game->id);
+                    COUNT(shard->metrics.prunedGames);
+                    closeGame(game);
+                }
+            }
+            id = next;
+        }
+    }
+    wheel->currentTick = nowTick;
+}
+
+struct message parsePacketFromBuffer(const unsigned char *buffer) {
+    struct message packet;
+    packet.version = buffer[0];
+    packet.command = buffer[1];
+    packet.position = buffer[2];
+    if(packet.version == EXTENDED_VERSION){
+        uint32_t nboID;
+        memcpy(&nboID, buffer + 3, sizeof(nboID));
+        packet.id = ntohl(nboID);
+        packet.seqNum = buffer[7];
+    }
+    else{
+        packet.id = buffer[3];
+        packet.seqNum = buffer[4];
+    }
+    LOG(LOG_DATA, "[DATA]\t\tRECVD\t%i\t%i\t%i\t%i\t%i\n",
+           packet.version, packet.command, packet.position, packet.id, packet.seqNum);
+    return packet;
+}
+
+int serializeMessage(const struct message *message, unsigned char *buffer){
+    buffer[0] = message->version;
+    buffer[1] = message->command;
+    buffer[2] = message->position;
+    if(message->version == EXTENDED_VERSION){
+        uint32_t nboID = htonl(message->id);
+        memcpy(buffer + 3, &nboID, sizeof(nboID));
+        buffer[7] = message->seqNum;
+        return EXTENDED_MESSAGE_SIZE;
+    }
+    buffer[3] = message->id;
+    buffer[4] = message->seqNum;
+    return MESSAGE_SIZE;
+}
+
+void sendPacketToClient(struct game *game, struct message *message) {
+    LOG(LOG_DATA, "[DATA]\t\tSENT\t%i\t%i\t%i\t%i\t%i\n",
+           message->version, message->command, message->position, message->id, message->seqNum);
+    unsigned char wire[EXTENDED_MESSAGE_SIZE];
+    int length = serializeMessage(message, wire);
+    //the state the reply is based on has to be in place before the client can act on it
+    saveGameRecord(game, message);
+    journalEvent(game, JOURNAL_SENT, message->command, message->position, message->seqNum);
+    replicateGame(game, message);
+    queueReply(game, wire, length);
+    //only replies to something the client sent count towards latency, timeout resends don't
+    if(game->shard->readableAt != 0){
+        game->unrecordedReplies++;
+        game->readableAt = game->shard->readableAt;
+    }
+}
+
+void queueReply(struct game *game, const unsigned char *wire, const int length){
+    //handleBufferedFrames() keeps room for the reply to every frame, only a timeout resend or a resume token can
+    //find the buffer full, and then the client hasn't read what is already queued
+    if(game->outHead - game->outTail + length > OUT_BUFFER_SIZE){
+        LOG(LOG_ERROR, "[ERROR]:\tOutput buffer full for game %i, dropping reply\n", game->id);
+        return;
+    }
+    for(int n = 0; n < length; n++)
+        game->outBuffer[(game->outHead + n) & (OUT_BUFFER_SIZE - 1)] = wire[n];
+    game->outHead += length;
+    if(!game->isSendPending){
+        game->isSendPending = 1;
+        game->sendNext = game->shard->pendingSends;
+        game->shard->pendingSends = game;
+    }
+}
+
+void flushSends(struct shard *shard){
+    uint64_t now = getMonotonicNanos();
+    //a stalled game whose replies went out reads on and queues more, those go out in another round
+    while(shard->pendingSends != NULL){
+        struct game *game = shard->pendingSends;
+        shard->pendingSends = NULL;
+        for(; game != NULL; game = game->sendNext){
+            game->isSendPending = 0;
+            if(game->socket <= 0)
+                continue;
+            recordReplyLatencies(game, now);
+            //anything queued behind a short write goes out with it once the socket drains
+            if(isDatagramGame(game))
+                queueDatagramReplies(shard, game);
+            else if(!game->isWaitingWritable)
+                writeQueuedReplies(shard, game);
+        }
+    }
+    if(shard->udp != NULL && shard->udp->numReplies > 0)
+        sendDatagramReplies(shard);
+}
+
+void writeQueuedReplies(struct shard *shard, struct game *game){
+    if(game->socket <= 0)
+        return;
+    if(isDatagramGame(game)){
+        queueDatagramReplies(shard, game);
+        return;
+    }
+    while(game->outTail != game->outHead){
+        //the queued bytes wrap around the end of the buffer at most once
+        unsigned int start = game->outTail & (OUT_BUFFER_SIZE - 1);
+        unsigned int length = game->outHead - game->outTail;
+        struct iovec iov[2];
+        iov[0].iov_base = game->outBuffer + start;
+        iov[0].iov_len = length < OUT_BUFFER_SIZE - start ? length : OUT_BUFFER_SIZE - start;
+        iov[1].iov_base = game->outBuffer;
+        iov[1].iov_len = length - iov[0].iov_len;
+        struct msghdr header = {.msg_iov = iov, .msg_iovlen = iov[1].iov_len > 0 ? 2 : 1};
+        COUNT(shard->metrics.syscalls);
+        ssize_t rc = sendmsg(game->socket, &header, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if(rc < 0){
+            LOG_ERRNO("writeQueuedReplies:\tsendmsg()");
+            closeGame(game);
+            cancelGameTimeout(&shard->timers, game);
+            return;
+        }
+        game->outTail += rc;
+    }
+    game->outSent = game->outTail;
+    int isWaiting = game->outTail != game->outHead;
+    if(isWaiting && !game->isWaitingWritable)
+        COUNT(shard->metrics.shortWrites);
+    if(isWaiting != game->isWaitingWritable){
+        struct epoll_event event = {.events = EPOLLIN | EPOLLET | (isWaiting ? EPOLLOUT : 0), .data.ptr = game};
+        COUNT(shard->metrics.syscalls);
+        if(epoll_ctl(shard->epollSD, EPOLL_CTL_MOD, game->socket, &event) != 0)
+            LOG_ERRNO("writeQueuedReplies:\tepoll_ctl()");
+        game->isWaitingWritable = isWaiting;
+    }
+    if(game->isReadStalled && OUT_BUFFER_SIZE - (game->outHead - game->outTail) >= EXTENDED_MESSAGE_SIZE)
+        handleGameData(shard, game);
+}
+
+void copyBoardStateToGame(struct game *game, const unsigned char *buffer) {
+    game->board.x = 0;
+    game->board.o = 0;
+    if(game->variant == VARIANT_CLASSIC){
+        for(int n=0; n < ROWS*COLUMNS; n++){
+            if(buffer[n] == 'X')
+                game->board.x |= 1 << n;
+            else if(buffer[n] == 'O')
+                game->board.o |= 1 << n;
+        }
+        return;
+    }
+    const struct variant *variant = &variants[game->variant];
+    struct wideBoard *board = getWideBoard(game);
+    memset(board, 0, sizeof(struct wideBoard));
+    for(int n=0; n < variant->rows * variant->columns; n++){
+        if(buffer[n] == 'X')
+            board->x[n / 64] |= 1ULL << (n % 64);
+        else if(buffer[n] == 'O')
+            board->o[n / 64] |= 1ULL << (n % 64);
+        else
+            continue;
+        board->moves++;
+    }
+    //nothing says which stone came last, so any stone can be the one completing a line
+    for(int n=0; n < variant->rows * variant->columns && board->winner == 0; n++){
+        if((board->x[n / 64] >> (n % 64) & 1) && variant->isWinningMove(board->x, n))
+            board->winner = 1;
+        else if((board->o[n / 64] >> (n % 64) & 1) && variant->isWinningMove(board->o, n))
+            board->winner = 2;
+    }
+}
+
+struct message getServerReply(struct game *game) {
+    const int SERVER = 1;
+    struct message reply;
+    reply.version = game->version;
+    reply.id = game->id;
+    reply.seqNum = game->currentSeqNum;
+
+    int rc = getGameState(game);
+
+    if(rc == -1){ //server needs to make a move in reply to client
+        unsigned char move = getServerMove(game);
+        if(move != 255){
+            LOG(LOG_ACTION, "[ACTION]:\tFor game %i, Player 1 made MOVE: %i\n", game->id, move);
+            makeMoveOnBoard(game, move, SERVER);
+            reply.command = MOVE;
+            reply.position = move;
+        }
+        rc = getGameState(game);
+        if(rc == 1 || rc == 0){
+            LOG(LOG_ACTION, "[ACTION]:\tFor game %i, game over state detected. Waiting for GAMEOVER message.\n", game->id);
+        }
+    }
+    else{ // the game is over, send a GAMEOVER message to client to ack their final move
+        LOG(LOG_ACTION, "[ACTION]:\tFor game %i, game over state detected. Sending GAMEOVER message.\n", game->id);
+        game->isInProgress = 0;
+        reply.command = GAMEOVER;
+        reply.position = 0;
+    }
+    return reply;
+}
+
+size_t getStateFileSlice(const int shard, const int numShards, const int maxGames){
+    const int recordsPerLine = CACHE_LINE_SIZE / sizeof(struct gameRecord);
+    size_t offset = 0;
+    for(int n = 0; n < shard; n++){
+        //same split as main()
+        int numGames = maxGames / numShards + (n < maxGames % numShards ? 1 : 0);
+        offset += (numGames + recordsPerLine - 1) / recordsPerLine * recordsPerLine;
+    }
+    return offset;
+}
+
+struct gameRecord *openStateFile(const char *path, const int numShards, const int maxGames){
+    size_t size = sizeof(struct stateFileHeader) + getStateFileSlice(numShards, numShards, maxGames) * sizeof(struct gameRecord);
+    struct stat info;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd == -1){
+        perror("openStateFile:\topen():");
+        return NULL;
+    }
+    if(fstat(fd, &info) != 0 || (info.st_size != (off_t)size && ftruncate(fd, size) != 0)){
+        perror("openStateFile:\tftruncate():");
+        close(fd);
+        return NULL;
+    }
+    struct stateFileHeader *header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(header == MAP_FAILED){
+        perror("openStateFile:\tmmap():");
+        return NULL;
+    }
+    if(memcmp(header->magic, STATE_FILE_MAGIC, sizeof(header->magic)) != 0 || header->format != STATE_FILE_FORMAT
+       || header->numShards != numShards || header->maxGames != maxGames){
+        if(info.st_size != 0)
+            printf("\nState file was written with another --threads or --max-games, starting it over");
+        memset(header, 0, size);
+        memcpy(header->magic, STATE_FILE_MAGIC, sizeof(header->magic));
+        header->format = STATE_FILE_FORMAT;
+        header->numShards = numShards;
+        header->maxGames = maxGames;
+    }
+    return (struct gameRecord *)(header + 1);
+}
+
+void saveGameRecord(struct game *game, const struct message *lastMessage){
+    if(game->shard->records == NULL)
+        return;
+    struct gameRecord *record = &game->shard->records[game->id];
+    //the fences keep the compiler from moving the field stores outside the odd window
+    uint32_t sequence = record->sequence | 1;
+    record->sequence = sequence;
+    atomic_thread_fence(memory_order_release);
+    packGameRecord(game, lastMessage, record);
+    if(game->variant != VARIANT_CLASSIC)
+        record->isInProgress = 0; //a record only has room for a 3x3 board
+    atomic_thread_fence(memory_order_release);
+    record->sequence = sequence + 1;
+}
+
+void packGameRecord(const struct game *game, const struct message *lastMessage, struct gameRecord *record){
+    record->x = game->board.x;
+    record->o = game->board.o;
+    record->currentSeqNum = game->currentSeqNum;
+    record->isInProgress = game->isInProgress;
+    record->version = game->version;
+    record->resends = game->resends;
+    record->lastCommand = lastMessage->command;
+    record->lastPosition = lastMessage->position;
+    record->lastSeqNum = lastMessage->seqNum;
+}
+
+int restoreGameRecord(struct shard *shard, struct game *game, const struct gameRecord *record){
+    if(record->sequence & 1 || !record->isInProgress)
+        return 0;
+    if((record->x & record->o) != 0 || record->x > FULL_BOARD || record->o > FULL_BOARD
+       || (record->version != VERSION && record->version != EXTENDED_VERSION) || record->lastCommand > RESUME)
+        return 0;
+    game->isInProgress = 1;
+    game->variant = VARIANT_CLASSIC;
+    game->board.x = record->x;
+    game->board.o = record->o;
+    game->currentSeqNum = record->currentSeqNum;
+    game->resends = record->resends;
+    game->version = record->version;
+    game->lastMessage.version = record->version;
+    game->lastMessage.command = record->lastCommand;
+    game->lastMessage.position = record->lastPosition;
+    game->lastMessage.id = game->id;
+    game->lastMessage.seqNum = record->lastSeqNum;
+    scheduleGameTimeout(&shard->timers, game, shard->now + GAME_TIMEOUT * 1000);
+    return 1;
+}
+
+int startLogger(const int numRings){
+    logRings = calloc(numRings, sizeof(struct logRing));
+    if(logRings == NULL){
+        perror("startLogger:\tcalloc():");
+        return 0;
+    }
+    numLogRings = numRings;
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, runLogger, NULL);
+    if(rc != 0){
+        printf("startLogger:\tpthread_create(): %s\n", strerror(rc));
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+void pushLogRecord(const char *format, const int args[LOG_MAX_ARGS], const int error){
+    struct logRecord *record;
+    struct logRing *ring = threadLogRing;
+    if(ring == NULL){ //not a reactor thread, nothing to keep fast
+        struct logRecord local = {.format = format, .error = error};
+        memcpy(local.args, args, sizeof(local.args));
+        writeLogRecord(&local);
+        return;
+    }
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SIZE){
+        //never block the event loop on the log, the logging thread reports how much was lost
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    record->format = format;
+    memcpy(record->args, args, sizeof(record->args));
+    record->error = error;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void writeLogRecord(const struct logRecord *record){
+    FILE *output = logOutput != NULL ? logOutput : stdout;
+    fprintf(output, record->format, record->args[0], record->args[1], record->args[2],
+            record->args[3], record->args[4], record->args[5]);
+    if(record->error != 0){
+        char description[128];
+        fprintf(output, ": %s\n", strerror_r(record->error, description, sizeof(description)));
+    }
+}
+
+void *runLogger(void *arg){
+    while(1){
+        int wrote = 0;
+        for(int n = 0; n < numLogRings; n++){
+            struct logRing *ring = &logRings[n];
+            unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            for(; tail != head; tail++){
+                writeLogRecord(&ring->records[tail & (LOG_RING_SIZE - 1)]);
+                wrote = 1;
+            }
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+            unsigned int dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+            if(dropped > 0){
+                struct logRecord warning = {.format = "[ERROR]:\tLog ring %i was full, dropped %i records\n", .args = {n, (int)dropped}};
+                writeLogRecord(&warning);
+                wrote = 1;
+            }
+        }
+        if(wrote){
+            fflush(logOutput != NULL ? logOutput : stdout);
+        }
+        else{
+            struct timespec idle = {.tv_sec = 0, .tv_nsec = LOG_IDLE_SLEEP_NS};
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+void waitForLogger(void){
+    uint64_t deadline = getMonotonicMillis() + TIMETOWAIT * 1000;
+    for(int n = 0; n < numLogRings && getMonotonicMillis() < deadline; ){
+        if(atomic_load_explicit(&logRings[n].tail, memory_order_acquire)
+           == atomic_load_explicit(&logRings[n].head, memory_order_relaxed)){
+            n++;
+            continue;
+        }
+        struct timespec idle = {.tv_sec = 0, .tv_nsec = LOG_IDLE_SLEEP_NS};
+        nanosleep(&idle, NULL);
+    }
+}
+
+int startJournal(struct shard *shards, const int numShards){
+    if(journal.fileSize == 0)
+        journal.fileSize = (size_t)DEFAULT_JOURNAL_SIZE << 20;
+    journal.rings = aligned_alloc(CACHE_LINE_SIZE, numShards * sizeof(struct journalRing));
+    if(journal.rings == NULL){
+        perror("startJournal:\taligned_alloc():");
+        return 0;
+    }
+    memset(journal.rings, 0, numShards * sizeof(struct journalRing));
+    journal.numRings = numShards;
+    for(int n = 0; n < numShards; n++)
+        shards[n].journal = &journal.rings[n];
+    if(!openJournalFile())
+        return 0;
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, runJournal, NULL);
+    if(rc != 0){
+        printf("startJournal:\tpthread_create(): %s\n", strerror(rc));
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+void journalEvent(struct game *game, const enum journalEvent event, const unsigned char command,
+                  const unsigned char position, const unsigned char seqNum){
+    struct journalRing *ring = game->shard->journal;
+    if(ring == NULL)
+        return;
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == JOURNAL_RING_SIZE){
+        COUNT(game->shard->metrics.journalDropped);
+        return;
     }
+    struct journalRecord *record = &ring->records[head & (JOURNAL_RING_SIZE - 1)];
+    record->timestamp = game->shard->wokeAt;
+    record->id = game->id;
+    record->source = game->shard->index << 2 | event;
+    record->command = command;
+    record->position = position;
+    record->seqNum = seqNum;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
 
-    portNum = strtol(argv[1], NULL, 10);
-    printf("host: %hu, nbo: %hu", portNum, htons(portNum));
-    int listeningSD;
-    if(!createListeningSocket(&listeningSD, portNum, &server_address)){
-        printf("\nCouldn't create listening socket, exiting.");
-        exit(EXIT_FAILURE);
+void journalBoard(struct game *game){
+    if(game->shard->journal == NULL)
+        return;
+    if(game->variant == VARIANT_CLASSIC){
+        for(int n = 0; n < ROWS * COLUMNS; n++){
+            if(game->board.x >> n & 1)
+                journalEvent(game, JOURNAL_STONE, 1, n + 1, 0);
+            else if(game->board.o >> n & 1)
+                journalEvent(game, JOURNAL_STONE, 2, n + 1, 0);
+        }
+        return;
     }
-
-    printf("Waiting for play requests...\n");
-
-    struct game games[MAX_GAMES];
-    for(int n=0; n < MAX_GAMES; n++){
-        games[n].id = n;
-        games[n].timeSinceCommunciation = 0;
-        games[n].isInProgress = 0;
-        memset(games[n].buffer, 0, sizeof(struct message));
-        games[n].bytesOfCurrentMessage = 0;
-        games[n].socket = 0;
+    const struct wideBoard *board = getWideBoard(game);
+    for(int n = 0; n < variants[game->variant].rows * variants[game->variant].columns; n++){
+        if(board->x[n / 64] >> (n % 64) & 1)
+            journalEvent(game, JOURNAL_STONE, 1, n + 1, 0);
+        else if(board->o[n / 64] >> (n % 64) & 1)
+            journalEvent(game, JOURNAL_STONE, 2, n + 1, 0);
     }
+}
 
-    while (1) {
-        // manage socketSet for select
-        FD_ZERO(&socketSet);
-        FD_SET(multicastSD, &socketSet);
-        FD_SET(listeningSD, &socketSet);
-        maxSD = multicastSD > listeningSD ? multicastSD : listeningSD;
-
-        for(int n=0; n < MAX_GAMES; n++){
-            if(games[n].socket > 0){
-                FD_SET(games[n].socket, &socketSet);
-                if(games[n].socket > maxSD)
-                    maxSD= games[n].socket;
-            }
-        }
-
-        memset(bufferIn, 255, sizeof(struct message));
-        fromLength=sizeof(struct sockaddr_in);
-        clock_gettime(CLOCK_REALTIME, &start);
-        struct timeval tv;
-        tv.tv_sec = TIMETOWAIT;
-        tv.tv_usec = 0;
-        select(maxSD+1, &socketSet, NULL, NULL, &tv);
-        clock_gettime(CLOCK_REALTIME, &stop);
-        timeDiffSeconds = (stop.tv_sec - start.tv_sec) + (double)(stop.tv_nsec - start.tv_nsec) / (double)1000000000L;
-
-        if(FD_ISSET(multicastSD, &socketSet)){
-            rc = recvfrom(multicastSD, bufferIn, sizeof(struct message), 0, (struct sockaddr *)&from_address, &fromLength);
-            if(rc == 2){ //ignore any malformed multicasts
-                int id = getAvailableGameID(games);
-                if(bufferIn[0] == VERSION && id != -1){
-                    const int replySize = 3;
-                    unsigned char reply[replySize];
-                    reply[0] = VERSION;
-                    unsigned short nboPort = htons(portNum);
-                    memcpy(reply+1, &nboPort, 2);
-                    printf("[DATA]:\tSENT\t%x %x %x\n", reply[0], reply[1], reply[2]);
-                    sendto(multicastSD, reply, replySize, 0, (struct sockaddr *)&from_address, fromLength);
+void *runJournal(void *arg){
+    struct journalRecord *batch = malloc(JOURNAL_BATCH * sizeof(struct journalRecord));
+    if(batch == NULL){
+        perror("runJournal:\tmalloc():");
+        exit(EXIT_FAILURE);
+    }
+    int numBatched = 0;
+    while(1){
+        int took = 0;
+        for(int n = 0; n < journal.numRings; n++){
+            struct journalRing *ring = &journal.rings[n];
+            unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            for(; tail != head && numBatched < JOURNAL_BATCH; tail++, took++)
+                batch[numBatched++] = ring->records[tail & (JOURNAL_RING_SIZE - 1)];
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+        //a full batch goes out right away, anything less once the shards have gone quiet
+        if(numBatched == JOURNAL_BATCH || (took == 0 && numBatched > 0)){
+            size_t length = numBatched * sizeof(struct journalRecord);
+            if(journal.written + length > journal.fileSize && !openJournalFile())
+                LOG(LOG_ERROR, "[ERROR]:\tCouldn't start the next journal file, carrying on with the current one\n");
+            const char *data = (const char *)batch;
+            while(length > 0){
+                ssize_t rc = write(journal.fd, data, length);
+                if(rc < 0 && errno == EINTR)
+                    continue;
+                if(rc < 0){
+                    LOG_ERRNO("runJournal:\twrite()");
+                    break;
                 }
+                data += rc;
+                length -= rc;
+                journal.written += rc;
             }
+            numBatched = 0;
         }
-        if(FD_ISSET(listeningSD, &socketSet)){
-            printf("[ACTION]:\tGot connection request from a client, searching for an open game id...\n");
-            int id = getAvailableGameID(games);
-            if(id == -1){
-                //When listen() is called the OS implicitly begins accepting connections even before accept() is called
-                //So if we can't find an available game ID we will just accept() and then drop the connection
-                //max connections = MAX_GAMES so this hopefully shouldn't ever happen
-                printf("[ACTION]:\tCouldn't find available game ID for game, rejecting.\n");
-                int rejectedSD = accept(listeningSD, (struct sockaddr *)&from_address, &fromLength);
-                close(rejectedSD);
-            }
-            else{
-                printf("[ACTION]:\tCreated socket for game id %i\n", id);
-                games[id].socket = accept(listeningSD, (struct sockaddr*)&from_address, &fromLength);
-            }
+        else if(took == 0){
+            atomic_store_explicit(&journal.isFlushed, 1, memory_order_release);
+            struct timespec idle = {.tv_sec = 0, .tv_nsec = LOG_IDLE_SLEEP_NS};
+            nanosleep(&idle, NULL);
         }
-        //retrieving data from connected clients
-        incrementTimeSinceCommunication(games, timeDiffSeconds, -1);
+    }
+    return NULL;
+}
 
-        for(int id=0; id < MAX_GAMES; id++){
-            if(FD_ISSET(games[id].socket, &socketSet)){
-                memset(bufferIn, 0, sizeof(struct message));
-                printf("[ACTION]:\tData available for game id %i\n", id);
-                rc = read(games[id].socket, &bufferIn, sizeof(struct message));
-                games[id].timeSinceCommunciation = 0;
+int openJournalFile(void){
+    char name[PATH_MAX];
+    int fd = -1;
+    uint32_t sequence = journal.fd == -1 ? 0 : journal.sequence + 1;
+    for(; fd == -1; sequence++){
+        snprintf(name, sizeof(name), "%s.%06u", journal.path, sequence);
+        fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+        if(fd == -1 && errno != EEXIST){
+            perror("openJournalFile:\topen():");
+            return 0;
+        }
+    }
+    struct timespec realtime, monotonic;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    struct journalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.format = JOURNAL_FORMAT;
+    header.recordSize = sizeof(struct journalRecord);
+    header.realtimeOffset = ((int64_t)realtime.tv_sec - monotonic.tv_sec) * 1000000000 + (realtime.tv_nsec - monotonic.tv_nsec);
+    header.sequence = sequence - 1;
+    if(write(fd, &header, sizeof(header)) != sizeof(header)){
+        perror("openJournalFile:\twrite():");
+        close(fd);
+        return 0;
+    }
+    if(journal.fd != -1)
+        close(journal.fd);
+    journal.fd = fd;
+    journal.sequence = sequence - 1;
+    journal.written = sizeof(header);
+    return 1;
+}
 
-                if(rc <= 0){ //disconnect
-                    printf("[ACTION]:\tBroken pipe for game %i, ending game and cleaning up\n", id);
-                    games[id].isInProgress = 0;
-                    close(games[id].socket);
-                    games[id].socket = 0;
-                    continue;
-                }
-                else if (games[id].bytesOfCurrentMessage + rc > sizeof(struct message)){
-                    printf("[ACTION]:\tReceived (%i (rc) + %i (current)) bytes of data from client for current message, max is %lu. Attempting to create a complete message\n",
-                           rc, games[id].bytesOfCurrentMessage, sizeof(struct message));
-                    int bytesLeft = sizeof(struct message) - games[id].bytesOfCurrentMessage;
-                    memcpy(games[id].buffer + games[id].bytesOfCurrentMessage, bufferIn, bytesLeft);
-                    games[id].bytesOfCurrentMessage += bytesLeft;
-                    continue;
-                }
-                else{
-                    memcpy(games[id].buffer + games[id].bytesOfCurrentMessage, bufferIn, rc);
-                    games[id].bytesOfCurrentMessage += rc;
-                    printf("[ACTION]:\tReceived %i bytes for game %i, at %i / %lu bytes\n", rc, id, games[id].bytesOfCurrentMessage, sizeof(struct message));
-                }
+void waitForJournal(void){
+    if(journal.path == NULL)
+        return;
+    uint64_t deadline = getMonotonicMillis() + TIMETOWAIT * 1000;
+    while(getMonotonicMillis() < deadline){
+        int isDrained = 1;
+        for(int n = 0; n < journal.numRings; n++){
+            if(atomic_load_explicit(&journal.rings[n].tail, memory_order_acquire)
+               != atomic_load_explicit(&journal.rings[n].head, memory_order_relaxed))
+                isDrained = 0;
+        }
+        //the journal thread only sets isFlushed on a pass that took nothing and had nothing left to write
+        if(isDrained){
+            atomic_store_explicit(&journal.isFlushed, 0, memory_order_release);
+            while(!atomic_load_explicit(&journal.isFlushed, memory_order_acquire) && getMonotonicMillis() < deadline){
+                struct timespec idle = {.tv_sec = 0, .tv_nsec = LOG_IDLE_SLEEP_NS};
+                nanosleep(&idle, NULL);
+            }
+            return;
+        }
+        struct timespec idle = {.tv_sec = 0, .tv_nsec = LOG_IDLE_SLEEP_NS};
+        nanosleep(&idle, NULL);
+    }
+}
 
-                //after processing input if we have a complete message, handle it
-                if(games[id].bytesOfCurrentMessage == sizeof(struct message)){
-                    struct message messageIn = parsePacketFromBuffer(games[id].buffer);
-                    games[id].bytesOfCurrentMessage = 0;
-                    memset(games[id].buffer, 0, sizeof(struct message));
-
-                    if(messageIn.version != VERSION){
-                        // client is using wrong protocol, close up
-                        printf("[ACTION]:\tReceived bad version number (%i) from client, disconnecting...\n", messageIn.version);
-                        games[id].isInProgress = 0;
-                        games[id].bytesOfCurrentMessage = 0;
-                        close(games[id].socket);
-                        games[id].socket = 0;
-                        continue;
-                    }
-                    if(messageIn.command == NEWGAME) {
-                        if (games[id].isInProgress) { //handle protocol v4/5 issue related to dropped seq#1 packet
-                            printf("[ACTION]:\tReceived NEWGAME request from client with game already in progress.\n");
-                            printf("[ACTION]:\tAssuming client didn't get the first move resending last message.\n");
-                            sendPacketToClient(&games[id], &games[id].lastMessage);
-                        }
-                        else {
-                            initializeGame(&games[id]);
-                            games[id].currentSeqNum = 1;
-                            struct message reply = getServerReply(&games[id]);
-                            memcpy(&games[id].lastMessage, &reply, sizeof(struct message));
-                            printf("[ACTION]\tCreated NEWGAME with id %i\n", id);
-                            printf("[ACTION]\tSent MOVE ( %i ) for game %i\n", reply.position, id);
-                            sendPacketToClient(&games[id], &reply);
-                        }
-                    }
-                    else if(messageIn.command == MOVE){
-                        if(!games[id].isInProgress){
-                            printf("[ACTION]:\tReceived a move for a game not in progress, ignoring.\n");
-                        }
-                        else if(messageIn.id != id){
-                            printf("[ACTION]:\tReceived move from client for game %i, but client is associated with game %i, ignoring\n",
-                                   messageIn.id, id);
-                        }
-                        else{
-                            //correct seq#, advance the game state
-                            if (messageIn.seqNum == games[messageIn.id].currentSeqNum + 1) {
-                                games[id].resends = 0;
-                                tictactoeRound(&games[id], messageIn.position);
-                            }
-                                //dupe seq#, resend previous message
-                            else if (messageIn.seqNum == games[id].currentSeqNum - 1) {
-                                games[messageIn.id].resends++;
-                                printf("[ACTION]\tGame %i sent dupe message (sent seq %i, should be %i), resending last message (%i / %i)\n",
-                                       id, messageIn.seqNum, games[id].currentSeqNum + 1,
-                                       games[messageIn.id].resends, MAX_RESENDS);
-                                sendPacketToClient(&games[id], &games[id].lastMessage);
-                            }
-                                //client is more than 1 move out of sync, abandon all hope
-                            else if (messageIn.seqNum > games[messageIn.id].currentSeqNum + 1) {
-                                printf("[ACTION]\tGame %i sent message more than 2 out of sync (sent %i, should be %i), ending game.\n",
-                                       messageIn.id, messageIn.seqNum, games[messageIn.id].currentSeqNum + 1);
-                                games[messageIn.id].isInProgress = 0;
-                            }
-                        }
-                    }
-                    else if(messageIn.command == GAMEOVER){
-                        if(messageIn.id != id){
-                            printf("[ACTION]:\tReceived game over command for game %i but client is associated with game %i, ignoring.\n",
-                                   messageIn.id, id);
-                        }
-                        else if(checkwin(games[id].board) == -1){
-                            printf("[ACTION]:\tReceived game over command for game %i but board is not in an endgame state, ignoring\n", id);
-                        }
-                        else{
-                            printf("[ACTION]:\tReceived game over command for game %i, cleaning up game + socket info.\n", id);
-                            close(games[id].socket);
-                            games[id].socket = 0;
-                            games[id].isInProgress = 0;
-                        }
-                    }
-                    else if(messageIn.command == RESUME){
-                        initializeGame(&games[id]);
-                        games[id].currentSeqNum = bufferIn[4];
-                        unsigned char gameState[ROWS*COLUMNS];
-                        rc = read(games[id].socket, gameState, ROWS*COLUMNS);
-
-                        if(rc != ROWS*COLUMNS){
-                            printf("[ACTION]:\tReceived RESUME command for game %i, but not full board state. Dropping game.\n", id);
-                            close(games[id].socket);
-                            games[id].socket = 0;
-                            games[id].isInProgress = 0;
-                        }
-                        else{
-                            printf("[ACTION]:\tReceived RESUME command.\n");
-                            copyBoardStateToGame(&games[id], gameState);
-                            games[id].currentSeqNum++;
-                            struct message reply = getServerReply(&games[id]);
-                            memcpy(&games[id].lastMessage, &reply, sizeof(struct message));
-                            sendPacketToClient(&games[id], &reply);
-                        }
+int runSelfPlay(const uint32_t numGames, const int numWorkers){
+    selfPlayWorkers = aligned_alloc(CACHE_LINE_SIZE, numWorkers * sizeof(struct selfPlayWorker));
+    if(selfPlayWorkers == NULL){
+        perror("runSelfPlay:\taligned_alloc():");
+        return 0;
+    }
+    memset(selfPlayWorkers, 0, numWorkers * sizeof(struct selfPlayWorker));
+    numSelfPlayWorkers = numWorkers;
+    uint32_t next = 0;
+    for(int n = 0; n < numWorkers; n++){
+        struct selfPlayWorker *worker = &selfPlayWorkers[n];
+        struct shard *shard = &worker->shard;
+        worker->index = n;
+        //spread the remainder over the first workers
+        uint32_t end = next + numGames / numWorkers + ((uint32_t)n < numGames % numWorkers ? 1 : 0);
+        atomic_init(&worker->range, (uint64_t)end << 32 | next);
+        next = end;
+        shard->index = n;
+        shard->numGames = 2;
+        shard->games = aligned_alloc(CACHE_LINE_SIZE, 2 * sizeof(struct game));
+        shard->wideBoards = calloc(2, sizeof(struct wideBoard));
+        shard->timers.entries = calloc(2, sizeof(struct gameTimer));
+        if(shard->games == NULL || shard->wideBoards == NULL || shard->timers.entries == NULL){
+            perror("runSelfPlay:\taligned_alloc():");
+            return 0;
+        }
+        memset(shard->games, 0, 2 * sizeof(struct game));
+        memset(shard->timers.slots, 0xFF, sizeof(shard->timers.slots));
+        for(int id = 0; id < 2; id++){
+            shard->games[id].id = id;
+            shard->games[id].shard = shard;
+            shard->games[id].variant = selfPlayVariant;
+        }
+    }
 
-                    }
-                    else{
-                        printf("[ACTION]:\tReceived invalid command from game with id %i, ignoring\n", id);
-                    }
-                }
-            }
+    uint64_t startedAt = getMonotonicNanos();
+    for(int n = 1; n < numWorkers; n++){
+        int rc = pthread_create(&selfPlayWorkers[n].thread, NULL, runSelfPlayWorker, &selfPlayWorkers[n]);
+        if(rc != 0){
+            printf("runSelfPlay:\tpthread_create(): %s\n", strerror(rc));
+            return 0;
         }
-        manageTimedOutGames(games);
     }
+    runSelfPlayWorker(&selfPlayWorkers[0]);
+    for(int n = 1; n < numWorkers; n++)
+        pthread_join(selfPlayWorkers[n].thread, NULL);
+    double seconds = (getMonotonicNanos() - startedAt) / 1e9;
+
+    uint64_t games = 0, moves = 0, outcomes[3] = {0}, mismatches = 0, steals = 0;
+    for(int n = 0; n < numWorkers; n++){
+        games += selfPlayWorkers[n].games;
+        moves += selfPlayWorkers[n].moves;
+        for(int outcome = 0; outcome < 3; outcome++)
+            outcomes[outcome] += selfPlayWorkers[n].outcomes[outcome];
+        mismatches += selfPlayWorkers[n].mismatches;
+        steals += selfPlayWorkers[n].steals;
+    }
+    printf("\nPlayed %lu games of variant %i on %i thread(s) in %.2f seconds\n", games, selfPlayVariant, numWorkers, seconds);
+    printf("games:\t\t%lu (%.0f/s)\n", games, games / seconds);
+    printf("moves:\t\t%lu (%.0f/s, %.2f per game)\n", moves, moves / seconds, (double)moves / games);
+    printf("X (server):\t%lu wins (%.2f%%)\n", outcomes[1], 100.0 * outcomes[1] / games);
+    printf("O (opponent):\t%lu wins (%.2f%%)\n", outcomes[2], 100.0 * outcomes[2] / games);
+    printf("draws:\t\t%lu (%.2f%%)\n", outcomes[0], 100.0 * outcomes[0] / games);
+    printf("steals:\t\t%lu\n", steals);
+    printf("mismatches:\t%lu\n", mismatches);
+    return mismatches == 0;
 }
 
-int createMulticastSocket(int *sd, struct sockaddr_in *multicast_address) {
-    struct ip_mreq mreq;
+void *runSelfPlayWorker(void *arg){
+    struct selfPlayWorker *worker = arg;
+    struct board finals[SELFPLAY_CHUNK];
+    signed char states[SELFPLAY_CHUNK];
+    int winners[SELFPLAY_CHUNK];
 
-    multicast_address->sin_family = AF_INET;
-    multicast_address->sin_addr.s_addr = htonl(INADDR_ANY);
-    multicast_address->sin_port = htons(MC_PORT);
+    aiSeed = time(NULL) ^ (worker->index * 2654435761u);
+    threadLogRing = &logRings[worker->index];
+    uint32_t count;
+    while((count = takeSelfPlayGames(worker)) > 0){
+        for(uint32_t n = 0; n < count; n++){
+            winners[n] = playSelfPlayGame(worker, &finals[n]);
+            worker->games++;
+            if(winners[n] == -1)
+                worker->mismatches++;
+            else
+                worker->outcomes[winners[n]]++;
+        }
+        if(selfPlayVariant != VARIANT_CLASSIC)
+            continue;
+        //the server's final boards have to agree with the outcome the opponent saw
+        classifyBoards(finals, states, count);
+        for(uint32_t n = 0; n < count; n++){
+            if(winners[n] != -1 && states[n] != (winners[n] != 0))
+                worker->mismatches++;
+        }
+    }
+    return NULL;
+}
 
-    mreq.imr_multiaddr.s_addr = inet_addr(MC_GROUP);
-    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+uint32_t takeSelfPlayGames(struct selfPlayWorker *worker){
+    uint64_t range = atomic_load(&worker->range);
+    while((uint32_t)range != range >> 32){
+        uint32_t next = range;
+        uint32_t end = range >> 32;
+        uint32_t taken = end - next < SELFPLAY_CHUNK ? end - next : SELFPLAY_CHUNK;
+        if(atomic_compare_exchange_weak(&worker->range, &range, (uint64_t)end << 32 | (next + taken)))
+            return taken;
+    }
+    //nobody steals from an empty range, so ours can be refilled with a plain store
+    for(int n = 1; n < numSelfPlayWorkers; n++){
+        struct selfPlayWorker *victim = &selfPlayWorkers[(worker->index + n) % numSelfPlayWorkers];
+        range = atomic_load(&victim->range);
+        while((uint32_t)range != range >> 32){
+            uint32_t next = range;
+            uint32_t end = range >> 32;
+            uint32_t middle = end - (end - next + 1) / 2;
+            if(atomic_compare_exchange_weak(&victim->range, &range, (uint64_t)middle << 32 | next)){
+                worker->steals++;
+                atomic_store(&worker->range, (uint64_t)end << 32 | middle);
+                return takeSelfPlayGames(worker);
+            }
+        }
+    }
+    return 0;
+}
 
-    *sd = socket(AF_INET, SOCK_DGRAM, 0);
-    if(*sd==-1){
-        perror("createMulticastSocket:\tsocket():");
-        return 0;
+int playSelfPlayGame(struct selfPlayWorker *worker, struct board *final){
+    const int SERVER = 1;
+    const int CLIENT = 2;
+    struct game *game = &worker->shard.games[0];
+    struct game *view = &worker->shard.games[1];
+    initializeGame(view);
+    struct message frame = {.version = VERSION, .command = NEWGAME, .position = selfPlayVariant};
+    struct message reply;
+    int winner = -1;
+    while(handleClientMessage(game, frame, NULL) && readSelfPlayReply(game, &reply)){
+        //the opponent's move ended the game, the server acknowledges it
+        if(reply.command == GAMEOVER){
+            winner = getWinner(view);
+            break;
+        }
+        if(!isLegalMove(view, reply.position))
+            break;
+        makeMoveOnBoard(view, reply.position, SERVER);
+        worker->moves++;
+        frame.id = reply.id;
+        frame.seqNum = reply.seqNum + 1;
+        if(getGameState(view) != -1){
+            frame.command = GAMEOVER;
+            handleClientMessage(game, frame, NULL);
+            winner = getWinner(view);
+            break;
+        }
+        frame.command = MOVE;
+        frame.position = getOpponentMove(view, opponentEpsilon);
+        makeMoveOnBoard(view, frame.position, CLIENT);
+        worker->moves++;
     }
-    socklen_t addrLen = sizeof(struct sockaddr_in);
-    int rc = bind(*sd, (struct sockaddr *)multicast_address, addrLen);
-    if(rc != 0){
-        perror("createMulticastSocket:\tbind():");
-        return 0;
+    *final = game->board;
+    int isSameBoard = game->variant == VARIANT_CLASSIC
+                      ? game->board.x == view->board.x && game->board.o == view->board.o
+                      : memcmp(getWideBoard(game), getWideBoard(view), sizeof(struct wideBoard)) == 0;
+    if(winner == -1 || !isSameBoard || game->isInProgress){
+        //whatever state the game was left in, the next one starts from a free slot
+        closeGame(game);
+        game->isSendPending = 0;
+        worker->shard.pendingSends = NULL;
+        return -1;
     }
-    rc = setsockopt(*sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
-    if(rc != 0){
-        perror("createMulticastSocket:\tsetsockopt():");
+    return winner;
+}
+
+int readSelfPlayReply(struct game *game, struct message *reply){
+    unsigned char wire[MESSAGE_SIZE];
+    if(game->outHead - game->outTail < MESSAGE_SIZE)
         return 0;
+    for(int n = 0; n < MESSAGE_SIZE; n++)
+        wire[n] = game->outBuffer[(game->outTail + n) & (OUT_BUFFER_SIZE - 1)];
+    *reply = parsePacketFromBuffer(wire);
+    game->outTail += MESSAGE_SIZE;
+    game->outSent = game->outTail;
+    if(game->outTail == game->outHead){
+        game->isSendPending = 0;
+        game->shard->pendingSends = NULL;
     }
-
     return 1;
 }
 
-int createListeningSocket(int *sd, int portNum, struct sockaddr_in *server_address){
-    struct timeval tv;
-    tv.tv_sec = TIMETOWAIT;
-    tv.tv_usec = 0;
-
-    server_address->sin_family = AF_INET;
-    server_address->sin_port = htons(portNum);
-    server_address->sin_addr.s_addr = INADDR_ANY;
-    *sd = socket(AF_INET, SOCK_STREAM, 0);  //initialize datagram socket
-    if (*sd==-1){
-        perror("createListeningSocket:\tsocket():");
+int startReplication(const char *target, struct shard *shards, const int numShards, const unsigned short portNum){
+    char group[INET_ADDRSTRLEN];
+    const char *colon = strrchr(target, ':');
+    int groupPort = colon != NULL ? strtol(colon + 1, NULL, 10) : 0;
+    if(colon == NULL || colon - target >= (int)sizeof(group) || groupPort < 1 || groupPort > 65535){
+        printf("replicate must be <multicast group>:<port>, e.g. 239.0.0.2:1819\n");
         return 0;
     }
-    if (setsockopt(*sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {//set socket timeout
-        perror("createListeningSocket:\tsetsockopt():");
-        close(*sd);
+    memcpy(group, target, colon - target);
+    group[colon - target] = '\0';
+    memset(&replication.group, 0, sizeof(replication.group));
+    replication.group.sin_family = AF_INET;
+    replication.group.sin_port = htons(groupPort);
+    if(inet_pton(AF_INET, group, &replication.group.sin_addr) != 1 || !IN_MULTICAST(ntohl(replication.group.sin_addr.s_addr))){
+        printf("replicate:\t%s is not a multicast group\n", group);
         return 0;
     }
-    socklen_t fromLength = sizeof(struct sockaddr_in);
-    int rc = bind(*sd, (struct sockaddr *)server_address, fromLength);
-    if(rc != 0){
-        perror("createListeningSocket:\tbind():");
+    if(getrandom(&replication.node, sizeof(replication.node), 0) != sizeof(replication.node)){
+        perror("startReplication:\tgetrandom():");
+        return 0;
+    }
+    replication.port = portNum;
+
+    //every server on a host binds the same port, the group's datagrams are delivered to each of them
+    replication.sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int reuseAddress = 1;
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = replication.group.sin_port,
+                                  .sin_addr.s_addr = htonl(INADDR_ANY)};
+    struct ip_mreq mreq = {.imr_multiaddr = replication.group.sin_addr, .imr_interface.s_addr = htonl(INADDR_ANY)};
+    if(replication.sd == -1
+       || setsockopt(replication.sd, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress)) != 0
+       || bind(replication.sd, (struct sockaddr *)&address, sizeof(address)) != 0
+       || setsockopt(replication.sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0){
+        perror("startReplication:\tsocket():");
         return 0;
     }
-    rc = listen(*sd, MAX_GAMES);
+
+    replication.rings = aligned_alloc(CACHE_LINE_SIZE, numShards * sizeof(struct replicationRing));
+    if(replication.rings == NULL){
+        perror("startReplication:\taligned_alloc():");
+        return 0;
+    }
+    memset(replication.rings, 0, numShards * sizeof(struct replicationRing));
+    replication.numRings = numShards;
+    for(int n = 0; n < numShards; n++)
+        shards[n].replication = &replication.rings[n];
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, runReplication, NULL);
     if(rc != 0){
-        perror("createListeningSocket:\tlisten():");
+        printf("startReplication:\tpthread_create(): %s\n", strerror(rc));
         return 0;
     }
+    pthread_detach(thread);
+    printf("\nReplicating games to %s as node %08x\n", target, replication.node);
     return 1;
 }
 
-int checkwin(char board[ROWS][COLUMNS])
-{
-    /************************************************************************/
-    /* brute force check to see if someone won, or if there is a draw       */
-    /* return a 0 if the game is 'over' and return -1 if game should go on  */
-    /************************************************************************/
-    if (board[0][0] == board[0][1] && board[0][1] == board[0][2] ) // row matches
-        return 1;
-
-    else if (board[1][0] == board[1][1] && board[1][1] == board[1][2] ) // row matches
-        return 1;
-
-    else if (board[2][0] == board[2][1] && board[2][1] == board[2][2] ) // row matches
-        return 1;
-
-    else if (board[0][0] == board[1][0] && board[1][0] == board[2][0] ) // column
-        return 1;
-
-    else if (board[0][1] == board[1][1] && board[1][1] == board[2][1] ) // column
-        return 1;
-
-    else if (board[0][2] == board[1][2] && board[1][2] == board[2][2] ) // column
-        return 1;
-
-    else if (board[0][0] == board[1][1] && board[1][1] == board[2][2] ) // diagonal
-        return 1;
-
-    else if (board[2][0] == board[1][1] && board[1][1] == board[0][2] ) // diagonal
-        return 1;
-
-    else if (board[0][0] != '1' && board[0][1] != '2' && board[0][2] != '3' &&
-             board[1][0] != '4' && board[1][1] != '5' && board[1][2] != '6' &&
-             board[2][0] != '7' && board[2][1] != '8' && board[2][2] != '9')
-
-        return 0; // Return of 0 means game over
-    else
-        return  - 1; // return of -1 means keep playing
-}
-
-void tictactoeRound(struct game *game, unsigned char clientMove){
-    const int CLIENT = 2;
-    game->currentSeqNum += 2; //account for both client and server response
-    if(validateMove(clientMove, game->board)){
-        makeMoveOnBoard(game, clientMove, CLIENT);
-        printf("[ACTION]:\tFor game %i, Player 2 made MOVE: %i\n", game->id, clientMove);
-    }
-    else{
-        printf("[ACTION]:\tFor game %i, Player 2 made illegal MOVE: %i, aborting game\n", game->id, clientMove);
-        game->isInProgress = 0;
+void replicateGame(struct game *game, const struct message *message){
+    struct replicationRing *ring = game->shard->replication;
+    if(ring == NULL || (game->variant != VARIANT_CLASSIC && message != NULL))
+        return;
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) == REPLICATION_RING_SIZE){
+        COUNT(game->shard->metrics.replicationDropped);
         return;
     }
-    struct message reply = getServerReply(game);
-    sendPacketToClient(game, &reply);
-    memcpy(&game->lastMessage, &reply, sizeof(struct message));
-}
-
-void makeMoveOnBoard(struct game *game, unsigned char move, int player){
-    char mark = (player%2==1) ? 'X' : 'O';
-    int row = (int)((move-1) / ROWS);
-    int column = (move-1) % COLUMNS;
-    game->board[row][column] = mark;
-}
-
-unsigned char getAIMove(char board[ROWS][COLUMNS]){
-    unsigned char move;
-    int n = 0;
-    do{
-        move = (rand() % 9) + 1;
-        n++;
-    }while(!validateMove(move, board) && n < 50);
-    if(n == 50) //probably passed a bad board.
-        return 255;
-    else
-        return move;
-}
-
-int getAvailableGameID(const struct game games[MAX_GAMES]){
-    for(int id = 0; id < MAX_GAMES; id++){
-        if(!games[id].isInProgress)
-            return id;
+    struct replicaDelta *delta = &ring->deltas[head & (REPLICATION_RING_SIZE - 1)];
+    delta->id = game->id;
+    delta->shard = game->shard->index;
+    delta->flags = 0;
+    delta->seqNum = 0;
+    delta->position = 0;
+    delta->x = game->board.x;
+    delta->o = game->board.o;
+    if(message != NULL && game->isInProgress && message->command != GAMEOVER){
+        delta->flags = REPLICA_IN_PROGRESS | (game->version == EXTENDED_VERSION ? REPLICA_EXTENDED : 0);
+        delta->seqNum = message->seqNum;
+        delta->position = message->command == MOVE ? message->position : 0;
     }
-    return -1;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
 }
 
-int initializeGame(struct game *game){
-    game->isInProgress = 1;
-    game->bytesOfCurrentMessage = 0;
-    game->timeSinceCommunciation = 0;
-    game->currentSeqNum = 0;
-    game->resends = 0;
-    memset(&game->lastMessage, 0, sizeof(struct message));
-    /* this just initializing the shared state aka the board */
-    int count = 1;
-    for (int i=0;i<3;i++)
-        for (int j=0;j<3;j++){
-            game->board[i][j] = count + '0';
-            count++;
+void *runReplication(void *arg){
+    unsigned char datagram[sizeof(struct replicationHeader) + REPLICATION_BATCH * sizeof(struct replicaDelta)];
+    uint64_t nextFlush = getMonotonicMillis() + REPLICATION_INTERVAL_MS;
+    uint64_t nextExpiry = getMonotonicMillis() + 1000;
+    while(1){
+        uint64_t now = getMonotonicMillis();
+        struct pollfd pollSD = {.fd = replication.sd, .events = POLLIN};
+        poll(&pollSD, 1, now < nextFlush ? (int)(nextFlush - now) : 0);
+        now = getMonotonicMillis();
+        while(1){
+            int rc = recv(replication.sd, datagram, sizeof(datagram), MSG_DONTWAIT);
+            if(rc < 0 && errno == EINTR)
+                continue;
+            if(rc < 0)
+                break;
+            applyReplicationDatagram(datagram, rc, now);
         }
-    return 0;
+        if(now >= nextFlush){
+            sendReplicationBatch();
+            nextFlush = now + REPLICATION_INTERVAL_MS;
+        }
+        if(now >= nextExpiry){
+            pthread_mutex_lock(&replication.lock);
+            for(int bucket = 0; bucket < REPLICA_BUCKETS; bucket++){
+                for(struct replica **link = &replication.buckets[bucket]; *link != NULL; ){
+                    struct replica *replica = *link;
+                    if(now - replica->updatedAt < (uint64_t)GAME_TIMEOUT * 1000){
+                        link = &replica->next;
+                        continue;
+                    }
+                    *link = replica->next;
+                    free(replica);
+                    atomic_fetch_sub(&replication.numReplicas, 1);
+                }
+            }
+            pthread_mutex_unlock(&replication.lock);
+            nextExpiry = now + 1000;
+        }
+    }
+    return NULL;
 }
 
-//ripped from client from lab4
-///Very simple function to validate user input
-int validateMove(unsigned char move, char board[ROWS][COLUMNS]){
-    //move corresponds to a square on the board
-    if(move < 0x01 || move > 0x09)
-        return 0;
-    else{
-        //simple math to convert our square number to array indices
-        int row = (int)((move-1) / ROWS);
-        int column = (move-1) % COLUMNS;
-        //squares are initialized to their corresponding number, and are set to X/O after a move
-        //if square == number, then we know its still available
-        if(board[row][column] == (move+'0')){
-            return 1;
+void sendReplicationBatch(void){
+    unsigned char datagram[sizeof(struct replicationHeader) + REPLICATION_BATCH * sizeof(struct replicaDelta)];
+    struct replicaDelta *deltas = (struct replicaDelta *)(datagram + sizeof(struct replicationHeader));
+    int count = 0;
+    for(int n = 0; n <= replication.numRings; n++){
+        unsigned int tail = 0, head = 0;
+        struct replicationRing *ring = n < replication.numRings ? &replication.rings[n] : NULL;
+        if(ring != NULL){
+            tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            head = atomic_load_explicit(&ring->head, memory_order_acquire);
         }
-        else
-            return 0;
+        for(; tail != head && count < REPLICATION_BATCH; tail++, count++){
+            deltas[count] = ring->deltas[tail & (REPLICATION_RING_SIZE - 1)];
+            deltas[count].id = htonl(deltas[count].id);
+            deltas[count].x = htons(deltas[count].x);
+            deltas[count].o = htons(deltas[count].o);
+        }
+        //a full datagram goes out as soon as it is full, the last one after every ring is drained
+        if(count == REPLICATION_BATCH || (ring == NULL && count > 0)){
+            struct replicationHeader *header = (struct replicationHeader *)datagram;
+            header->magic = htonl(REPLICATION_MAGIC);
+            header->node = htonl(replication.node);
+            header->port = htons(replication.port);
+            header->format = REPLICATION_FORMAT;
+            header->count = count;
+            size_t length = sizeof(*header) + count * sizeof(struct replicaDelta);
+            if(sendto(replication.sd, datagram, length, 0, (struct sockaddr *)&replication.group,
+                      sizeof(replication.group)) != (ssize_t)length)
+                perror("sendReplicationBatch:\tsendto():");
+            else
+                atomic_fetch_add_explicit(&replication.deltasSent, count, memory_order_relaxed);
+            count = 0;
+        }
+        if(ring == NULL)
+            break;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        //this ring still has deltas left after a full datagram, carry on with it
+        if(tail != head)
+            n--;
     }
 }
 
-void incrementTimeSinceCommunication(struct game games[], const double time, const int resetID){
-    for(int n = 0; n < MAX_GAMES; n++){
-        if(n == resetID){
-            games[n].timeSinceCommunciation = 0;
+void applyReplicationDatagram(const unsigned char *data, const int length, const uint64_t now){
+    struct replicationHeader header;
+    if(length < (int)sizeof(header))
+        return;
+    memcpy(&header, data, sizeof(header));
+    if(ntohl(header.magic) != REPLICATION_MAGIC || header.format != REPLICATION_FORMAT
+       || length != (int)(sizeof(header) + header.count * sizeof(struct replicaDelta)))
+        return;
+    uint32_t node = ntohl(header.node);
+    //multicast loopback hands us our own datagrams too
+    if(node == replication.node)
+        return;
+    atomic_fetch_add_explicit(&replication.deltasReceived, header.count, memory_order_relaxed);
+    pthread_mutex_lock(&replication.lock);
+    for(int n = 0; n < header.count; n++){
+        struct replicaDelta delta;
+        memcpy(&delta, data + sizeof(header) + n * sizeof(delta), sizeof(delta));
+        delta.id = ntohl(delta.id);
+        delta.x = ntohs(delta.x);
+        delta.o = ntohs(delta.o);
+        struct replica *replica = findReplica(node, delta.shard, delta.id);
+        if(!(delta.flags & REPLICA_IN_PROGRESS)){
+            if(replica == NULL)
+                continue;
+            struct replica **link = &replication.buckets[delta.id & (REPLICA_BUCKETS - 1)];
+            while(*link != replica)
+                link = &(*link)->next;
+            *link = replica->next;
+            free(replica);
+            atomic_fetch_sub(&replication.numReplicas, 1);
+            continue;
         }
-        else if(games[n].isInProgress){
-            games[n].timeSinceCommunciation += time;
+        if(replica == NULL){
+            replica = malloc(sizeof(*replica));
+            if(replica == NULL)
+                continue;
+            replica->node = node;
+            replica->next = replication.buckets[delta.id & (REPLICA_BUCKETS - 1)];
+            replication.buckets[delta.id & (REPLICA_BUCKETS - 1)] = replica;
+            atomic_fetch_add(&replication.numReplicas, 1);
         }
+        replica->delta = delta;
+        replica->updatedAt = now;
     }
+    pthread_mutex_unlock(&replication.lock);
 }
 
-void manageTimedOutGames(struct game *games){
-    for(int n = 0; n < MAX_GAMES; n++){
-        if(games[n].isInProgress && games[n].timeSinceCommunciation > GAME_TIMEOUT){
-            if(games[n].resends < MAX_RESENDS){
-                games[n].resends++;
-                games[n].timeSinceCommunciation = 0;
-                printf("[ACTION]:\tFor game %i, resent last message ( %i / %i resends )\n", games[n].id, games[n].resends, MAX_RESENDS);
-                sendPacketToClient(&games[n], &games[n].lastMessage);
+struct replica *findReplica(const uint32_t node, const int shard, const uint32_t id){
+    for(struct replica *replica = replication.buckets[id & (REPLICA_BUCKETS - 1)]; replica != NULL; replica = replica->next){
+        if(replica->node == node && replica->delta.shard == shard && replica->delta.id == id)
+            return replica;
+    }
+    return NULL;
+}
+
+enum resumeCheck checkResume(const struct game *game, const struct message messageIn, struct replicaDelta *matched){
+    if(game->variant != VARIANT_CLASSIC)
+        return RESUME_UNKNOWN;
+    const struct board client = game->board;
+    //a 0x06 client only knows the low byte of its id, so every replica whose id ends in it is a candidate
+    int isExtended = messageIn.version == EXTENDED_VERSION;
+    uint32_t stride = isExtended ? 0 : 256;
+    enum resumeCheck check = RESUME_UNKNOWN;
+    pthread_mutex_lock(&replication.lock);
+    for(uint32_t bucket = messageIn.id & (REPLICA_BUCKETS - 1); bucket < REPLICA_BUCKETS; bucket += stride){
+        struct replica **link = &replication.buckets[bucket];
+        for(; *link != NULL; link = &(*link)->next){
+            const struct replicaDelta *delta = &(*link)->delta;
+            if(isExtended ? delta->id != messageIn.id : (delta->id & 0xFF) != messageIn.id)
+                continue;
+            check = RESUME_MISMATCH;
+            //the client saw the replica's last frame, and may have made its own next move since
+            uint16_t extraO = client.o & ~delta->o;
+            if((uint8_t)(delta->seqNum + 1) == messageIn.seqNum && client.x == delta->x
+               && (client.o & delta->o) == delta->o && (extraO & (extraO - 1)) == 0 && !(extraO & delta->x)){
+                check = RESUME_VERIFIED;
+                break;
             }
-            else{
-                printf("[ACTION]:\tPruned timed out game with ID %i\n", games[n].id);
-                games[n].isInProgress = 0;
-                games[n].timeSinceCommunciation = 0;
+            //the replica's last frame, a MOVE, never reached the client
+            uint16_t extraX = delta->x & ~client.x;
+            if(delta->seqNum == (uint8_t)(messageIn.seqNum + 1) && client.o == delta->o && delta->position != 0
+               && (client.x & delta->x) == client.x && extraX == 1 << (delta->position - 1)){
+                check = RESUME_RECOVERED;
+                break;
             }
         }
+        if(check == RESUME_VERIFIED || check == RESUME_RECOVERED){
+            struct replica *replica = *link;
+            *matched = replica->delta;
+            *link = replica->next;
+            free(replica);
+            atomic_fetch_sub(&replication.numReplicas, 1);
+            break;
+        }
+        if(stride == 0)
+            break;
     }
+    pthread_mutex_unlock(&replication.lock);
+    return check;
 }
 
-struct message parsePacketFromBuffer(unsigned char *buffer) {
-    struct message packet;
-    packet.version = buffer[0];
-    packet.command = buffer[1];
-    packet.position = buffer[2];
-    packet.id = buffer[3];
-    packet.seqNum = buffer[4];
-    printf("[DATA]\t\tRECVD\t%i\t%i\t%i\t%i\t%i\n",
-           packet.version, packet.command, packet.position, packet.id, packet.seqNum);
-    return packet;
+int getLatencyBucket(const uint64_t nanos){
+    const int subBuckets = 1 << LATENCY_SUB_BUCKET_BITS;
+    if(nanos < subBuckets)
+        return (int)nanos;
+    int highestBit = 63 - __builtin_clzll(nanos);
+    int subBucket = (int)(nanos >> (highestBit - LATENCY_SUB_BUCKET_BITS)) & (subBuckets - 1);
+    return ((highestBit - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS) + subBucket;
 }
 
-void sendPacketToClient(struct game *game, struct message *message) {
-    printf("[DATA]\t\tSENT\t%i\t%i\t%i\t%i\t%i\n",
-           message->version, message->command, message->position, message->id, message->seqNum);
-    send(game->socket, message, sizeof(struct message), 0);
+uint64_t getLatencyBucketLimit(const int bucket){
+    const int subBuckets = 1 << LATENCY_SUB_BUCKET_BITS;
+    if(bucket < subBuckets)
+        return bucket;
+    int shift = (bucket >> LATENCY_SUB_BUCKET_BITS) - 1;
+    uint64_t lowest = (uint64_t)(subBuckets + (bucket & (subBuckets - 1))) << shift;
+    return lowest + ((uint64_t)1 << shift) - 1;
+}
+
+void recordLatency(struct metrics *metrics, const uint64_t nanos){
+    COUNT(metrics->latencyBuckets[getLatencyBucket(nanos)]);
+    COUNT(metrics->latencyCount);
+    atomic_store_explicit(&metrics->latencySumNs,
+                          atomic_load_explicit(&metrics->latencySumNs, memory_order_relaxed) + nanos, memory_order_relaxed);
+}
+
+void recordReplyLatencies(struct game *game, const uint64_t now){
+    for(; game->unrecordedReplies > 0; game->unrecordedReplies--)
+        recordLatency(&game->shard->metrics, now - game->readableAt);
 }
 
-void copyBoardStateToGame(struct game *game, unsigned char *buffer) {
-    for(int n=0; n < 9; n++){
-        int row = (int)((n) / ROWS);
-        int column = (n) % COLUMNS;
-        game->board[row][column] = buffer[n];
+int startStatsServer(const unsigned short portNum, int *sd, struct shard *shards, const int numShards){
+    struct statsServer *server = malloc(sizeof(struct statsServer));
+    if(server == NULL){
+        perror("startStatsServer:\tmalloc():");
+        return 0;
+    }
+    server->shards = shards;
+    server->numShards = numShards;
+    server->sd = *sd;
+    if(server->sd == -1 && !createStatsSocket(&server->sd, portNum))
+        return 0;
+    *sd = server->sd;
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, runStatsServer, server);
+    if(rc != 0){
+        printf("startStatsServer:\tpthread_create(): %s\n", strerror(rc));
+        return 0;
     }
+    pthread_detach(thread);
+    return 1;
 }
 
-struct message getServerReply(struct game *game) {
-    const int SERVER = 1;
-    struct message reply;
-    reply.version = VERSION;
-    reply.id = game->id;
-    reply.seqNum = game->currentSeqNum;
+int createStatsSocket(int *sd, const unsigned short portNum){
+    struct sockaddr_in address;
+    *sd = socket(AF_INET, SOCK_STREAM, 0);
+    if(*sd == -1){
+        perror("createStatsSocket:\tsocket():");
+        return 0;
+    }
+    int reuseAddress = 1;
+    setsockopt(*sd, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress));
+    //metrics are for the operator, only serve them locally
+    address.sin_family = AF_INET;
+    address.sin_port = htons(portNum);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(*sd, (struct sockaddr *)&address, sizeof(address)) != 0){
+        perror("createStatsSocket:\tbind():");
+        return 0;
+    }
+    if(listen(*sd, 16) != 0){
+        perror("createStatsSocket:\tlisten():");
+        return 0;
+    }
+    return 1;
+}
 
-    int rc = checkwin(game->board);
+void *runStatsServer(void *arg){
+    struct statsServer *server = arg;
+    struct timeval tv = {.tv_sec = TIMETOWAIT, .tv_usec = 0};
+    while(1){
+        int clientSD = accept(server->sd, NULL, NULL);
+        if(clientSD == -1)
+            continue;
+        //the request itself doesn't matter, every path gets the metrics. don't let a silent client wedge the thread
+        char request[1024];
+        setsockopt(clientSD, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(clientSD, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        recv(clientSD, request, sizeof(request), 0);
 
-    if(rc == -1){ //server needs to make a move in reply to client
-        unsigned char move = getAIMove(game->board);
-        if(move != 255){
-            printf("[ACTION]:\tFor game %i, Player 1 made MOVE: %i\n", game->id, move);
-            makeMoveOnBoard(game, move, SERVER);
-            reply.command = MOVE;
-            reply.position = move;
-        }
-        rc = checkwin(game->board);
-        if(rc == 1 || rc == 0){
-            printf("[ACTION]:\tFor game %i, game over state detected. Waiting for GAMEOVER message.\n", game->id);
+        char *body = NULL;
+        size_t bodyLength = 0;
+        FILE *output = open_memstream(&body, &bodyLength);
+        if(output != NULL){
+            writeMetrics(output, server->shards, server->numShards);
+            fclose(output);
+            char header[128];
+            int headerLength = snprintf(header, sizeof(header),
+                                        "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", bodyLength);
+            send(clientSD, header, headerLength, MSG_NOSIGNAL);
+            send(clientSD, body, bodyLength, MSG_NOSIGNAL);
+            free(body);
         }
+        close(clientSD);
     }
-    else{ // the game is over, send a GAMEOVER message to client to ack their final move
-        printf("[ACTION]:\tFor game %i, game over state detected. Sending GAMEOVER message.\n", game->id);
-        game->isInProgress = 0;
-        reply.command = GAMEOVER;
-        reply.position = 0;
+    return NULL;
+}
+
+void writeMetrics(FILE *output, struct shard *shards, const int numShards){
+    const char *commandNames[] = {"newgame", "move", "gameover", "resume", "token"};
+    fprintf(output, "# HELP ttts_commands_total Messages received from clients by command.\n# TYPE ttts_commands_total counter\n");
+    for(int command = 0; command <= TOKEN; command++)
+        fprintf(output, "ttts_commands_total{command=\"%s\"} %lu\n", commandNames[command], SUM_METRIC(commands[command]));
+    fprintf(output, "ttts_commands_total{command=\"invalid\"} %lu\n", SUM_METRIC(invalidCommands));
+
+    fprintf(output, "# HELP ttts_resends_total Last messages sent again to a client.\n# TYPE ttts_resends_total counter\n");
+    fprintf(output, "ttts_resends_total{reason=\"duplicate\"} %lu\n", SUM_METRIC(duplicateResends));
+    fprintf(output, "ttts_resends_total{reason=\"timeout\"} %lu\n", SUM_METRIC(timeoutResends));
+
+    fprintf(output, "# HELP ttts_pruned_games_total Games ended after MAX_RESENDS timeouts.\n# TYPE ttts_pruned_games_total counter\n");
+    fprintf(output, "ttts_pruned_games_total %lu\n", SUM_METRIC(prunedGames));
+    fprintf(output, "# HELP ttts_tokens_total Resume tokens sent to idle games' clients, and ones rejected from clients.\n# TYPE ttts_tokens_total counter\n");
+    fprintf(output, "ttts_tokens_total{result=\"issued\"} %lu\n", SUM_METRIC(tokensIssued));
+    fprintf(output, "ttts_tokens_total{result=\"rejected\"} %lu\n", SUM_METRIC(tokensRejected));
+    fprintf(output, "# HELP ttts_syscalls_total Syscalls the reactor threads made serving clients.\n# TYPE ttts_syscalls_total counter\n");
+    fprintf(output, "ttts_syscalls_total %lu\n", SUM_METRIC(syscalls));
+    fprintf(output, "# HELP ttts_bad_version_disconnects_total Clients dropped for using another protocol version.\n# TYPE ttts_bad_version_disconnects_total counter\n");
+    fprintf(output, "ttts_bad_version_disconnects_total %lu\n", SUM_METRIC(badVersionDisconnects));
+    fprintf(output, "# HELP ttts_bad_variant_disconnects_total Clients dropped for asking for a board variant the server doesn't host.\n# TYPE ttts_bad_variant_disconnects_total counter\n");
+    fprintf(output, "ttts_bad_variant_disconnects_total %lu\n", SUM_METRIC(badVariantDisconnects));
+    fprintf(output, "# HELP ttts_journal_dropped_total Journal records dropped because the journal thread fell behind.\n# TYPE ttts_journal_dropped_total counter\n");
+    fprintf(output, "ttts_journal_dropped_total %lu\n", SUM_METRIC(journalDropped));
+    if(replication.sd != -1){
+        const char *checkNames[] = {"verified", "recovered", "mismatch", "unknown"};
+        fprintf(output, "# HELP ttts_replication_deltas_total Game states sent to and received from peer servers.\n# TYPE ttts_replication_deltas_total counter\n");
+        fprintf(output, "ttts_replication_deltas_total{direction=\"sent\"} %lu\n", atomic_load(&replication.deltasSent));
+        fprintf(output, "ttts_replication_deltas_total{direction=\"received\"} %lu\n", atomic_load(&replication.deltasReceived));
+        fprintf(output, "# HELP ttts_replication_dropped_total Game states not replicated because the replication thread fell behind.\n# TYPE ttts_replication_dropped_total counter\n");
+        fprintf(output, "ttts_replication_dropped_total %lu\n", SUM_METRIC(replicationDropped));
+        fprintf(output, "# HELP ttts_replicas Peer servers' games held for clients that may resume them here.\n# TYPE ttts_replicas gauge\n");
+        fprintf(output, "ttts_replicas %i\n", atomic_load(&replication.numReplicas));
+        fprintf(output, "# HELP ttts_resume_checks_total RESUMEs by how they compare to the replicas.\n# TYPE ttts_resume_checks_total counter\n");
+        for(int check = 0; check <= RESUME_UNKNOWN; check++)
+            fprintf(output, "ttts_resume_checks_total{result=\"%s\"} %lu\n", checkNames[check], SUM_METRIC(resumeChecks[check]));
+    }
+    fprintf(output, "# HELP ttts_accepted_connections_total Connections accepted, rejected ones included.\n# TYPE ttts_accepted_connections_total counter\n");
+    fprintf(output, "ttts_accepted_connections_total %lu\n", SUM_METRIC(acceptedConnections));
+    fprintf(output, "# HELP ttts_rejected_connections_total Connections sent SERVER_FULL and closed because no game slot was free.\n# TYPE ttts_rejected_connections_total counter\n");
+    fprintf(output, "ttts_rejected_connections_total %lu\n", SUM_METRIC(rejectedConnections));
+    //read straight from the shards, a count that is a wakeup out of date is fine for a gauge
+    int freeGames = 0;
+    for(int n = 0; n < numShards; n++)
+        freeGames += __atomic_load_n(&shards[n].numFreeSlots, __ATOMIC_RELAXED);
+    fprintf(output, "# HELP ttts_free_games Game slots without a client.\n# TYPE ttts_free_games gauge\n");
+    fprintf(output, "ttts_free_games %i\n", freeGames);
+    //for a listening socket the kernel reports its accept queue length and limit in these two TCP_INFO fields
+    fprintf(output, "# HELP ttts_listen_queue_length Connections waiting to be accepted, per shard.\n# TYPE ttts_listen_queue_length gauge\n");
+    struct tcp_info info[MAX_THREADS];
+    for(int n = 0; n < numShards; n++){
+        socklen_t length = sizeof(info[n]);
+        if(getsockopt(shards[n].listeningSD, IPPROTO_TCP, TCP_INFO, &info[n], &length) != 0)
+            memset(&info[n], 0, sizeof(info[n]));
+        fprintf(output, "ttts_listen_queue_length{shard=\"%i\"} %u\n", n, info[n].tcpi_unacked);
+    }
+    fprintf(output, "# HELP ttts_listen_queue_limit Backlog of each shard's listening socket, after the kernel's cap.\n# TYPE ttts_listen_queue_limit gauge\n");
+    for(int n = 0; n < numShards; n++)
+        fprintf(output, "ttts_listen_queue_limit{shard=\"%i\"} %u\n", n, info[n].tcpi_sacked);
+    fprintf(output, "# HELP ttts_short_writes_total Reply flushes a game socket only took part of, the rest waits for EPOLLOUT.\n# TYPE ttts_short_writes_total counter\n");
+    fprintf(output, "ttts_short_writes_total %lu\n", SUM_METRIC(shortWrites));
+    fprintf(output, "# HELP ttts_discovery_offers_total Offers sent in reply to discovery multicasts.\n# TYPE ttts_discovery_offers_total counter\n");
+    fprintf(output, "ttts_discovery_offers_total %lu\n", SUM_METRIC(discoveryOffers));
+    if(udpPort != 0){
+        fprintf(output, "# HELP ttts_datagrams_total Datagrams on --udp-port by what became of them.\n# TYPE ttts_datagrams_total counter\n");
+        fprintf(output, "ttts_datagrams_total{result=\"received\"} %lu\n", SUM_METRIC(datagramsReceived));
+        fprintf(output, "ttts_datagrams_total{result=\"stray\"} %lu\n", SUM_METRIC(strayDatagrams));
+        fprintf(output, "ttts_datagrams_total{result=\"dropped\"} %lu\n", SUM_METRIC(datagramsDropped));
+    }
+
+    //collapse the HDR buckets onto powers of two, which line up with their boundaries exactly
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count = 0;
+    for(int bucket = 0; bucket < LATENCY_BUCKETS; bucket++){
+        buckets[bucket] = SUM_METRIC(latencyBuckets[bucket]);
+        count += buckets[bucket];
+    }
+    fprintf(output, "# HELP ttts_reply_latency_seconds Time from a game socket becoming readable to the reply being sent.\n"
+                    "# TYPE ttts_reply_latency_seconds histogram\n");
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    for(int power = 0; power < LATENCY_EXPORTED_POWERS; power++){
+        uint64_t limit = ((uint64_t)1 << power) - 1;
+        for(; bucket < LATENCY_BUCKETS && getLatencyBucketLimit(bucket) <= limit; bucket++)
+            cumulative += buckets[bucket];
+        fprintf(output, "ttts_reply_latency_seconds_bucket{le=\"%.9f\"} %lu\n", (limit + 1) / 1e9, cumulative);
+    }
+    fprintf(output, "ttts_reply_latency_seconds_bucket{le=\"+Inf\"} %lu\n", count);
+    fprintf(output, "ttts_reply_latency_seconds_sum %.9f\n", SUM_METRIC(latencySumNs) / 1e9);
+    fprintf(output, "ttts_reply_latency_seconds_count %lu\n", count);
+
+    //quantiles straight from the full resolution buckets
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    fprintf(output, "# HELP ttts_reply_latency_quantile_seconds Reply latency quantiles, upper bound of the HDR bucket holding them.\n"
+                    "# TYPE ttts_reply_latency_quantile_seconds gauge\n");
+    for(int n = 0; n < sizeof(quantiles) / sizeof(quantiles[0]); n++){
+        uint64_t rank = (uint64_t)(quantiles[n] * count);
+        cumulative = 0;
+        for(bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++){
+            cumulative += buckets[bucket];
+            if(count > 0 && cumulative > rank)
+                break;
+        }
+        fprintf(output, "ttts_reply_latency_quantile_seconds{quantile=\"%g\"} %.9f\n", quantiles[n],
+                count > 0 ? getLatencyBucketLimit(bucket) / 1e9 : 0);
     }
-    return reply;
 }
 
 